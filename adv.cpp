@@ -1,8 +1,10 @@
+#include <infos/kernel/kernel.h>
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
 #include <infos/kernel/log.h>
 #include <infos/util/list.h>
 #include <infos/util/lock.h>
+#include "sched-group.h"
 
 using namespace infos::kernel;
 using namespace infos::util;
@@ -10,10 +12,23 @@ using namespace infos::util;
 // Define the number of priority levels
 #define NUM_PRIORITIES 4
 
+// Picks a level may win in a row while a lower level is waiting, before that level gets one
+#define MAX_CONSECUTIVE 5
+
 /**
- * A Multiple Queue priority scheduling algorithm
+ * A Multiple Queue priority scheduling algorithm, with aging.  Entities are
+ * round-robined within their priority level, and the highest non-empty level
+ * normally wins, but a level that has won MAX_CONSECUTIVE picks in a row
+ * while a lower one waits lets the next lower one have a turn, so that no
+ * level starves.
+ *
+ * Entities are divided into a hierarchy of groups (see SchedGroups).  Each
+ * pick first walks down the hierarchy choosing between sibling groups by
+ * weight, skipping any that have used up their bandwidth quota, and then
+ * takes the next entity from the group it arrives at, so a group's share does
+ * not grow with its number of entities.
  */
-class MultipleQueuePriorityScheduler : public SchedulingAlgorithm
+class AdvancedScheduler : public SchedulingAlgorithm
 {
 public:
     /**
@@ -35,25 +50,12 @@ public:
      */
     void add_to_runqueue(SchedulingEntity& entity) override
     {
-        // Determine the priority level of the entity
-        int priority = entity->priority();
-        if (priority >= NUM_PRIORITIES) {
-            priority = NUM_PRIORITIES - 1;
-        }
-        if (priority = 0) {
-            runqueue0.append(&entity);
-        }
-        if (priority = 1) {
-            runqueue1.append(&entity);
-        }
-        if (priority = 2) {
-            runqueue2.append(&entity);
-        }
-        if (priority = 3) {
-            runqueue3.append(&entity);
-        }
+        UniqueIRQLock l;
 
         // Add the entity to the appropriate run queue
+        unsigned int group = groups.group_of(entity);
+        runqueues[group][level_of(entity)].append(&entity);
+        shares.enqueue(groups, group);
     }
 
     /**
@@ -62,26 +64,17 @@ public:
      */
     void remove_from_runqueue(SchedulingEntity& entity) override
     {
-        // Determine the priority level of the entity
-        int priority = entity->priority();
-        if (priority >= NUM_PRIORITIES) {
-            priority = NUM_PRIORITIES - 1;
-        }
-        if (priority = 0) {
-            runqueue0.remove(&entity);
-        }
-        if (priority = 1) {
-            runqueue1.remove(&entity);
-        }
-        if (priority = 2) {
-            runqueue2.remove(&entity);
-        }
-        if (priority = 3) {
-            runqueue3.remove(&entity);
+        UniqueIRQLock l;
+
+        if (current == &entity) {
+            charge_current();
+            current = NULL;
         }
 
         // Remove the entity from the appropriate run queue
-
+        unsigned int group = groups.group_of(entity);
+        runqueues[group][level_of(entity)].remove(&entity);
+        shares.dequeue(groups, group);
     }
 
     /**
@@ -91,94 +84,174 @@ public:
      */
     SchedulingEntity *pick_next_entity() override
     {
-        
-        SchedulingEntity *next = NULL;
+        charge_current();
 
+        groups.refill(sys.runtime());
+        unsigned int group = shares.pick(groups, current ? current_group : NO_GROUP);
+        if (group == NO_GROUP) {
+            current = NULL;
+            return NULL;
+        }
 
-        /* Select the highest priority non-empty run queue
-         for runque 0, implement first in first out scheduling
-        due to the fact that the runqueue0 contains the highest 
-        priority items that are often realtime, we should implement
-        them in the order that they come in as some tasks may be
-        from user input from a possible graphical interface.
-        */
-        int R0runtimes=0;
-        int R1runtimes=0;
-        int R2runtimes=0;
-        int R3runtimes=0;
+        // Select the highest priority non-empty run queue, unless it has had its turns
+        unsigned int level = NUM_PRIORITIES;
+        for (unsigned int candidate = 0; candidate < NUM_PRIORITIES; candidate++) {
+            if (runqueues[group][candidate].empty()) {
+                continue;
+            }
+            if (level == NUM_PRIORITIES) {
+                level = candidate;
+                if (streak[group][level] < MAX_CONSECUTIVE) {
+                    break;
+                }
+            } else {
+                // Age: the next lower waiting level gets this pick
+                level = candidate;
+                break;
+            }
+        }
 
+        for (unsigned int other = 0; other < NUM_PRIORITIES; other++) {
+            if (other != level) {
+                streak[group][other] = 0;
+            }
+        }
+        streak[group][level]++;
 
+        // Round-robin within the level
+        List<SchedulingEntity*>& runqueue = runqueues[group][level];
+        SchedulingEntity *next = runqueue.first();
+        runqueue.remove(next);
+        runqueue.append(next);
 
-        R0:
-        if (R0runtimes > 5) {
-            R0runtimes=0;
-            goto R1;
-        }
+        current = next;
+        current_group = group;
+        current_runtime = next->cpu_runtime();
+        return next;
+    }
 
-        if (runqueue0.count() > 0) {
-            R0runtimes++;
-            next = &runqueue0.first();
-            runqueue0.remove(next);
-            runqueue0.append(next);
-            goto label1;=]o
-        }
-        if (runqueue0.count() == 0) {
-            R0runtimes = 0;
-        }
-        R1:
-        if (R1runtimes > 5) {
-            R1runtimes--;
-            goto R2;
-        }
-        if (runqueue1.count() > 0) {
-            R1runtimes++;
-            SchedulingEntity *next = &runqueue1.first();
-            runqueue1.remove(*next);
-            runqueue1.append(next);
-            goto label1;
-        }
-        if (runqueue1.count() == 0) {
-            R1runtimes = 0;
+    /**
+     * Creates a scheduling group below parent (ROOT_GROUP for a top level
+     * one), which will share its parent's CPU time with its siblings in
+     * proportion to weight; GROUP_DEFAULT_WEIGHT is what the entities placed
+     * directly in the parent get between them.  Returns the new group's
+     * number, or NO_GROUP.
+     */
+    unsigned int create_group(unsigned int parent, unsigned int weight)
+    {
+        UniqueIRQLock l;
+        return groups.create(parent, weight);
+    }
+
+    /**
+     * Removes a group that has no entities and no groups left in it.
+     */
+    bool destroy_group(unsigned int group)
+    {
+        UniqueIRQLock l;
+        return groups.destroy(group);
+    }
+
+    bool set_group_weight(unsigned int group, unsigned int weight)
+    {
+        UniqueIRQLock l;
+        return groups.set_weight(group, weight);
+    }
+
+    /**
+     * Caps a group, and everything below it, at quota nanoseconds of CPU time
+     * per period.  Once the quota is used up none of it runs until the next
+     * period.  A quota of zero lifts the cap.
+     */
+    bool set_group_bandwidth(unsigned int group, SchedulingEntity::EntityRuntime quota,
+                             SchedulingEntity::EntityRuntime period)
+    {
+        UniqueIRQLock l;
+        return groups.set_bandwidth(group, quota, period, sys.runtime());
+    }
+
+    /**
+     * Moves an entity into a group, requeueing it there if it is runnable.
+     * An entity in any group but ROOT_GROUP must be moved back to the root
+     * before it is destroyed.
+     */
+    bool set_group(SchedulingEntity& entity, unsigned int group)
+    {
+        UniqueIRQLock l;
+
+        if (!groups.exists(group)) {
+            return false;
         }
-        R2:
-        if (R2runtimes > 5) {
-            R2runtimes--;
-            goto R3;
+
+        unsigned int from = groups.group_of(entity);
+        unsigned int level = level_of(entity);
+        bool queued = false;
+        for (SchedulingEntity *e : runqueues[from][level]) {
+            if (e == &entity) {
+                queued = true;
+                break;
+            }
         }
-        if (runqueue2.count() > 0) {
-            R2runtimes++;
-            SchedulingEntity *next = &runqueue2.first();
-            runqueue2.remove(*next);
-            runqueue2.append(next);
-            goto label1;
+
+        if (current == &entity) {
+            charge_current();
         }
-        if (runqueue2.count() == 0) {
-            R2runtimes = 0;
+        if (queued) {
+            runqueues[from][level].remove(&entity);
+            shares.dequeue(groups, from);
         }
-        R3:
-
-        if (runqueue3.count() > 0) {
-            R3runtimes++;
-            SchedulingEntity *next = &runqueue3.first();
-            runqueue3.remove(*next);
-            runqueue3.append(next);
-            goto label1;
-           
+
+        bool moved = groups.set_member(entity, group);
+        unsigned int to = groups.group_of(entity);
+        if (queued) {
+            runqueues[to][level].append(&entity);
+            shares.enqueue(groups, to);
         }
-        if (runqueue3.count() == 0) {
-            R3runtimes = 0;
+        if (current == &entity) {
+            current_group = to;
         }
-        label1:
-        return next;
+        return moved;
+    }
 
+    void group_stats(unsigned int group, GroupStats& out)
+    {
+        UniqueIRQLock l;
+        groups.stats(group, out);
     }
 
 private:
-    // The run queues for each priority level
-    List<SchedulingEntity*> runqueue0;
-    List<SchedulingEntity*> runqueue1;
-    List<SchedulingEntity*> runqueue2;
-    List<SchedulingEntity*> runqueue3;
+    static unsigned int level_of(const SchedulingEntity& entity)
+    {
+        unsigned int level = entity.priority();
+        return level < NUM_PRIORITIES ? level : NUM_PRIORITIES - 1;
+    }
+
+    // Charges the CPU time the entity last picked has used since to its groups
+    void charge_current()
+    {
+        if (!current) {
+            return;
+        }
+
+        SchedulingEntity::EntityRuntime used = current->cpu_runtime() - current_runtime;
+        current_runtime = current->cpu_runtime();
+        shares.charge(groups, current_group, used);
+        groups.charge(current_group, used);
+    }
+
+    // Each group's run queues for each priority level
+    List<SchedulingEntity*> runqueues[MAX_GROUPS][NUM_PRIORITIES];
+
+    // Picks each of a group's levels has won in a row
+    unsigned int streak[MAX_GROUPS][NUM_PRIORITIES] = { };
+
+    SchedGroups groups;
+    GroupShares shares;
+
+    // The entity last picked, its group, and its CPU time when last charged
+    SchedulingEntity *current = NULL;
+    unsigned int current_group = ROOT_GROUP;
+    SchedulingEntity::EntityRuntime current_runtime = 0;
 };
 
 // Register the scheduler
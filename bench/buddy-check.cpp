@@ -0,0 +1,248 @@
+/*
+Host-side check of the buddy allocator's bulk calls.  It runs the real
+buddy-Allocator.cpp in user space over an array of page descriptors,
+takes batches of blocks with alloc_pages_bulk() and gives them back with
+free_pages_bulk(), free_pages(), or both, and checks that:
+
+  - every block handed out is aligned to its order, inside the array,
+    and not part of any other block still held;
+  - no page is lost or counted twice on the way through, with the free
+    pages counted by taking all of them in one bulk call;
+  - once everything has been freed, the free lists have merged back
+    into the largest blocks the array allows.
+
+Batches are freed in the order they were allocated, shuffled, or one
+block at a time, so the merging within a batch and the coalescing with
+the free lists are both covered.  The huge-page reserve is emptied
+first, as it would otherwise hold some order-9 blocks back from the
+final merge.
+
+It uses the same shims as cache-bench.  Build from the top of the tree:
+
+    g++ -std=c++17 -O2 -Ibench/shim bench/buddy-check.cpp -o buddy-check
+
+Usage: buddy-check [rounds [seed]]     (defaults 5000 and 1)
+
+Prints the rounds run and exits with status 0 if every check passed.
+*/
+
+#include "../buddy-Allocator.cpp"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+
+/* Host side of the kernel shims */
+
+infos::kernel::SystemLog infos::kernel::syslog;
+infos::kernel::Kernel infos::kernel::sys;
+ComponentLog infos::mm::mm_log(syslog, "mm");
+
+void ComponentLog::messagef(LogLevel level, const char* fmt, ...)
+{
+    if (level < LogLevel::WARNING)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+// A whole number of the largest blocks, and an odd tail that never merges into one
+static const uint64_t NR_PAGES = (2ull << MAX_ORDER) + 1000;
+static PageDescriptor* pages;
+
+uint64_t PageAllocator::pgd_to_pfn(const PageDescriptor* pgd)
+{
+    return pgd - pages;
+}
+
+PageDescriptor* PageAllocator::pfn_to_pgd(uint64_t pfn)
+{
+    return pages + pfn;
+}
+
+// The zeroing thread is never started here
+void Thread::start()
+{
+    abort();
+}
+
+void Thread::sleep()
+{
+    abort();
+}
+
+void Thread::wake_up()
+{
+    abort();
+}
+
+Thread& Thread::current()
+{
+    abort();
+}
+
+Thread& Process::create_thread(ThreadPrivilege, Thread::thread_proc_t, const char*)
+{
+    abort();
+}
+
+
+#define CHECK(cond, ...) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "buddy-check: " __VA_ARGS__); \
+            fputc('\n', stderr); \
+            exit(1); \
+        } \
+    } while (0)
+
+
+struct Batch
+{
+    std::vector<PageDescriptor*> blocks;
+    int order;
+};
+
+
+// Which batch, if any, holds each page
+static std::vector<uint8_t> held;
+
+static void mark(PageDescriptor* pgd, int order, bool hold)
+{
+    uint64_t pfn = pgd - pages;
+    CHECK(pgd >= pages && pfn + (1ull << order) <= NR_PAGES, "block %p of order %d is outside the array", pgd, order);
+    CHECK(pfn % (1ull << order) == 0, "block at pfn %lu is not aligned to order %d", pfn, order);
+
+    for (uint64_t i = pfn; i < pfn + (1ull << order); i++)
+    {
+        CHECK(held[i] != hold, "page %lu %s", i, hold ? "handed out twice" : "freed twice");
+        held[i] = hold;
+    }
+}
+
+
+// Counts the free pages by taking them all in one bulk call, and gives them back
+static uint64_t count_free(BuddyPageAllocator& alloc)
+{
+    std::vector<PageDescriptor*> all(NR_PAGES);
+    uint64_t got = alloc.alloc_pages_bulk(0, all.data(), all.size());
+    for (uint64_t i = 0; i < got; i++)
+    {
+        mark(all[i], 0, true);
+    }
+    for (uint64_t i = 0; i < got; i++)
+    {
+        mark(all[i], 0, false);
+    }
+
+    CHECK(alloc.allocate_pages(0) == NULL, "a page was left over after taking every free page");
+    alloc.free_pages_bulk(all.data(), got, 0);
+    return got;
+}
+
+
+int main(int argc, char** argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 5000;
+    std::mt19937 rng(argc > 2 ? atoi(argv[2]) : 1);
+
+    pages = new PageDescriptor[NR_PAGES]();
+    held.assign(NR_PAGES, false);
+
+    BuddyPageAllocator alloc;
+    alloc.insert_page_range(pages, NR_PAGES);
+    alloc.set_huge_reserve(0);
+    CHECK(count_free(alloc) == NR_PAGES, "not every page is free after insert_page_range");
+
+    std::vector<Batch> live;
+    uint64_t nr_held = 0;
+
+    for (int round = 0; round < rounds; round++)
+    {
+        if (live.empty() || rng() % 2)
+        {
+            Batch batch;
+            batch.order = rng() % 5;
+            batch.blocks.resize(rng() % 300 + 1);
+
+            uint64_t got = alloc.alloc_pages_bulk(batch.order, batch.blocks.data(), batch.blocks.size());
+            batch.blocks.resize(got);
+            for (auto pgd : batch.blocks)
+            {
+                mark(pgd, batch.order, true);
+            }
+
+            nr_held += got << batch.order;
+            live.push_back(batch);
+        }
+        else
+        {
+            size_t which = rng() % live.size();
+            Batch batch = live[which];
+            live.erase(live.begin() + which);
+
+            for (auto pgd : batch.blocks)
+            {
+                mark(pgd, batch.order, false);
+            }
+            nr_held -= batch.blocks.size() << batch.order;
+
+            switch (rng() % 4)
+            {
+            case 0:
+                for (auto pgd : batch.blocks)
+                {
+                    alloc.free_pages(pgd, batch.order);
+                }
+                break;
+
+            case 1:
+                std::shuffle(batch.blocks.begin(), batch.blocks.end(), rng);
+                alloc.free_pages_bulk(batch.blocks.data(), batch.blocks.size(), batch.order);
+                break;
+
+            default:
+                alloc.free_pages_bulk(batch.blocks.data(), batch.blocks.size(), batch.order);
+                break;
+            }
+        }
+
+        if (round % 100 == 0)
+        {
+            uint64_t nr_free = count_free(alloc);
+            CHECK(nr_free + nr_held == NR_PAGES, "round %d: %lu free and %lu held of %lu pages", round, nr_free, nr_held, NR_PAGES);
+        }
+    }
+
+    for (auto& batch : live)
+    {
+        for (auto pgd : batch.blocks)
+        {
+            mark(pgd, batch.order, false);
+        }
+        alloc.free_pages_bulk(batch.blocks.data(), batch.blocks.size(), batch.order);
+    }
+
+    // Everything is back, so only the largest blocks and the tail should be left
+    PageDescriptor* largest[4];
+    uint64_t nr_largest = alloc.alloc_pages_bulk(MAX_ORDER, largest, 4);
+    CHECK(nr_largest == NR_PAGES >> MAX_ORDER, "%lu blocks of order %d after freeing everything, expected %lu",
+        nr_largest, MAX_ORDER, NR_PAGES >> MAX_ORDER);
+    CHECK(count_free(alloc) == NR_PAGES % (1ull << MAX_ORDER), "the tail did not come back whole");
+    alloc.free_pages_bulk(largest, nr_largest, MAX_ORDER);
+
+    printf("buddy-check: %d rounds, %lu pages, all checks passed\n", rounds, NR_PAGES);
+    return 0;
+}
@@ -0,0 +1,781 @@
+/*
+Host-side benchmark for the block cache.  It runs the real page-cache.cpp
+in user space, on top of a file-backed stand-in for the ATA device with
+a simulated per-command latency.  It replays a block trace through the
+cache and reports the hit ratio, device commands, bytes moved, and
+per-operation latency percentiles.  Every block read back is checked
+against the data last written to it (see fill_block()).
+
+The kernel headers the cache includes are replaced by the small shims
+under bench/shim.  Build from the top of the tree:
+
+    g++ -std=c++17 -O2 -pthread -Ibench/shim bench/cache-bench.cpp page-cache.cpp -o cache-bench
+
+Usage: cache-bench [options]
+
+    --trace seq|zipf|scanhot|FILE   access pattern (default zipf)
+    --ops N                         requests to replay (default 200000)
+    --warmup N                      requests replayed before measuring (default ops/10)
+    --blocks N                      device size in blocks (default 65536)
+    --capacity N                    cache capacity in blocks (default 4096)
+    --extent N                      blocks per synthetic request (default 1)
+    --writes P                      percentage of synthetic requests that write (default 0)
+    --rewrites P                    percentage of writes that store the data already there (default 0)
+    --theta T                       Zipf skew (default 0.99)
+    --hot N                         scanhot: hot set size in blocks (default capacity/2)
+    --hot-share P                   scanhot: percentage of requests to the hot set (default 80)
+    --latency-us N                  simulated time per device command (default 100)
+    --block-ns N                    simulated transfer time per block (default 1000)
+    --threads N                     replay threads (default 1)
+    --queue                         put a BlockRequestQueue between cache and device
+    --verify hit|scrub|both         turn on block checksums (see PageCache::set_verify())
+    --tier N                        compressed second tier of up to N KiB (default off)
+    --snapshot                      afterwards, save a warm-cache snapshot, prewarm a fresh
+                                    cache from it, and replay the requests again on that
+    --device FILE                   backing file, overwritten (default: a temporary file)
+    --seed N                        random seed (default 1)
+
+With --snapshot the device gets a snapshot region after its last block,
+which the trace never touches.  The second replay shows how close a
+prewarmed cache starts to the steady state of the first.
+
+A recorded trace is a text file with one request per line, "R <offset>
+<count>" or "W <offset> <count>"; lines starting with '#' are skipped.
+*/
+
+#include <infos/drivers/ata/page-cache.h>
+#include <infos/mm/pgalloc-ext.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+
+/* Host side of the kernel shims */
+
+infos::kernel::SystemLog infos::kernel::syslog;
+infos::kernel::Kernel infos::kernel::sys;
+
+void ComponentLog::messagef(LogLevel level, const char* fmt, ...)
+{
+    if (level < LogLevel::WARNING)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+PageDescriptor* PageAllocator::alloc_pages(int order)
+{
+    PageDescriptor* pgd = new PageDescriptor;
+    pgd->base = aligned_alloc(4096, (size_t)4096 << order);
+    return pgd;
+}
+
+void PageAllocator::free_pages(PageDescriptor* pgd, int)
+{
+    free(pgd->base);
+    delete pgd;
+}
+
+static thread_local Thread* current_thread;
+
+// Kernel threads that have not returned yet, by name, so a pass can wait for the prewarm thread
+static std::mutex running_lock;
+static std::condition_variable running_done;
+static std::map<std::string, unsigned int> running;
+
+void Thread::start()
+{
+    {
+        std::lock_guard<std::mutex> l(running_lock);
+        running[name_]++;
+    }
+
+    std::thread([this]
+    {
+        current_thread = this;
+        proc_(NULL);
+
+        std::lock_guard<std::mutex> l(running_lock);
+        running[name_]--;
+        running_done.notify_all();
+    }).detach();
+}
+
+static void wait_for_threads(const char* name)
+{
+    std::unique_lock<std::mutex> l(running_lock);
+    running_done.wait(l, [name] { return running[name] == 0; });
+}
+
+void Thread::sleep()
+{
+    std::unique_lock<std::mutex> l(lock_);
+    cv_.wait(l, [this] { return woken_; });
+    woken_ = false;
+}
+
+void Thread::wake_up()
+{
+    std::lock_guard<std::mutex> l(lock_);
+    woken_ = true;
+    cv_.notify_one();
+}
+
+Thread& Thread::current()
+{
+    // Replay threads are plain std::threads, which get a Thread of their own to sleep on
+    static thread_local Thread self(NULL);
+    return current_thread ? *current_thread : self;
+}
+
+Thread& Process::create_thread(ThreadPrivilege, Thread::thread_proc_t proc, const char* name)
+{
+    return *new Thread(proc, name ? name : "");
+}
+
+// The host's page allocator above is a plain one, which never runs short
+// of pages, so it has no shrinkers to ask for any
+PageAllocatorExtensions* pgalloc_ext;
+
+void register_shrinker(MemoryShrinker*)
+{
+}
+
+void unregister_shrinker(MemoryShrinker*)
+{
+}
+
+
+/*
+Block contents.  A block holds its offset and a version number (0 until
+it is first written), a quarter of pseudo-random bytes derived from the
+two, and a short repeating pattern for the rest, so that it compresses
+about as well as ordinary file data and no two versions are alike.
+*/
+static void fill_block(uint8_t* block, uint32_t offset, uint32_t version)
+{
+    uint64_t x = ((uint64_t)offset << 32 | version) * 0x9e3779b97f4a7c15ull + 1;
+
+    memcpy(block, &offset, sizeof(offset));
+    memcpy(block + 4, &version, sizeof(version));
+    for (size_t i = 8; i < BLOCK_SIZE / 4; i += 8)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(block + i, &x, 8);
+    }
+    for (size_t i = BLOCK_SIZE / 4; i < BLOCK_SIZE; i++)
+    {
+        block[i] = (uint8_t)(x >> (i % 8 * 8));
+    }
+}
+
+
+// Returns the version a block read from offset holds, or -1 if it is not one fill_block() made
+static int64_t check_block(const uint8_t* block, uint32_t offset)
+{
+    uint32_t version;
+    uint8_t expected[BLOCK_SIZE];
+
+    memcpy(&version, block + 4, sizeof(version));
+    fill_block(expected, offset, version);
+    return memcmp(block, expected, BLOCK_SIZE) ? -1 : version;
+}
+
+
+/*
+The ATA device stand-in.  Blocks live in a file; every command costs
+latency_ns plus block_ns per block, spent spinning with the device
+held, since the real device runs one command at a time.
+*/
+class FileBlockDevice : public CacheBackingStore
+{
+    public:
+    FileBlockDevice(const char* path, uint32_t nr_blocks, uint64_t latency_ns, uint64_t block_ns)
+        : nr_blocks_(nr_blocks), latency_ns_(latency_ns), block_ns_(block_ns)
+    {
+        if (path)
+        {
+            fd_ = open(path, O_RDWR | O_CREAT, 0644);
+        }
+        else
+        {
+            char name[] = "/tmp/cache-bench-XXXXXX";
+            fd_ = mkstemp(name);
+            unlink(name);
+        }
+
+        if (fd_ < 0 || ftruncate(fd_, (off_t)nr_blocks * BLOCK_SIZE) < 0)
+        {
+            perror("cache-bench: device");
+            exit(1);
+        }
+
+        // Every block starts out as version 0
+        std::vector<uint8_t> chunk(256 * BLOCK_SIZE);
+        for (uint32_t lba = 0; lba < nr_blocks; lba += 256)
+        {
+            uint32_t count = nr_blocks - lba < 256 ? nr_blocks - lba : 256;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                fill_block(&chunk[i * BLOCK_SIZE], lba + i, 0);
+            }
+            if (pwrite(fd_, chunk.data(), count * BLOCK_SIZE, (off_t)lba * BLOCK_SIZE) != (ssize_t)(count * BLOCK_SIZE))
+            {
+                perror("cache-bench: device");
+                exit(1);
+            }
+        }
+    }
+
+    ~FileBlockDevice() { close(fd_); }
+
+    bool fetch_blocks(void* buffer, uint64_t lba, size_t count) override
+    {
+        if (lba + count > nr_blocks_)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> l(lock_);
+        simulate(count);
+        reads++;
+        blocks_read += count;
+        return pread(fd_, buffer, count * BLOCK_SIZE, (off_t)lba * BLOCK_SIZE) == (ssize_t)(count * BLOCK_SIZE);
+    }
+
+    bool store_blocks(const void* buffer, uint64_t lba, size_t count) override
+    {
+        if (lba + count > nr_blocks_)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> l(lock_);
+        simulate(count);
+        writes++;
+        blocks_written += count;
+        return pwrite(fd_, buffer, count * BLOCK_SIZE, (off_t)lba * BLOCK_SIZE) == (ssize_t)(count * BLOCK_SIZE);
+    }
+
+    void reset_counters()
+    {
+        reads = writes = blocks_read = blocks_written = 0;
+    }
+
+    std::atomic<uint64_t> reads { 0 };
+    std::atomic<uint64_t> writes { 0 };
+    std::atomic<uint64_t> blocks_read { 0 };
+    std::atomic<uint64_t> blocks_written { 0 };
+
+    private:
+    void simulate(size_t count)
+    {
+        auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(latency_ns_ + block_ns_ * count);
+        while (std::chrono::steady_clock::now() < until)
+        {
+            __builtin_ia32_pause();
+        }
+    }
+
+    int fd_;
+    uint32_t nr_blocks_;
+    uint64_t latency_ns_;
+    uint64_t block_ns_;
+    std::mutex lock_;
+};
+
+
+struct TraceOp
+{
+    bool write;
+    bool rewrite; // stores what the blocks already hold
+    uint32_t offset;
+    uint32_t count;
+};
+
+
+/*
+The data every block should hold: the version last written to it.  With
+one replay thread reads must return exactly that; with more, requests
+for the same block race, so a read is only checked for being a whole
+version of the right block.
+*/
+struct Model
+{
+    Model(uint32_t nr_blocks) : versions(nr_blocks) { }
+
+    std::vector<std::atomic<uint32_t>> versions;
+    std::atomic<uint32_t> next_version { 1 };
+    std::atomic<uint64_t> checked { 0 };
+    std::atomic<uint64_t> corrupt { 0 };
+    std::atomic<uint64_t> stale { 0 };
+};
+
+struct Options
+{
+    std::string trace = "zipf";
+    size_t ops = 200000;
+    size_t warmup = (size_t)-1;
+    uint32_t blocks = 65536;
+    size_t capacity = 4096;
+    uint32_t extent = 1;
+    unsigned int writes = 0;
+    unsigned int rewrites = 0;
+    double theta = 0.99;
+    size_t hot = 0;
+    unsigned int hot_share = 80;
+    uint64_t latency_us = 100;
+    uint64_t block_ns = 1000;
+    unsigned int threads = 1;
+    bool queue = false;
+    bool snapshot = false;
+    uint8_t verify = 0;
+    size_t tier_kib = 0;
+    const char* device = NULL;
+    unsigned int seed = 1;
+};
+
+
+/*
+Draws ranks from a Zipf distribution over n items by binary search of
+the CDF.  Rank r is spread over the device by multiplying by a large
+odd constant, so the hot blocks are not all neighbours.
+*/
+class ZipfGenerator
+{
+    public:
+    ZipfGenerator(uint32_t n, double theta) : cdf_(n)
+    {
+        double sum = 0;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            sum += 1.0 / std::pow((double)(i + 1), theta);
+            cdf_[i] = sum;
+        }
+        for (auto& c : cdf_)
+        {
+            c /= sum;
+        }
+    }
+
+    uint32_t next(std::mt19937_64& rng)
+    {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        uint32_t rank = std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+        return (uint32_t)(((uint64_t)rank * 2654435761u) % cdf_.size());
+    }
+
+    private:
+    std::vector<double> cdf_;
+};
+
+
+static std::vector<TraceOp> load_trace(const char* path)
+{
+    std::vector<TraceOp> trace;
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        perror("cache-bench: trace");
+        exit(1);
+    }
+
+    char line[128];
+    while (fgets(line, sizeof(line), f))
+    {
+        char kind;
+        unsigned int offset, count;
+        if (line[0] == '#' || sscanf(line, " %c %u %u", &kind, &offset, &count) != 3)
+        {
+            continue;
+        }
+        trace.push_back({ kind == 'W' || kind == 'w', false, offset, count });
+    }
+
+    fclose(f);
+    return trace;
+}
+
+
+static std::vector<TraceOp> make_trace(const Options& opt, size_t nr_ops)
+{
+    if (opt.trace != "seq" && opt.trace != "zipf" && opt.trace != "scanhot")
+    {
+        // Requests running past the end of the device are dropped; they could only fail
+        std::vector<TraceOp> trace = load_trace(opt.trace.c_str());
+        trace.erase(std::remove_if(trace.begin(), trace.end(),
+                                   [&](const TraceOp& op) { return (uint64_t)op.offset + op.count > opt.blocks; }),
+                    trace.end());
+        return trace;
+    }
+
+    std::mt19937_64 rng(opt.seed);
+    std::vector<TraceOp> trace;
+    uint32_t nr_extents = opt.blocks / opt.extent;
+    size_t hot = opt.hot ? opt.hot : opt.capacity / 2;
+    uint32_t scan = 0;
+    ZipfGenerator* zipf = opt.trace == "zipf" ? new ZipfGenerator(nr_extents, opt.theta) : NULL;
+
+    for (size_t i = 0; i < nr_ops; i++)
+    {
+        uint32_t offset;
+
+        if (opt.trace == "seq")
+        {
+            offset = (uint32_t)((i % nr_extents) * opt.extent);
+        }
+        else if (zipf)
+        {
+            offset = zipf->next(rng) * opt.extent;
+        }
+        else if (rng() % 100 < opt.hot_share)
+        {
+            // The hot set sits at the top of the device, clear of the scan's start
+            offset = opt.blocks - opt.extent - (uint32_t)(rng() % (hot / opt.extent + 1)) * opt.extent;
+        }
+        else
+        {
+            offset = scan;
+            scan = (scan + opt.extent) % (nr_extents * opt.extent);
+        }
+
+        bool write = rng() % 100 < opt.writes;
+        trace.push_back({ write, write && rng() % 100 < opt.rewrites, offset, opt.extent });
+    }
+
+    delete zipf;
+    return trace;
+}
+
+
+// Records the versions op wrote, or checks the blocks it read
+static void check_op(const TraceOp& op, const uint8_t* buffer, bool exact, Model& model)
+{
+    for (uint32_t j = 0; j < op.count; j++)
+    {
+        uint32_t offset = op.offset + j;
+        int64_t version = check_block(buffer + j * BLOCK_SIZE, offset);
+
+        if (op.write)
+        {
+            model.versions[offset] = (uint32_t)version;
+            continue;
+        }
+
+        model.checked++;
+        if (version < 0)
+        {
+            if (model.corrupt++ == 0)
+            {
+                fprintf(stderr, "cache-bench: block %u read back corrupt\n", offset);
+            }
+        }
+        else if (exact && version != model.versions[offset])
+        {
+            if (model.stale++ == 0)
+            {
+                fprintf(stderr, "cache-bench: block %u read back version %u, wrote %u\n", offset, (uint32_t)version,
+                        model.versions[offset].load());
+            }
+        }
+    }
+}
+
+
+/*
+Replays ops[first], ops[first + stride], ... and records each one's
+latency.  A write stores a new version of its blocks, or for a rewrite
+the version they hold; what a read returns is checked against model.
+*/
+static void replay(PageCache& cache, const std::vector<TraceOp>& ops, size_t first, size_t stride,
+                   std::vector<uint64_t>* latencies, std::atomic<uint64_t>& failures, Model& model)
+{
+    std::vector<uint8_t> buffer;
+
+    for (size_t i = first; i < ops.size(); i += stride)
+    {
+        const TraceOp& op = ops[i];
+        buffer.resize(op.count * BLOCK_SIZE);
+
+        uint32_t new_version = op.write && !op.rewrite ? model.next_version++ : 0;
+        for (uint32_t j = 0; op.write && j < op.count; j++)
+        {
+            uint32_t version = op.rewrite ? model.versions[op.offset + j].load() : new_version;
+            fill_block(&buffer[j * BLOCK_SIZE], op.offset + j, version);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = op.write ? cache.write_extent(buffer.data(), op.offset, op.count)
+                           : cache.read_extent(buffer.data(), op.offset, op.count);
+        auto end = std::chrono::steady_clock::now();
+
+        if (!ok)
+        {
+            failures++;
+        }
+        else
+        {
+            check_op(op, buffer.data(), stride == 1, model);
+        }
+        if (latencies)
+        {
+            latencies->push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        }
+    }
+}
+
+
+static void run_threads(PageCache& cache, const std::vector<TraceOp>& ops, unsigned int nr_threads,
+                        std::vector<std::vector<uint64_t>>* latencies, std::atomic<uint64_t>& failures, Model& model)
+{
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < nr_threads; t++)
+    {
+        threads.emplace_back(replay, std::ref(cache), std::cref(ops), t, nr_threads,
+                             latencies ? &(*latencies)[t] : NULL, std::ref(failures), std::ref(model));
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+}
+
+
+static double percentile_us(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: cache-bench [--trace seq|zipf|scanhot|FILE] [--ops N] [--warmup N] [--blocks N]\n"
+                    "                   [--capacity N] [--extent N] [--writes P] [--rewrites P] [--theta T]\n"
+                    "                   [--hot N] [--hot-share P] [--latency-us N] [--block-ns N]\n"
+                    "                   [--threads N] [--queue] [--verify hit|scrub|both] [--tier N]\n"
+                    "                   [--snapshot] [--device FILE] [--seed N]\n");
+    exit(1);
+}
+
+
+static Options parse_options(int argc, char** argv)
+{
+    Options opt;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--queue")
+        {
+            opt.queue = true;
+            continue;
+        }
+        if (arg == "--snapshot")
+        {
+            opt.snapshot = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage();
+        }
+
+        const char* value = argv[++i];
+        if (arg == "--trace") opt.trace = value;
+        else if (arg == "--ops") opt.ops = strtoull(value, NULL, 0);
+        else if (arg == "--warmup") opt.warmup = strtoull(value, NULL, 0);
+        else if (arg == "--blocks") opt.blocks = strtoul(value, NULL, 0);
+        else if (arg == "--capacity") opt.capacity = strtoull(value, NULL, 0);
+        else if (arg == "--extent") opt.extent = strtoul(value, NULL, 0);
+        else if (arg == "--writes") opt.writes = strtoul(value, NULL, 0);
+        else if (arg == "--rewrites") opt.rewrites = strtoul(value, NULL, 0);
+        else if (arg == "--theta") opt.theta = strtod(value, NULL);
+        else if (arg == "--hot") opt.hot = strtoull(value, NULL, 0);
+        else if (arg == "--hot-share") opt.hot_share = strtoul(value, NULL, 0);
+        else if (arg == "--latency-us") opt.latency_us = strtoull(value, NULL, 0);
+        else if (arg == "--block-ns") opt.block_ns = strtoull(value, NULL, 0);
+        else if (arg == "--threads") opt.threads = strtoul(value, NULL, 0);
+        else if (arg == "--device") opt.device = value;
+        else if (arg == "--verify") opt.verify = !strcmp(value, "hit") ? VERIFY_ON_HIT : !strcmp(value, "scrub") ? VERIFY_SCRUB
+                                               : !strcmp(value, "both") ? VERIFY_ON_HIT | VERIFY_SCRUB : (usage(), 0);
+        else if (arg == "--tier") opt.tier_kib = strtoull(value, NULL, 0);
+        else if (arg == "--seed") opt.seed = strtoul(value, NULL, 0);
+        else usage();
+    }
+
+    if (opt.extent == 0 || opt.extent > opt.blocks || opt.threads == 0)
+    {
+        usage();
+    }
+    if (opt.warmup == (size_t)-1)
+    {
+        opt.warmup = opt.ops / 10;
+    }
+
+    return opt;
+}
+
+
+static void setup_cache(PageCache& cache, const Options& opt, CacheBackingStore* store, uint32_t snapshot_blocks)
+{
+    cache.init();
+    cache.set_backing_store(store);
+    cache.set_capacity(opt.capacity);
+    cache.set_verify(opt.verify);
+    if (opt.tier_kib)
+    {
+        cache.enable_tier(opt.tier_kib * 1024);
+    }
+    if (snapshot_blocks)
+    {
+        cache.set_snapshot_region(opt.blocks, snapshot_blocks);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    Options opt = parse_options(argc, argv);
+
+    // Room for a key per cached block after the header
+    uint32_t snapshot_blocks = opt.snapshot ? 1 + (opt.capacity + SNAPSHOT_ENTRIES_PER_BLOCK - 1) / SNAPSHOT_ENTRIES_PER_BLOCK : 0;
+
+    FileBlockDevice device(opt.device, opt.blocks + snapshot_blocks, opt.latency_us * 1000, opt.block_ns);
+    BlockRequestQueue queue(&device);
+
+    PageCache cache;
+    setup_cache(cache, opt, opt.queue ? (CacheBackingStore*)&queue : &device, snapshot_blocks);
+
+    std::vector<TraceOp> trace = make_trace(opt, opt.warmup + opt.ops);
+    if (trace.size() <= opt.warmup)
+    {
+        opt.warmup = 0;
+    }
+
+    std::vector<TraceOp> warmup(trace.begin(), trace.begin() + opt.warmup);
+    std::vector<TraceOp> measured(trace.begin() + opt.warmup, trace.end());
+    std::atomic<uint64_t> failures { 0 };
+    Model model(opt.blocks);
+
+    run_threads(cache, warmup, opt.threads, NULL, failures, model);
+
+    cache.reset_stats();
+    device.reset_counters();
+
+    std::vector<std::vector<uint64_t>> latencies(opt.threads);
+    auto start = std::chrono::steady_clock::now();
+    run_threads(cache, measured, opt.threads, &latencies, failures, model);
+    bool flushed = cache.flush();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint64_t> all;
+    for (auto& l : latencies)
+    {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    uint64_t blocks_requested = 0;
+    uint64_t nr_writes = 0;
+    for (auto& op : measured)
+    {
+        blocks_requested += op.count;
+        nr_writes += op.write;
+    }
+
+    CacheStats stats;
+    cache.stats(stats);
+    uint64_t lookups = stats.counters[CACHE_HITS] + stats.counters[CACHE_MISSES];
+
+    printf("trace            %s, %lu requests (+%lu warmup), %u thread(s)%s\n", opt.trace.c_str(),
+           (unsigned long)measured.size(), (unsigned long)opt.warmup, opt.threads, opt.queue ? ", request queue" : "");
+    printf("cache            %lu blocks, device %u blocks\n", (unsigned long)cache.capacity(), opt.blocks);
+    if (opt.verify)
+    {
+        printf("checksums        %lu bad blocks, %lu refetched\n", (unsigned long)stats.counters[CACHE_CHECKSUM_ERRORS],
+               (unsigned long)stats.counters[CACHE_REFETCHES]);
+    }
+    if (opt.tier_kib)
+    {
+        printf("compressed tier  %lu hits, %lu stored, %lu rejected, %lu KiB in use\n",
+               (unsigned long)stats.counters[CACHE_TIER_HITS], (unsigned long)stats.counters[CACHE_TIER_STORES],
+               (unsigned long)stats.counters[CACHE_TIER_REJECTS], (unsigned long)(cache.tier()->bytes() / 1024));
+    }
+    printf("hit ratio        %.4f (%lu hits, %lu misses, %lu coalesced)\n",
+           lookups ? (double)stats.counters[CACHE_HITS] / lookups : 0.0, (unsigned long)stats.counters[CACHE_HITS],
+           (unsigned long)stats.counters[CACHE_MISSES], (unsigned long)stats.counters[CACHE_COALESCED_MISSES]);
+    if (nr_writes)
+    {
+        printf("writes           %lu requests, %lu blocks already held and dropped\n", (unsigned long)nr_writes,
+               (unsigned long)stats.counters[CACHE_CLEAN_REWRITES]);
+    }
+    printf("device I/Os      %lu reads (%lu blocks), %lu writes (%lu blocks)\n",
+           (unsigned long)device.reads, (unsigned long)device.blocks_read,
+           (unsigned long)device.writes, (unsigned long)device.blocks_written);
+    printf("bytes moved      %lu requested by callers, %lu to/from device\n", (unsigned long)(blocks_requested * BLOCK_SIZE),
+           (unsigned long)((device.blocks_read + device.blocks_written) * BLOCK_SIZE));
+    printf("data check       %lu blocks read back, %lu corrupt, %lu stale%s\n", (unsigned long)model.checked,
+           (unsigned long)model.corrupt, (unsigned long)model.stale, opt.threads > 1 ? " (not checked with threads)" : "");
+    printf("latency (us)     p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", percentile_us(all, 50),
+           percentile_us(all, 90), percentile_us(all, 99), percentile_us(all, 99.9), percentile_us(all, 100));
+    printf("throughput       %.0f requests/s\n", measured.size() / seconds);
+
+    // flush() above saved the snapshot; a fresh cache starts from it, as after a reboot
+    if (opt.snapshot)
+    {
+        PageCache warm;
+        setup_cache(warm, opt, opt.queue ? (CacheBackingStore*)&queue : &device, snapshot_blocks);
+        bool prewarmed = warm.prewarm();
+        wait_for_threads("cache-prewarm");
+
+        warm.stats(stats);
+        uint64_t nr_prewarmed = stats.counters[CACHE_PREWARMED];
+        warm.reset_stats();
+
+        run_threads(warm, measured, opt.threads, NULL, failures, model);
+        flushed &= warm.flush();
+
+        warm.stats(stats);
+        lookups = stats.counters[CACHE_HITS] + stats.counters[CACHE_MISSES];
+        printf("warm restart     %.4f hit ratio on the same requests, %lu blocks prewarmed%s\n",
+               lookups ? (double)stats.counters[CACHE_HITS] / lookups : 0.0, (unsigned long)nr_prewarmed,
+               prewarmed ? "" : " (no snapshot)");
+    }
+
+    if (failures || !flushed || model.corrupt || model.stale)
+    {
+        printf("failures         %lu requests%s\n", (unsigned long)failures, flushed ? "" : ", flush failed");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+namespace infos { namespace arch { namespace x86 { } } }
@@ -0,0 +1,3 @@
+#pragma once
+
+namespace infos { namespace drivers { namespace ata { class ATAController { }; } } }
@@ -0,0 +1,8 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+namespace infos { namespace drivers {
+namespace block { class BlockDevice { }; }
+namespace ata { class ATADevice { }; }
+} }
@@ -0,0 +1,3 @@
+#pragma once
+// The cache under test, from the top of the tree
+#include "../../../../../page-cache.h"
@@ -0,0 +1,22 @@
+#pragma once
+#include <assert.h>
+#include <infos/kernel/log.h>
+#include <infos/kernel/thread.h>
+#include <infos/mm/mm.h>
+
+namespace infos { namespace kernel {
+
+class Kernel
+{
+public:
+    infos::mm::MemoryManager& mm() { return mm_; }
+    Process& kernel_process() { return kernel_process_; }
+
+private:
+    infos::mm::MemoryManager mm_;
+    Process kernel_process_;
+};
+
+extern Kernel sys;
+
+} }
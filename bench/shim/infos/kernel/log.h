@@ -0,0 +1,18 @@
+#pragma once
+
+namespace infos { namespace kernel {
+
+enum class LogLevel { DEBUG, INFO, WARNING, ERROR, FATAL };
+
+class SystemLog { };
+extern SystemLog syslog;
+
+// Debug output would swamp the numbers, so only errors are printed
+class ComponentLog
+{
+public:
+    ComponentLog(SystemLog&, const char*) { }
+    void messagef(LogLevel level, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+};
+
+} }
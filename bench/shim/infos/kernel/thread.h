@@ -0,0 +1,43 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace infos { namespace kernel {
+
+enum class ThreadPrivilege { User, Kernel };
+
+namespace SchedulingEntityPriority
+{
+    enum SchedulingEntityPriority { REALTIME, INTERACTIVE, NORMAL, DAEMON };
+}
+
+// Kernel threads become detached std::threads
+class Thread
+{
+public:
+    typedef void (*thread_proc_t)(void*);
+
+    Thread(thread_proc_t proc, const char* name = "") : proc_(proc), name_(name) { }
+
+    void start();
+    void priority(SchedulingEntityPriority::SchedulingEntityPriority) { }
+    void sleep();
+    void wake_up();
+    static Thread& current();
+
+private:
+    thread_proc_t proc_;
+    const char* name_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+    bool woken_ = false;
+};
+
+class Process
+{
+public:
+    Thread& create_thread(ThreadPrivilege, Thread::thread_proc_t proc, const char* name = 0);
+};
+
+} }
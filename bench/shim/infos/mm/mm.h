@@ -0,0 +1,18 @@
+#pragma once
+#include <infos/kernel/log.h>
+#include <infos/mm/page-allocator.h>
+
+namespace infos { namespace mm {
+
+class MemoryManager
+{
+public:
+    PageAllocator& pgalloc() { return pgalloc_; }
+
+private:
+    PageAllocator pgalloc_;
+};
+
+extern infos::kernel::ComponentLog mm_log;
+
+} }
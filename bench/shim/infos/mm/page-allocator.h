@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+namespace infos { namespace mm {
+
+struct PageDescriptor
+{
+    void* base;
+    PageDescriptor* next_free;
+};
+
+// Pages come from the host heap, or from a descriptor array a bench sets up
+class PageAllocator
+{
+public:
+    PageDescriptor* alloc_pages(int order);
+    void free_pages(PageDescriptor* pgd, int order);
+    void* pgd_to_vpa(const PageDescriptor* pgd) { return pgd->base; }
+    uint64_t pgd_to_pfn(const PageDescriptor* pgd);
+    PageDescriptor* pfn_to_pgd(uint64_t pfn);
+};
+
+class PageAllocatorAlgorithm
+{
+public:
+    virtual ~PageAllocatorAlgorithm() { }
+
+    virtual bool init(PageDescriptor* page_descriptors, uint64_t nr_page_descriptors) = 0;
+    virtual PageDescriptor* allocate_pages(int order) = 0;
+    virtual void free_pages(PageDescriptor* pgd, int order) = 0;
+    virtual void insert_page_range(PageDescriptor* start, uint64_t count) = 0;
+    virtual void remove_page_range(PageDescriptor* start, uint64_t count) = 0;
+    virtual const char* name() const = 0;
+    virtual void dump_state() const = 0;
+};
+
+} }
+
+// A bench makes its own instance of the algorithm it tests
+#define RegisterPageAllocator(_class)
@@ -0,0 +1,3 @@
+#pragma once
+// The page allocator's extensions, from the top of the tree
+#include "../../../../pgalloc-ext.h"
@@ -0,0 +1,20 @@
+#pragma once
+#include <list>
+
+namespace infos { namespace util {
+
+template<typename T>
+class List
+{
+public:
+    void append(const T& v) { l_.push_back(v); }
+    void remove(const T& v) { l_.remove(v); }
+    size_t count() const { return l_.size(); }
+    typename std::list<T>::iterator begin() { return l_.begin(); }
+    typename std::list<T>::iterator end() { return l_.end(); }
+
+private:
+    std::list<T> l_;
+};
+
+} }
@@ -0,0 +1,35 @@
+#pragma once
+#include <mutex>
+
+namespace infos { namespace util {
+
+class Mutex
+{
+public:
+    void lock() { m_.lock(); }
+    bool try_lock() { return m_.try_lock(); }
+    void unlock() { m_.unlock(); }
+
+private:
+    std::mutex m_;
+};
+
+template<typename L>
+class UniqueLock
+{
+public:
+    UniqueLock(L& l) : l_(l) { l_.lock(); }
+    ~UniqueLock() { l_.unlock(); }
+
+private:
+    L& l_;
+};
+
+// No interrupts in user space; Thread::sleep() below cannot miss a wake_up() anyway
+class UniqueIRQLock
+{
+public:
+    UniqueIRQLock() { }
+};
+
+} }
@@ -0,0 +1,18 @@
+#pragma once
+#include <map>
+
+namespace infos { namespace util {
+
+template<typename K, typename V>
+class Map
+{
+public:
+    void add(K k, V v) { m_[k] = v; }
+    bool try_get_value(K k, V& v) const { auto i = m_.find(k); if (i == m_.end()) return false; v = i->second; return true; }
+    void remove(K k) { m_.erase(k); }
+
+private:
+    std::map<K, V> m_;
+};
+
+} }
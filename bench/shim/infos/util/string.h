@@ -0,0 +1,4 @@
+#pragma once
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
@@ -5,8 +5,12 @@
 
 #include <infos/mm/page-allocator.h>
 #include <infos/mm/mm.h>
+#include <infos/mm/pgalloc-ext.h>
 #include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
+#include <infos/kernel/thread.h>
+#include <infos/util/list.h>
+#include <infos/util/lock.h>
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
 
@@ -17,11 +21,31 @@ using namespace infos::util;
 #define MAX_ORDER	18
 // #define DEBUGPRINT
 
+#define BYTES_PER_PAGE	4096
+
+// Zeroed order-0 pages the zeroing thread keeps ready, and the level that wakes it to refill them
+#define ZERO_POOL_TARGET	256
+#define ZERO_POOL_LOW		64
+
+// Pages the zeroing thread takes from the free lists at a time
+#define ZERO_BATCH	16
+
+// The order of a 2 MiB huge page, and how many blocks of it are held back from small allocations by default
+#define HUGE_ORDER		9
+#define HUGE_RESERVE_DEFAULT	8
+
+class BuddyPageAllocator;
+
+PageAllocatorExtensions *pgalloc_ext;
+
+// The allocator whose pool the zeroing thread refills; thread procedures are passed no argument
+static BuddyPageAllocator *zeroing_allocator;
+static void zero_worker_main(void *);
 
 /**
  * A buddy page allocation algorithm.
  */
-class BuddyPageAllocator : public PageAllocatorAlgorithm
+class BuddyPageAllocator : public PageAllocatorAlgorithm, public PageAllocatorExtensions
 {
 private:
 
@@ -259,7 +283,207 @@ current block.
 		return insert_block(left_block, target_order);
 	}
 
+	/**
+	 * Returns the lowest order, at or above the given order, that has a free block.
+	 * @param order The order to start searching from.
+	 * @return Returns the order found, or MAX_ORDER + 1 if every free list from order upwards is empty.
+	 */
+	int first_free_order(int order) const
+	{
+		while (order <= MAX_ORDER && _free_areas[order] == NULL) {
+			order++;
+		}
+		return order;
+	}
+
+	/**
+	 * Frees an ascending run of blocks of the same order.  Each pass merges pairs of buddies
+	 * within the run into the order above, packing them at the front of the array, where they
+	 * stay in ascending order for the next pass, and frees the blocks without a buddy in the
+	 * run, which coalesce with what is already on the free lists.
+	 * @param pgds The first page descriptor of each block, in ascending order.  The array is
+	 * used as scratch space.
+	 * @param count The number of blocks in pgds.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 */
+	void free_block_run(PageDescriptor **pgds, uint64_t count, int order)
+	{
+		while (count > 0) {
+			uint64_t merged = 0;
+			for (uint64_t i = 0; i < count; i++) {
+				assert(is_correct_alignment_for_order(pgds[i], order));
+
+				if (order < MAX_ORDER && i + 1 < count && is_correct_alignment_for_order(pgds[i], order + 1) &&
+						pgds[i + 1] == pgds[i] + pages_per_block(order)) {
+					pgds[merged++] = pgds[i++];
+				} else {
+					insert_block(pgds[i], order);
+					CoalesceResult result = coalesce(pgds[i], order);
+					replenish_huge_reserve(result.pgd, result.order);
+				}
+			}
+
+			count = merged;
+			order++;
+		}
+	}
+
+	/**
+	 * Zero-fills a block.  Non-temporal stores write the zeroes straight out to memory rather
+	 * than through the cache, which suits the zeroing thread, whose pages will not be touched
+	 * again until some later fault.  Callers that use them must sfence before the block is
+	 * handed out.  Stays in general-purpose registers, as kernel code may not touch SSE state.
+	 * @param pgd The first page descriptor of the block.
+	 * @param order The order of the block.
+	 * @param non_temporal Whether to use non-temporal stores, if the CPU has them.
+	 */
+	void zero_block(PageDescriptor *pgd, int order, bool non_temporal)
+	{
+		uint64_t *p = (uint64_t *)sys.mm().pgalloc().pgd_to_vpa(pgd);
+		uint64_t n = pages_per_block(order) * (BYTES_PER_PAGE / sizeof(uint64_t));
+
+		if (non_temporal && _has_movnti) {
+			for (uint64_t i = 0; i < n; i += 4) {
+				asm volatile("movnti %4, %0\n\tmovnti %4, %1\n\tmovnti %4, %2\n\tmovnti %4, %3"
+						: "=m"(p[i]), "=m"(p[i + 1]), "=m"(p[i + 2]), "=m"(p[i + 3]) : "r"((uint64_t)0));
+			}
+		} else {
+			asm volatile("rep stosq" : "+D"(p), "+c"(n) : "a"((uint64_t)0) : "memory");
+		}
+	}
+
+	/**
+	 * Takes a page from the zeroed pool, and asks for a refill if that leaves the pool low.  The
+	 * allocator can be called where waking a thread is not safe, so the zeroing thread is only
+	 * woken later, by kick_zeroing().
+	 * @return Returns the page, or NULL if the pool is empty.
+	 */
+	PageDescriptor *take_zeroed_page()
+	{
+		PageDescriptor *pgd = _zeroed_pages;
+		if (!pgd) {
+			return NULL;
+		}
+
+		_zeroed_pages = pgd->next_free;
+		pgd->next_free = NULL;
+		_zero_stats.pool--;
+
+		if (_zero_stats.pool < ZERO_POOL_LOW) {
+			_zero_refill_wanted = true;
+		}
+		return pgd;
+	}
+
+	/**
+	 * Returns every page in the zeroed pool to the free lists, so that they can coalesce.
+	 * @return Returns TRUE if there were any.
+	 */
+	bool drain_zeroed_pages()
+	{
+		if (!_zeroed_pages) {
+			return false;
+		}
+
+		while (_zeroed_pages) {
+			PageDescriptor *pgd = _zeroed_pages;
+			_zeroed_pages = pgd->next_free;
+			free_pages(pgd, 0);
+		}
+		_zero_stats.pool = 0;
+		return true;
+	}
+
+	/**
+	 * Tops the huge-page reserve back up after a free, if the reserve is short of its target
+	 * and the freed block coalesced into one at least HUGE_ORDER large.  A HUGE_ORDER block
+	 * goes straight in; a larger one means the free lists have recovered, so the reserve is
+	 * refilled from them.
+	 * @param pgd The block, as it ended up after being freed and coalesced.
+	 * @param order The order of the block.
+	 */
+	void replenish_huge_reserve(PageDescriptor *pgd, int order)
+	{
+		if (order < HUGE_ORDER || _huge_stats.reserved >= _huge_stats.target) {
+			return;
+		}
+
+		uint64_t before = _huge_stats.reserved;
+		if (order == HUGE_ORDER) {
+			remove_block(pgd, HUGE_ORDER);
+			pgd->next_free = _huge_reserve;
+			_huge_reserve = pgd;
+			_huge_stats.reserved++;
+		} else {
+			fill_huge_reserve();
+		}
+		_huge_stats.replenished += _huge_stats.reserved - before;
+	}
+
+	/**
+	 * Tops the huge-page reserve up to its target from the free lists, splitting larger
+	 * blocks if need be.  Used when the target or the memory available changes; otherwise
+	 * the reserve is only replenished by coalescing.
+	 */
+	void fill_huge_reserve()
+	{
+		while (_huge_stats.reserved < _huge_stats.target && first_free_order(HUGE_ORDER) <= MAX_ORDER) {
+			PageDescriptor *pgd = allocate_block(HUGE_ORDER);
+			pgd->next_free = _huge_reserve;
+			_huge_reserve = pgd;
+			_huge_stats.reserved++;
+		}
+	}
+
+	/**
+	 * Returns one block from the huge-page reserve to the free lists, where it coalesces as usual.
+	 * @return Returns TRUE if the reserve had a block to return.
+	 */
+	bool release_huge_block()
+	{
+		PageDescriptor *pgd = _huge_reserve;
+		if (!pgd) {
+			return false;
+		}
+
+		_huge_reserve = pgd->next_free;
+		_huge_stats.reserved--;
+
+		// Not free_pages(), which would put the block straight back
+		insert_block(pgd, HUGE_ORDER);
+		coalesce(pgd, HUGE_ORDER);
+		return true;
+	}
+
+	/**
+	 * Returns blocks from the huge-page reserve to the free lists, where they coalesce as usual.
+	 * @param keep The number of blocks to leave in the reserve.
+	 * @return Returns TRUE if any blocks were returned.
+	 */
+	bool release_huge_reserve(uint64_t keep)
+	{
+		if (_huge_stats.reserved <= keep) {
+			return false;
+		}
+
+		while (_huge_stats.reserved > keep) {
+			release_huge_block();
+		}
+		return true;
+	}
+
 public:
+	/**
+	 * Counters for the pool of pre-zeroed pages.
+	 */
+	struct ZeroStats
+	{
+		uint64_t pool; // zeroed pages ready now
+		uint64_t hits; // alloc_zeroed_pages() calls served from the pool
+		uint64_t misses; // alloc_zeroed_pages() calls that zeroed the pages themselves
+		uint64_t zeroed; // pages zeroed by the zeroing thread
+	};
+
 	/**
 	 * Constructs a new instance of the Buddy Page Allocator.
 	 */
@@ -277,20 +501,85 @@ public:
 	 * allocation failed.
 	 */
 	PageDescriptor *allocate_pages(int order) override
+	{
+		if (order == HUGE_ORDER) {
+			return allocate_huge();
+		}
+		return allocate_block(order);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous zero-filled pages.  Single pages come from the pool
+	 * the zeroing thread keeps while it has any.  Anything else is zeroed here once interrupts
+	 * are enabled again, as zeroing a large block would hold them off for too long.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *alloc_zeroed_pages(int order) override
+	{
+		PageDescriptor *pgd;
+		{
+			UniqueIRQLock irq;
+
+			if (order == 0) {
+				pgd = take_zeroed_page();
+				if (pgd) {
+					_zero_stats.hits++;
+					return pgd;
+				}
+			}
+
+			pgd = allocate_pages(order);
+			if (!pgd) {
+				return NULL;
+			}
+			_zero_stats.misses++;
+		}
+
+		// The block is ours now, so nothing else touches it while we zero it
+		zero_block(pgd, order, false);
+		return pgd;
+	}
+
+	/** XX
+	 * Takes 2^order number of contiguous pages off the free lists, splitting a larger block if need be
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the page range, or NULL if
+	 * there is no block large enough.
+	 */
+	PageDescriptor *allocate_block(int order)
 	{
 
 		mm_log.messagef(LogLevel::DEBUG, "ALLOC_PAGES: order: %d", order);
-		
+#ifdef DEBUGPRINT
 		dump_state();
+#endif
 		// Ensure order is valid
 		assert(order >= 0);
 		assert(order <= MAX_ORDER);
 
-		//Here we find the highest order which has a block and is non empty to start with, making sure we
-		//don't cross maximum order 
-		int x = order;
-		while( _free_areas[x] == NULL && x <= MAX_ORDER) {
-			x++;
+		//Here we find the lowest order at or above the one asked for which has a block to start with,
+		//making sure we don't cross maximum order 
+		int x = first_free_order(order);
+
+		// Pages waiting in the zeroed pool are as good as free, and may be what keeps the
+		// free lists from having a block this large.  Blocks come out of the huge-page
+		// reserve too, one at a time until there is one: holding them back is not worth
+		// failing the allocation for, and frees refill the reserve once memory recovers.
+		// As a last resort, the shrinkers are asked to give back as many pages as the block
+		// needs, which need not make a block this large if they are scattered.
+		if (x > MAX_ORDER && drain_zeroed_pages()) {
+			x = first_free_order(order);
+		}
+		while (x > MAX_ORDER && release_huge_block()) {
+			x = first_free_order(order);
+		}
+		if (x > MAX_ORDER && reclaim_pages(pages_per_block(order))) {
+			x = first_free_order(order);
+		}
+		if (x > MAX_ORDER) {
+			return NULL;
 		}
 	mm_log.messagef(LogLevel::DEBUG, "ALLOC_PAGES: x: %d", x);
 		PageDescriptor *block_pointer = _free_areas[x];
@@ -306,6 +595,32 @@ public:
 		return block_pointer;	 	  		
 
 	}
+
+	/**
+	 * Allocates a HUGE_ORDER block, from the reserve if it has one, which takes neither a
+	 * search nor a split.
+	 * @return Returns a pointer to the first page descriptor of the block, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_huge()
+	{
+		PageDescriptor *pgd = _huge_reserve;
+		if (pgd) {
+			_huge_reserve = pgd->next_free;
+			pgd->next_free = NULL;
+			_huge_stats.reserved--;
+			_huge_stats.hits++;
+			return pgd;
+		}
+
+		pgd = allocate_block(HUGE_ORDER);
+		if (pgd) {
+			_huge_stats.allocated++;
+		} else {
+			_huge_stats.failures++;
+		}
+		return pgd;
+	}
 	
 	PageDescriptor** is_page_free(PageDescriptor* pgd, int order)
 	{
@@ -415,8 +730,210 @@ public:
 		// Free these pages straight away.
 		insert_block(pgd, order);
 
-		// Now coalesce
-		coalesce(pgd, order);
+		// Now coalesce, and keep the result if the huge-page reserve is short of it
+		CoalesceResult result = coalesce(pgd, order);
+		replenish_huge_reserve(result.pgd, result.order);
+	}
+
+	/**
+	 * Allocates up to count blocks of 2^order contiguous pages in one call.  Whole blocks are
+	 * taken off the head of the lowest non-empty free list and carved up here, rather than
+	 * split one order at a time through the free lists, and only what is left of the last one
+	 * goes back on them.  Neither the zeroed pool nor the huge-page reserve is drawn on, and
+	 * the shrinkers are not asked for more.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 * @param pgds The array to fill with the first page descriptor of each block, in ascending
+	 * order within each block carved up.
+	 * @param count The number of blocks wanted, which pgds must have room for.
+	 * @return Returns the number of blocks allocated, which is less than count if memory ran out.
+	 */
+	uint64_t alloc_pages_bulk(int order, PageDescriptor **pgds, uint64_t count) override
+	{
+		UniqueIRQLock irq;
+
+		// Ensure order is valid
+		assert(order >= 0);
+		assert(order <= MAX_ORDER);
+
+		uint64_t filled = 0;
+		while (filled < count) {
+			int x = first_free_order(order);
+			if (x > MAX_ORDER) {
+				break;
+			}
+
+			// The head of a free list comes off without a search
+			PageDescriptor *block = _free_areas[x];
+			_free_areas[x] = block->next_free;
+			block->next_free = NULL;
+
+			// Hand out as many pieces of the requested order from the front of it as are still wanted
+			uint64_t pieces = pages_per_block(x - order);
+			uint64_t taken = (count - filled < pieces) ? count - filled : pieces;
+			for (uint64_t i = 0; i < taken; i++) {
+				pgds[filled++] = block + i * pages_per_block(order);
+			}
+
+			// Free the rest, from piece 'taken' to the end, as the fewest aligned blocks that cover it:
+			// each set bit of the piece index marks where a block of that bit's order starts
+			uint64_t next = taken;
+			for (int o = order; next < pieces; o++) {
+				if (next & pages_per_block(o - order)) {
+					insert_block(block + next * pages_per_block(order), o);
+					next += pages_per_block(o - order);
+				}
+			}
+		}
+
+		mm_log.messagef(LogLevel::DEBUG, "ALLOC_PAGES_BULK: order: %d, count: %lu, allocated: %lu", order, count, filled);
+		return filled;
+	}
+
+	/**
+	 * Frees a batch of blocks of 2^order contiguous pages.  Buddies that lie next to each other
+	 * in an ascending stretch of the batch are merged with each other here, and only the blocks
+	 * left over are inserted into the free lists and coalesced with what is already there.  A
+	 * batch from alloc_pages_bulk is ascending within each block it carved up; blocks in any
+	 * other order are still freed correctly, just one at a time.
+	 * @param pgds The first page descriptor of each block to free.  The array is used as scratch
+	 * space, and its contents are undefined afterwards.
+	 * @param count The number of blocks in pgds.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 */
+	void free_pages_bulk(PageDescriptor **pgds, uint64_t count, int order) override
+	{
+		UniqueIRQLock irq;
+
+		// Ensure order is valid
+		assert(order >= 0);
+		assert(order <= MAX_ORDER);
+
+		mm_log.messagef(LogLevel::DEBUG, "FREE_PAGES_BULK: order: %d, count: %lu", order, count);
+
+		uint64_t start = 0;
+		while (start < count) {
+			uint64_t end = start + 1;
+			while (end < count && pgds[end - 1] < pgds[end]) {
+				end++;
+			}
+
+			free_block_run(&pgds[start], end - start, order);
+			start = end;
+		}
+	}
+
+	/**
+	 * Starts the thread that keeps a pool of zeroed pages for alloc_zeroed_pages().  This
+	 * must wait until the kernel can create threads, which is well after init(); until then,
+	 * zeroed pages are zeroed on request.
+	 */
+	void start_zeroing() override
+	{
+		if (_zero_worker) {
+			return;
+		}
+
+		zeroing_allocator = this;
+		_zero_worker = &sys.kernel_process().create_thread(ThreadPrivilege::Kernel, (Thread::thread_proc_t)&zero_worker_main, "page-zero");
+		_zero_worker->priority(SchedulingEntityPriority::DAEMON);
+		_zero_worker->start();
+	}
+
+	/**
+	 * Wakes the zeroing thread if allocations have taken the zeroed pool below ZERO_POOL_LOW
+	 * while it slept.  The scheduler calls this when a CPU is about to go idle, so the pool
+	 * is refilled in time nothing else wants.  It may be called with interrupts disabled,
+	 * but never from inside the allocator, and does nothing when there is nothing to refill.
+	 * @return Returns TRUE if the zeroing thread was woken.
+	 */
+	bool kick_zeroing() override
+	{
+		UniqueIRQLock irq;
+
+		if (!_zero_refill_wanted || !_zero_worker_asleep) {
+			return false;
+		}
+
+		_zero_refill_wanted = false;
+		_zero_worker_asleep = false;
+		_zero_worker->wake_up();
+		return true;
+	}
+
+	/**
+	 * Runs on the zeroing thread.  Pages are taken from the free lists ZERO_BATCH at a time
+	 * and zeroed with interrupts enabled; only moving them on and off the lists, which the
+	 * allocation calls also do, runs with interrupts disabled.  The thread sleeps once the
+	 * pool reaches ZERO_POOL_TARGET, or the free lists run dry, until kick_zeroing() finds
+	 * the pool below ZERO_POOL_LOW.
+	 */
+	void run_zeroing()
+	{
+		while (true) {
+			PageDescriptor *batch[ZERO_BATCH];
+			uint64_t count;
+			{
+				UniqueIRQLock irq;
+
+				uint64_t wanted = ZERO_POOL_TARGET - _zero_stats.pool;
+				count = (_zero_stats.pool < ZERO_POOL_TARGET) ?
+					alloc_pages_bulk(0, batch, wanted < ZERO_BATCH ? wanted : ZERO_BATCH) : 0;
+
+				// Interrupts stay off from here until we are asleep, so kick_zeroing() cannot
+				// slip in between.  The pool is as full as the free lists allow, so any refill
+				// asked for while we ran has been done.
+				if (count == 0) {
+					_zero_refill_wanted = false;
+					_zero_worker_asleep = true;
+					Thread::current().sleep();
+					continue;
+				}
+			}
+
+			for (uint64_t i = 0; i < count; i++) {
+				zero_block(batch[i], 0, true);
+			}
+
+			// The zeroes must reach memory before the pages can be handed out
+			asm volatile("sfence" ::: "memory");
+
+			UniqueIRQLock irq;
+			for (uint64_t i = 0; i < count; i++) {
+				batch[i]->next_free = _zeroed_pages;
+				_zeroed_pages = batch[i];
+			}
+			_zero_stats.pool += count;
+			_zero_stats.zeroed += count;
+		}
+	}
+
+	/**
+	 * Returns the zeroed pool's counters.
+	 */
+	ZeroStats zero_stats() const { return _zero_stats; }
+
+	/**
+	 * Sets how many HUGE_ORDER blocks are held back from being split for smaller allocations.
+	 * The reserve is filled from the free lists straight away, as far as they allow, and
+	 * afterwards as frees bring blocks of HUGE_ORDER or larger back onto them.
+	 * @param count The number of blocks to hold back.
+	 */
+	void set_huge_reserve(uint64_t count) override
+	{
+		UniqueIRQLock irq;
+
+		_huge_stats.target = count;
+		release_huge_reserve(count);
+		fill_huge_reserve();
+	}
+
+	/**
+	 * Returns the counters for HUGE_ORDER allocations.
+	 */
+	HugeStats huge_stats() const override
+	{
+		UniqueIRQLock irq;
+		return _huge_stats;
 	}
 
     /** 
@@ -438,6 +955,7 @@ virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
 			// If the count is zero, we are done
 				if (newcount == 0)
 				{		dump_state();
+					fill_huge_reserve();
 					return;
 				}
 			int x = (1 << order);
@@ -552,6 +1070,11 @@ lists area.
 virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
     {
 		mm_log.messagef(LogLevel::DEBUG, "RESERVE_PAGE(pgd: %p)", start);
+
+		// The range may take in pages sitting in the zeroed pool or the huge-page reserve, and
+		// pages are only found on the free lists
+		drain_zeroed_pages();
+		release_huge_reserve(0);
         dump_state();
         auto order = MAX_ORDER;
         PageDescriptor* current_block = nullptr;
@@ -613,7 +1136,8 @@ virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
 			pgd++;
 		}
 mm_log.messagef(LogLevel::DEBUG, "RESERVED PAGES(from start:%p, to last page %p, %p, count: %lu)", start, last_page, pgd, count);
-		
+
+		fill_huge_reserve();
 	}
 
 
@@ -631,11 +1155,16 @@ bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) overri
 		
 				for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
 			_free_areas[i] = NULL;
-		return true;
-	}
+		}
 
+		// movnti is part of SSE2
+		uint32_t eax, ebx, ecx, edx;
+		asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+		_has_movnti = (edx >> 26) & 1;
 
-}
+		pgalloc_ext = this;
+		return true;
+	}
 	/**
 	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
 	 */
@@ -665,13 +1194,76 @@ bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) overri
 
 			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
 		}
+
+		mm_log.messagef(LogLevel::DEBUG, "[huge reserve] %lu of %lu", _huge_stats.reserved, _huge_stats.target);
 	}
 
 
 private:
 	PageDescriptor *_free_areas[MAX_ORDER+1];
+
+	PageDescriptor *_zeroed_pages = NULL; // the zeroed pool, linked through next_free
+	ZeroStats _zero_stats = { };
+	Thread *_zero_worker = NULL;
+	bool _zero_refill_wanted = false; // the pool fell below ZERO_POOL_LOW; see kick_zeroing()
+	bool _zero_worker_asleep = false;
+	bool _has_movnti = false;
+
+	PageDescriptor *_huge_reserve = NULL; // HUGE_ORDER blocks held back, linked through next_free
+	HugeStats _huge_stats = { 0, HUGE_RESERVE_DEFAULT };
 };
 
+static void zero_worker_main(void *)
+{
+	zeroing_allocator->run_zeroing();
+}
+
+static List<MemoryShrinker *> shrinkers;
+static bool reclaiming;
+
+void register_shrinker(MemoryShrinker *shrinker)
+{
+	UniqueIRQLock irq;
+	shrinkers.append(shrinker);
+}
+
+void unregister_shrinker(MemoryShrinker *shrinker)
+{
+	UniqueIRQLock irq;
+	shrinkers.remove(shrinker);
+}
+
+/**
+ * Asks each shrinker in turn for pages, until nr_pages have been released.  The pages come
+ * back through free_pages(), so this is called from allocate_block() before it fails.  An
+ * allocation made while reclaiming does not reclaim again, and fails instead.
+ * @param nr_pages The number of pages wanted.
+ * @return Returns the number of pages released.
+ */
+size_t reclaim_pages(size_t nr_pages)
+{
+	UniqueIRQLock irq;
+
+	if (__atomic_exchange_n(&reclaiming, true, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	size_t released = 0;
+	for (auto shrinker : shrinkers) {
+		if (released >= nr_pages) {
+			break;
+		}
+
+		size_t reclaimable = shrinker->count_reclaimable();
+		if (reclaimable > 0) {
+			released += shrinker->scan(nr_pages - released < reclaimable ? nr_pages - released : reclaimable);
+		}
+	}
+
+	__atomic_store_n(&reclaiming, false, __ATOMIC_RELEASE);
+	return released;
+}
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 /*
@@ -1,6 +1,7 @@
 
 
 
+#include <infos/drivers/ata/page-cache.h>
 #include <infos/drivers/ata/ata-device.h>
 #include <infos/drivers/ata/ata-controller.h>
 #include <infos/kernel/kernel.h>
@@ -30,11 +31,6 @@ offset=686).
 */
 
 
-
-# define CACHE_SIZE 64 // amount of blocks in the cache
-
-
-
 /* TODO Using the offset (and block size) I can 
 find the block pointer (buffer pointer), and then
 I just copy the next 512 bytes from the buffer?
@@ -66,83 +62,3778 @@ using namespace infos::util;
 using namespace infos::arch::x86;
 using namespace infos::drivers::ata;
 
-PageCache::PageCache()
+ComponentLog infos::drivers::ata::cache_log(syslog, "cache");
+
+
+
+// Log format for a block key, "device:lba"
+# define KEY_FMT "%u:%lu"
+# define KEY_ARGS(key) cache_key_device(key), (unsigned long)cache_key_lba(key)
+
+
+
+static inline uint32_t index_hash(CacheKey key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+
+
+static uint32_t table_lookup(const ShardTable* table, CacheKey key)
 {
+    uint32_t pos = index_hash(key) & table->index_mask;
 
+    while (table->index[pos] != 0)
+    {
+        uint32_t slot = table->index[pos] - 1;
+        if (table->slot_key[slot] == key)
+        {
+            return slot;
+        }
+        pos = (pos + 1) & table->index_mask;
+    }
 
+    return NO_SLOT;
 }
 
 
-PageCache::~PageCache()
+
+/*
+CRC32C.  With SSE4.2 the crc32 instruction does eight bytes at a time
+in general-purpose registers, so no FPU state needs saving in the
+kernel.  Its three-cycle latency would make one dependent chain several
+times slower than copying the block, so a whole block is split into
+three interleaved streams that are joined at the end by
+crc32c_shift(), which advances a CRC over CRC32C_STREAM zero bytes
+using four lookup tables.  Without SSE4.2 a byte-at-a-time table is
+used.
+*/
+# define CRC32C_POLY 0x82f63b78u // reflected Castagnoli polynomial
+# define CRC32C_STREAM 168 // bytes per stream: 3 * 168 + 8 = BLOCK_SIZE
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_shift_table[4][256];
+static bool crc32c_hw;
+static bool crc32c_ready;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t length)
+{
+    while (length--)
+    {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void crc32c_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        crc32c_table[i] = crc;
+    }
+
+    // The CRC is linear, so advancing it over zeros splits into one table per byte
+    uint8_t zeros[CRC32C_STREAM] = { };
+    for (int byte = 0; byte < 4; byte++)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            crc32c_shift_table[byte][i] = crc32c_sw(i << (byte * 8), zeros, CRC32C_STREAM);
+        }
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    crc32c_hw = (ecx >> 20) & 1;
+
+    __atomic_store_n(&crc32c_ready, true, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+    return crc32c_shift_table[0][crc & 0xff] ^ crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xff] ^ crc32c_shift_table[3][crc >> 24];
+}
+
+static inline uint64_t crc32c_u64(uint64_t crc, uint64_t data)
 {
+    asm("crc32q %1, %0" : "+r"(crc) : "rm"(data));
+    return crc;
+}
 
+static inline uint32_t crc32c_u8(uint32_t crc, uint8_t data)
+{
+    asm("crc32b %1, %0" : "+r"(crc) : "rm"(data));
+    return crc;
 }
 
+static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t* p, size_t length)
+{
+    uint64_t a = crc;
+
+    if (length == BLOCK_SIZE)
+    {
+        uint64_t b = 0;
+        uint64_t c = 0;
+        for (size_t i = 0; i < CRC32C_STREAM; i += 8)
+        {
+            a = crc32c_u64(a, *(const uint64_t*)(p + i));
+            b = crc32c_u64(b, *(const uint64_t*)(p + CRC32C_STREAM + i));
+            c = crc32c_u64(c, *(const uint64_t*)(p + 2 * CRC32C_STREAM + i));
+        }
 
+        a = crc32c_shift(crc32c_shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+        p += 3 * CRC32C_STREAM;
+        length -= 3 * CRC32C_STREAM;
+    }
 
+    for (; length >= 8; p += 8, length -= 8)
+    {
+        a = crc32c_u64(a, *(const uint64_t*)p);
+    }
+    while (length--)
+    {
+        a = crc32c_u8((uint32_t)a, *p++);
+    }
 
+    return (uint32_t)a;
+}
 
-void PageCache::init()
+uint32_t infos::drivers::ata::crc32c(uint32_t crc, const void* data, size_t length)
 {
-    // Initialize the cache
-    // Initialize the cache
-    for (int i = 0; i < CACHE_SIZE; i++)
+    if (!__atomic_load_n(&crc32c_ready, __ATOMIC_ACQUIRE))
+    {
+        crc32c_init();
+    }
+
+    crc = ~crc;
+    crc = crc32c_hw ? crc32c_hw_update(crc, (const uint8_t*)data, length)
+                    : crc32c_sw(crc, (const uint8_t*)data, length);
+    return ~crc;
+}
+
+
+
+/*
+Block copy and compare.  Kernel code may not touch the SSE/AVX registers
+without saving the FPU state around them, so these stay in
+general-purpose registers: string moves for copies (rep movsb where the
+CPU advertises fast strings, ERMS, and rep movsq otherwise) and an
+unrolled 64-bit compare that checks a cache line at a time.
+*/
+static bool fast_strings;
+
+static void copy_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 7)
+    {
+        return;
+    }
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    fast_strings = (ebx >> 9) & 1;
+}
+
+static inline void copy_blocks(void* dst, const void* src, size_t count)
+{
+    size_t n = count * BLOCK_SIZE;
+
+    if (fast_strings)
+    {
+        asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+    }
+    else
+    {
+        n /= sizeof(uint64_t);
+        asm volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+    }
+}
+
+static inline bool blocks_equal(const void* a, const void* b)
+{
+    const uint64_t* x = (const uint64_t*)a;
+    const uint64_t* y = (const uint64_t*)b;
+
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i += 8)
+    {
+        uint64_t diff = (x[i] ^ y[i]) | (x[i + 1] ^ y[i + 1]) | (x[i + 2] ^ y[i + 2]) | (x[i + 3] ^ y[i + 3]) |
+                        (x[i + 4] ^ y[i + 4]) | (x[i + 5] ^ y[i + 5]) | (x[i + 6] ^ y[i + 6]) | (x[i + 7] ^ y[i + 7]);
+        if (diff)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+static void free_table(ShardTable* table)
+{
+    delete[] table->page_pgd;
+    delete[] table->page_base;
+    delete[] table->slot_key;
+    delete[] table->slot_stamp;
+    delete[] table->slot_pins;
+    delete[] table->slot_flags;
+    delete[] table->slot_csum;
+    delete[] table->index;
+    delete table;
+}
+
+
+
+CacheShard::~CacheShard()
+{
+    for (size_t page = 0; page < nr_pages_; page++)
+    {
+        sys.mm().pgalloc().free_pages(table_->page_pgd[page], 0);
+    }
+
+    while (table_)
+    {
+        ShardTable* retired = table_->retired;
+        free_table(table_);
+        table_ = retired;
+    }
+}
+
+
+
+/*
+Copies the block at key into buffer without taking the lock, and returns the
+slot it came from.  Returns NO_SLOT if the block is not cached, or if
+the shard changed while we were reading; either way the caller retries
+under the lock.
+*/
+uint32_t CacheShard::try_read(void* buffer, CacheKey key)
+{
+    uint32_t seq = __atomic_load_n(&seq_, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+    {
+        return NO_SLOT;
+    }
+
+    ShardTable* table = __atomic_load_n(&table_, __ATOMIC_ACQUIRE);
+    if (!table)
+    {
+        return NO_SLOT;
+    }
+
+    uint32_t slot = table_lookup(table, key);
+    if (slot == NO_SLOT || (table->slot_flags[slot] & (SLOT_FILLING | SLOT_LOST)))
+    {
+        return NO_SLOT;
+    }
+
+    uint32_t csum = table->slot_csum[slot];
+    copy_blocks(buffer, table->page_base[slot / SECTORS_PER_PAGE] + (slot % SECTORS_PER_PAGE) * BLOCK_SIZE, 1);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&seq_, __ATOMIC_RELAXED) != seq)
+    {
+        return NO_SLOT;
+    }
+
+    // Checked on our own copy, which nobody can change under us; the locked path repairs a bad block
+    if ((__atomic_load_n(&verify_, __ATOMIC_RELAXED) & VERIFY_ON_HIT) && crc32c(0, buffer, BLOCK_SIZE) != csum)
+    {
+        return NO_SLOT;
+    }
+
+    touch_slot(slot);
+    return slot;
+}
+
+
+
+// A lock-free hint only; the answer can be stale by the time it is used
+bool CacheShard::contains(CacheKey key)
+{
+    ShardTable* table = __atomic_load_n(&table_, __ATOMIC_ACQUIRE);
+    return table && table_lookup(table, key) != NO_SLOT;
+}
+
+
+
+uint32_t CacheShard::lookup_slot(CacheKey key)
+{
+    return table_ ? table_lookup(table_, key) : NO_SLOT;
+}
+
+
+
+void CacheShard::touch_slot(uint32_t slot)
+{
+    // Stamp the slot so the LRU scan in claim_slot() sees it as most recent.  Hits
+    // stamp without the lock, so the counter is bumped atomically.
+    uint32_t stamp = __atomic_add_fetch(&access_counter_, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&table_->slot_stamp[slot], stamp, __ATOMIC_RELAXED);
+}
+
+
+
+void CacheShard::index_insert(CacheKey key, uint32_t slot)
+{
+    uint32_t pos = index_hash(key) & table_->index_mask;
+
+    while (table_->index[pos] != 0)
     {
-        ata.logf(LogLevel::DEBUG, "cache: Initializing cache");
-        cache[i].valid = false;
-        cache[i].dirty = false;
-        cache[i].block_offset = 0;
-        cache[i].buffer = new uint8_t[512];
+        pos = (pos + 1) & table_->index_mask;
     }
+    table_->index[pos] = slot + 1;
 }
 
-bool PageCache::checkfordata(uint32_t block_offset)
+
+
+void CacheShard::index_remove(CacheKey key)
 {
-    // Check if the block is in the cache
-    for (int i = 0; i < CACHE_SIZE; i++)
+    uint32_t mask = table_->index_mask;
+    uint32_t* index = table_->index;
+    uint32_t hole = index_hash(key) & mask;
+
+    while (index[hole] != 0 && table_->slot_key[index[hole] - 1] != key)
+    {
+        hole = (hole + 1) & mask;
+    }
+    if (index[hole] == 0)
+    {
+        return;
+    }
+
+    // Backward-shift deletion: pull later entries of the probe run into the hole
+    // so that lookups never need tombstones.
+    uint32_t pos = hole;
+    while (true)
     {
-        if (cache[i].valid && cache[i].block_offset == block_offset)
+        pos = (pos + 1) & mask;
+        if (index[pos] == 0)
+        {
+            break;
+        }
+
+        uint32_t home = index_hash(table_->slot_key[index[pos] - 1]) & mask;
+        bool movable = (hole <= pos) ? (home <= hole || home > pos) : (home <= hole && home > pos);
+        if (movable)
         {
-            return true;
+            index[hole] = index[pos];
+            hole = pos;
         }
     }
-    return false;
+    index[hole] = 0;
+}
+
+
+
+// Allocates an empty table for max_pages pages
+static ShardTable* alloc_table(size_t max_pages)
+{
+    size_t nr_slots = max_pages * SECTORS_PER_PAGE;
+    uint32_t index_size = 1;
+    while (index_size < nr_slots * 2)
+    {
+        index_size <<= 1;
+    }
+
+    ShardTable* table = new ShardTable;
+    table->max_pages = max_pages;
+    table->index_mask = index_size - 1;
+    table->page_pgd = new PageDescriptor*[max_pages];
+    table->page_base = new uint8_t*[max_pages];
+    table->slot_key = new CacheKey[nr_slots];
+    table->slot_stamp = new uint32_t[nr_slots];
+    table->slot_pins = new uint16_t[nr_slots];
+    table->slot_flags = new uint8_t[nr_slots];
+    table->slot_csum = new uint32_t[nr_slots];
+    table->index = new uint32_t[index_size];
+    table->retired = NULL;
+
+    for (uint32_t pos = 0; pos < index_size; pos++)
+    {
+        table->index[pos] = 0;
+    }
+
+    return table;
 }
 
 
 
-void PageCache::read_blocks_from_cache(uint32_t block_offset, uint8_t* buffer)
+/*
+Switches the shard over to a bigger table: the live state is copied,
+the index rebuilt, and the old table is retired rather than freed.
+*/
+void CacheShard::install_table(ShardTable* table)
 {
-    // Read the block from the cache
-    for (int i = 0; i < CACHE_SIZE; i++)
+    ShardTable* old = table_;
+    table->retired = old;
+
+    size_t used_slots = nr_pages_ * SECTORS_PER_PAGE;
+    for (size_t page = 0; page < nr_pages_; page++)
+    {
+        table->page_pgd[page] = old->page_pgd[page];
+        table->page_base[page] = old->page_base[page];
+    }
+    for (size_t slot = 0; slot < used_slots; slot++)
+    {
+        table->slot_key[slot] = old->slot_key[slot];
+        table->slot_stamp[slot] = old->slot_stamp[slot];
+        table->slot_pins[slot] = old->slot_pins[slot];
+        table->slot_flags[slot] = old->slot_flags[slot];
+        table->slot_csum[slot] = old->slot_csum[slot];
+    }
+
+    write_begin();
+    __atomic_store_n(&table_, table, __ATOMIC_RELEASE);
+    for (uint32_t slot = 0; slot < used_slots; slot++)
     {
-        if (cache[i].valid && cache[i].block_offset == block_offset)
+        if (table->slot_flags[slot] & SLOT_VALID)
         {
-            memcpy(buffer, cache[i].buffer, 512);
-            return;
+            index_insert(table->slot_key[slot], slot);
+        }
+    }
+    write_end();
+}
+
+
+
+/*
+Adds the page pgd as SECTORS_PER_PAGE empty slots.  Nothing is allocated
+here, as the shard lock is held (see PageCache::grow_shard()): if the
+table is full, spare is installed in its place (and cleared) when it is
+big enough, and otherwise the page is not added and the number of pages
+a new table should hold is returned, for the caller to allocate one and
+try again.  Returns 0 once the page is added.
+*/
+size_t CacheShard::add_page(PageDescriptor* pgd, ShardTable*& spare)
+{
+    if (!table_ || nr_pages_ == table_->max_pages)
+    {
+        if (!spare || spare->max_pages <= nr_pages_)
+        {
+            // At least double the old table, so the retired ones never outweigh it
+            return table_ ? table_->max_pages * 2 : 1;
+        }
+
+        if (table_)
+        {
+            install_table(spare);
+        }
+        else
+        {
+            __atomic_store_n(&table_, spare, __ATOMIC_RELEASE);
         }
+        spare = NULL;
+    }
+
+    table_->page_pgd[nr_pages_] = pgd;
+    table_->page_base[nr_pages_] = (uint8_t*)sys.mm().pgalloc().pgd_to_vpa(pgd);
+
+    for (uint32_t slot = nr_pages_ * SECTORS_PER_PAGE; slot < (nr_pages_ + 1) * SECTORS_PER_PAGE; slot++)
+    {
+        table_->slot_key[slot] = 0;
+        table_->slot_stamp[slot] = 0;
+        table_->slot_pins[slot] = 0;
+        table_->slot_flags[slot] = 0;
+        table_->slot_csum[slot] = 0;
     }
+
+    nr_pages_++;
+    return 0;
 }
 
 
 
+/*
+Empties one page (writing back its dirty blocks) and hands it back to
+the page allocator.  Its blocks are dropped rather than kept in the
+compressed tier, as memory is being given back.  The last page is moved into the hole so the live pages
+stay packed at the front.  Fails if any block on the page is pinned or
+cannot be written back.
+*/
+bool CacheShard::release_page(size_t page)
+{
+    uint32_t first = page * SECTORS_PER_PAGE;
+    uint32_t last_page_first = (nr_pages_ - 1) * SECTORS_PER_PAGE;
+
+    for (uint32_t slot = first; slot < first + SECTORS_PER_PAGE; slot++)
+    {
+        if (slot_busy(slot))
+        {
+            return false;
+        }
+    }
+
+    for (uint32_t slot = first; slot < first + SECTORS_PER_PAGE; slot++)
+    {
+        if ((table_->slot_flags[slot] & SLOT_VALID) && !evict_slot(slot, false))
+        {
+            return false;
+        }
+    }
+
+    sys.mm().pgalloc().free_pages(table_->page_pgd[page], 0);
+
+    if (page != nr_pages_ - 1)
+    {
+        write_begin();
+        table_->page_pgd[page] = table_->page_pgd[nr_pages_ - 1];
+        table_->page_base[page] = table_->page_base[nr_pages_ - 1];
+
+        for (uint32_t i = 0; i < SECTORS_PER_PAGE; i++)
+        {
+            uint32_t to = first + i;
+            uint32_t from = last_page_first + i;
+
+            if (table_->slot_flags[from] & SLOT_VALID)
+            {
+                index_remove(table_->slot_key[from]);
+            }
+
+            table_->slot_key[to] = table_->slot_key[from];
+            table_->slot_stamp[to] = table_->slot_stamp[from];
+            table_->slot_pins[to] = table_->slot_pins[from];
+            table_->slot_flags[to] = table_->slot_flags[from];
+            table_->slot_csum[to] = table_->slot_csum[from];
+
+            if (table_->slot_flags[to] & SLOT_VALID)
+            {
+                index_insert(table_->slot_key[to], to);
+            }
+        }
+        write_end();
+    }
+
+    nr_pages_--;
+    return true;
+}
+
 
 
-void PageCache::write_blocks_to_cache(uint32_t block_offset, uint8_t* buffer)
+/*
+Gives up to nr_pages pages back to the page allocator.  Pages holding
+only clean blocks go first, since they can be dropped without any
+device I/O; within each group the coldest page (the one whose most
+recently used block is oldest) goes first.  With clean_only set, for
+the shrinker, dirty pages are left alone.  Returns the number of pages
+released.
+*/
+size_t CacheShard::shrink(size_t nr_pages, bool clean_only)
 {
-    // Write the block to the cache
-    for (int i = 0; i < CACHE_SIZE; i++)
+    size_t released = 0;
+
+    while (released < nr_pages && nr_pages_ > 0)
     {
-        if (!cache[i].valid)
+        size_t coldest = nr_pages_;
+        uint32_t coldest_stamp = 0;
+        bool coldest_dirty = false;
+
+        for (size_t page = 0; page < nr_pages_; page++)
         {
-            cache[i].valid = true;
-            cache[i].block_offset = block_offset;
-            memcpy(cache[i].buffer, buffer, 512);
-            return;
+            uint32_t stamp = 0;
+            bool pinned = false;
+            bool dirty = false;
+
+            for (uint32_t slot = page * SECTORS_PER_PAGE; slot < (page + 1) * SECTORS_PER_PAGE; slot++)
+            {
+                pinned |= slot_busy(slot);
+                dirty |= (table_->slot_flags[slot] & SLOT_DIRTY) != 0;
+                if ((table_->slot_flags[slot] & SLOT_VALID) && table_->slot_stamp[slot] > stamp)
+                {
+                    stamp = table_->slot_stamp[slot];
+                }
+            }
+
+            if (pinned || (clean_only && dirty))
+            {
+                continue;
+            }
+
+            if (coldest == nr_pages_ || (coldest_dirty && !dirty) ||
+                (coldest_dirty == dirty && stamp < coldest_stamp))
+            {
+                coldest = page;
+                coldest_stamp = stamp;
+                coldest_dirty = dirty;
+            }
         }
+
+        if (coldest == nr_pages_ || !release_page(coldest))
+        {
+            break;
+        }
+        released++;
     }
-    // If the cache is full, replace the first block
-    cache[0].block_offset = block_offset;
-    memcpy(cache[0].buffer, buffer, 512);
+
+    return released;
 }
 
+
+
+bool CacheShard::evict_slot(uint32_t slot, bool demote)
+{
+    // A dirty block must reach the device before its slot can be reused
+    if (table_->slot_flags[slot] & SLOT_DIRTY)
+    {
+        CacheBackingStore* store = slot_store(slot);
+        if (!store || !store->store_blocks(slot_data(slot), cache_key_lba(table_->slot_key[slot]), 1))
+        {
+            cache_log.messagef(LogLevel::ERROR, "cache: writeback failed offset=" KEY_FMT, KEY_ARGS(table_->slot_key[slot]));
+            return false;
+        }
+        stats_->add(CACHE_WRITEBACKS);
+    }
+
+    // Clean now either way, so the device and the tier agree
+    if (tier_ && demote)
+    {
+        tier_->stage(table_->slot_key[slot], slot_data(slot));
+    }
+
+    stats_->add(CACHE_EVICTIONS);
+    resident_[cache_key_device(table_->slot_key[slot])]--;
+    write_begin();
+    index_remove(table_->slot_key[slot]);
+    table_->slot_flags[slot] = 0;
+    write_end();
+    return true;
+}
+
+
+
+/*
+Picks the slot a new block of device goes into: an empty one if there
+is one, otherwise the least recently used block that is neither pinned
+nor being filled (nor dirty, if clean_only is set).  The device's
+partition limits which blocks it may take: at its cap only its own, and
+never one of a device that is at or below its guaranteed minimum.
+Returns NO_SLOT if nothing qualifies.
+*/
+uint32_t CacheShard::pick_victim(unsigned int device, bool clean_only)
+{
+    // The partition limits are per cache; each shard holds its share of them
+    size_t max_blocks = partitions_[device].max_blocks;
+    bool capped = max_blocks && resident_[device] >= (max_blocks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+
+    uint32_t nr = nr_pages_ * SECTORS_PER_PAGE;
+    uint32_t victim = NO_SLOT;
+
+    for (uint32_t slot = 0; slot < nr; slot++)
+    {
+        if (!(table_->slot_flags[slot] & SLOT_VALID))
+        {
+            if (!capped)
+            {
+                return slot;
+            }
+            continue;
+        }
+        if (slot_busy(slot) || (clean_only && (table_->slot_flags[slot] & SLOT_DIRTY)))
+        {
+            continue;
+        }
+
+        unsigned int owner = cache_key_device(table_->slot_key[slot]);
+        if (owner != device && (capped || resident_[owner] <= (partitions_[owner].min_blocks + CACHE_SHARDS - 1) / CACHE_SHARDS))
+        {
+            continue;
+        }
+
+        if (victim == NO_SLOT || table_->slot_stamp[slot] < table_->slot_stamp[victim])
+        {
+            victim = slot;
+        }
+    }
+
+    return victim;
+}
+
+
+
+/*
+Finds a slot for key, evicting a block (see pick_victim()) if there is
+no empty one.  The slot comes back marked SLOT_FILLING; the caller
+copies the data in and then calls finish_fill() (or abort_fill() if the
+data never arrived).
+*/
+uint32_t CacheShard::claim_slot(CacheKey key)
+{
+    if (verify_ & VERIFY_SCRUB)
+    {
+        scrub(SCRUB_BLOCKS_PER_MISS);
+    }
+
+    unsigned int device = cache_key_device(key);
+    uint32_t victim = pick_victim(device, false);
+    if (victim == NO_SLOT)
+    {
+        cache_log.messagef(LogLevel::WARNING, "cache: no block device %u may take is free", device);
+        return NO_SLOT;
+    }
+
+    // A block that cannot be written back stays put (dirty, for a later
+    // attempt), and the oldest clean block goes instead
+    if ((table_->slot_flags[victim] & SLOT_VALID) && !evict_slot(victim))
+    {
+        victim = pick_victim(device, true);
+        if (victim == NO_SLOT || ((table_->slot_flags[victim] & SLOT_VALID) && !evict_slot(victim)))
+        {
+            return NO_SLOT;
+        }
+    }
+
+    resident_[device]++;
+    write_begin();
+    table_->slot_key[victim] = key;
+    table_->slot_flags[victim] = SLOT_VALID | SLOT_FILLING;
+    index_insert(key, victim);
+    write_end();
+    return victim;
+}
+
+
+
+void CacheShard::finish_fill(uint32_t slot, uint8_t flags)
+{
+    write_begin();
+    table_->slot_flags[slot] = SLOT_VALID | flags;
+    seal_slot(slot);
+    write_end();
+    touch_slot(slot);
+}
+
+
+
+// Records the checksum of a slot whose data has just changed, inside write_begin()/write_end()
+void CacheShard::seal_slot(uint32_t slot)
+{
+    if (verify_)
+    {
+        table_->slot_csum[slot] = crc32c(0, slot_data(slot), BLOCK_SIZE);
+    }
+}
+
+
+
+/*
+Checks a cached block against its checksum.  A clean block that fails is
+read again from the device in place.  A dirty one cannot be: the device
+copy is older than a write that was already acknowledged, and writing
+the garbage back would spread the damage.  It is marked SLOT_LOST
+instead, and fails every read until it is written again.  Returns false
+if the block is lost or could not be read again.
+*/
+bool CacheShard::check_slot(uint32_t slot)
+{
+    if (table_->slot_flags[slot] & SLOT_LOST)
+    {
+        return false;
+    }
+    if (!verify_ || crc32c(0, slot_data(slot), BLOCK_SIZE) == table_->slot_csum[slot])
+    {
+        return true;
+    }
+
+    CacheKey key = table_->slot_key[slot];
+    stats_->add(CACHE_CHECKSUM_ERRORS);
+    cache_log.messagef(LogLevel::ERROR, "cache: checksum mismatch offset=" KEY_FMT "%s", KEY_ARGS(key),
+                       (table_->slot_flags[slot] & SLOT_DIRTY) ? ", unwritten data lost" : "");
+
+    if (table_->slot_flags[slot] & SLOT_DIRTY)
+    {
+        write_begin();
+        table_->slot_flags[slot] = (table_->slot_flags[slot] & ~SLOT_DIRTY) | SLOT_LOST;
+        write_end();
+        return false;
+    }
+
+    write_begin();
+    CacheBackingStore* store = slot_store(slot);
+    bool ok = store && store->fetch_blocks(slot_data(slot), cache_key_lba(key), 1);
+    if (ok)
+    {
+        seal_slot(slot);
+    }
+    write_end();
+
+    if (ok)
+    {
+        stats_->add(CACHE_REFETCHES);
+    }
+    return ok;
+}
+
+
+
+// Checks the next nr_blocks slots round-robin, and returns how many were bad
+size_t CacheShard::scrub(size_t nr_blocks)
+{
+    uint32_t nr = nr_pages_ * SECTORS_PER_PAGE;
+    size_t bad = 0;
+
+    for (size_t i = 0; i < nr_blocks && i < nr; i++)
+    {
+        if (scrub_cursor_ >= nr)
+        {
+            scrub_cursor_ = 0;
+        }
+        uint32_t slot = scrub_cursor_++;
+
+        if ((table_->slot_flags[slot] & (SLOT_VALID | SLOT_FILLING | SLOT_LOST)) != SLOT_VALID)
+        {
+            continue;
+        }
+        if (crc32c(0, slot_data(slot), BLOCK_SIZE) != table_->slot_csum[slot])
+        {
+            bad++;
+            check_slot(slot);
+        }
+    }
+
+    return bad;
+}
+
+
+
+void CacheShard::abort_fill(uint32_t slot)
+{
+    resident_[cache_key_device(table_->slot_key[slot])]--;
+    write_begin();
+    index_remove(table_->slot_key[slot]);
+    table_->slot_flags[slot] = 0;
+    write_end();
+}
+
+
+
+/*
+Registers a fill of the freshly claimed slot, so that later requests for
+the same block wait for it instead of going to the device.
+*/
+InflightFill* CacheShard::start_fill(PageCache* cache, uint32_t slot)
+{
+    InflightFill* fill = new InflightFill;
+    fill->cache = cache;
+    fill->key = table_->slot_key[slot];
+    fill->data = slot_data(slot);
+    fill->waiters = NULL;
+    fill->queue_next = NULL;
+
+    fill->next = inflight_;
+    inflight_ = fill;
+    return fill;
+}
+
+
+
+InflightFill* CacheShard::find_fill(CacheKey key)
+{
+    for (InflightFill* fill = inflight_; fill; fill = fill->next)
+    {
+        if (fill->key == key)
+        {
+            return fill;
+        }
+    }
+    return NULL;
+}
+
+
+
+void CacheShard::join_fill(InflightFill* fill, CacheCompletion& completion)
+{
+    completion.done = false;
+    completion.next = fill->waiters;
+    fill->waiters = &completion;
+}
+
+
+
+/*
+Ends the fill of key: the slot is published with flags (or dropped if
+the fetch failed), and the block is copied out to every waiter that asked
+for it.  Returns the waiters, which the caller must hand to
+notify_completions() once it has dropped the lock.
+*/
+CacheCompletion* CacheShard::complete_fill(CacheKey key, bool ok, uint8_t flags)
+{
+    InflightFill** link = &inflight_;
+    while (*link && (*link)->key != key)
+    {
+        link = &(*link)->next;
+    }
+
+    InflightFill* fill = *link;
+    assert(fill);
+    *link = fill->next;
+
+    uint32_t slot = lookup_slot(key);
+    if (ok)
+    {
+        for (CacheCompletion* waiter = fill->waiters; waiter; waiter = waiter->next)
+        {
+            if (waiter->buffer)
+            {
+                copy_blocks(waiter->buffer, slot_data(slot), 1);
+            }
+        }
+        finish_fill(slot, flags);
+    }
+    else
+    {
+        abort_fill(slot);
+    }
+
+    CacheCompletion* waiters = fill->waiters;
+    delete fill;
+    return waiters;
+}
+
+
+
+bool CacheShard::flush()
+{
+    bool ok = true;
+    uint32_t nr = nr_pages_ * SECTORS_PER_PAGE;
+
+    for (uint32_t slot = 0; slot < nr; slot++)
+    {
+        if ((table_->slot_flags[slot] & (SLOT_VALID | SLOT_DIRTY)) != (SLOT_VALID | SLOT_DIRTY))
+        {
+            continue;
+        }
+
+        CacheBackingStore* store = slot_store(slot);
+        if (store && store->store_blocks(slot_data(slot), cache_key_lba(table_->slot_key[slot]), 1))
+        {
+            table_->slot_flags[slot] &= ~SLOT_DIRTY;
+            stats_->add(CACHE_WRITEBACKS);
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+
+
+/*
+Signals every completion on the chain, and wakes any thread sleeping on
+one.  The next pointer and the waiter are read before done is set,
+since a synchronous waiter may return (and its completion go out of
+scope) the moment it sees done.
+*/
+static void notify_completions(CacheCompletion* completion, bool ok)
+{
+    while (completion)
+    {
+        CacheCompletion* next = completion->next;
+        Thread* waiter = completion->waiter;
+
+        completion->ok = ok;
+        if (completion->callback)
+        {
+            completion->callback(*completion);
+        }
+        __atomic_store_n(&completion->done, true, __ATOMIC_RELEASE);
+
+        if (waiter)
+        {
+            waiter->wake_up();
+        }
+        completion = next;
+    }
+}
+
+
+
+/*
+Sleeps until a completion whose waiter is the current thread is done.
+The waiter must be set before the completion joins a fill, so the
+filling thread knows whom to wake.
+*/
+static void wait_completion(CacheCompletion& completion)
+{
+    while (true)
+    {
+        // Interrupts stay off from the check until we are asleep, so the
+        // filling thread cannot slip its wake_up() in between
+        UniqueIRQLock irq;
+        if (__atomic_load_n(&completion.done, __ATOMIC_ACQUIRE))
+        {
+            return;
+        }
+        Thread::current().sleep();
+    }
+}
+
+
+
+/*
+Asynchronous fills are handed to a single kernel thread, shared by every
+PageCache, which runs them in submission order.
+*/
+static Mutex fill_queue_lock;
+static InflightFill* fill_queue_head = NULL;
+static InflightFill* fill_queue_tail = NULL;
+static Thread* fill_worker = NULL;
+
+static void fill_worker_main(void*)
+{
+    while (true)
+    {
+        InflightFill* fill;
+        {
+            // Interrupts stay off from the empty check until we are asleep, so a
+            // submitter cannot slip its wake_up() in between.
+            UniqueIRQLock irq;
+            {
+                UniqueLock<Mutex> l(fill_queue_lock);
+                fill = fill_queue_head;
+                if (fill)
+                {
+                    fill_queue_head = fill->queue_next;
+                    if (!fill_queue_head)
+                    {
+                        fill_queue_tail = NULL;
+                    }
+                }
+            }
+
+            if (!fill)
+            {
+                Thread::current().sleep();
+                continue;
+            }
+        }
+
+        fill->cache->run_fill(*fill);
+    }
+}
+
+
+
+static void queue_fill(InflightFill* fill)
+{
+    UniqueLock<Mutex> l(fill_queue_lock);
+
+    if (!fill_worker)
+    {
+        fill_worker = &sys.kernel_process().create_thread(ThreadPrivilege::Kernel, (Thread::thread_proc_t)&fill_worker_main, "cache-fill");
+        fill_worker->start();
+    }
+
+    if (fill_queue_tail)
+    {
+        fill_queue_tail->queue_next = fill;
+    }
+    else
+    {
+        fill_queue_head = fill;
+    }
+    fill_queue_tail = fill;
+
+    fill_worker->wake_up();
+}
+
+
+
+// Shell sort, for the few thousand keys a snapshot holds at most
+static void sort_keys(uint64_t* keys, size_t count)
+{
+    size_t gap = 1;
+    while (gap < count / 3)
+    {
+        gap = gap * 3 + 1;
+    }
+
+    for (; gap > 0; gap /= 3)
+    {
+        for (size_t i = gap; i < count; i++)
+        {
+            uint64_t key = keys[i];
+            size_t j = i;
+            for (; j >= gap && keys[j - gap] > key; j -= gap)
+            {
+                keys[j] = keys[j - gap];
+            }
+            keys[j] = key;
+        }
+    }
+}
+
+
+
+static uint32_t snapshot_checksum(const CacheKey* keys, size_t count)
+{
+    const uint8_t* p = (const uint8_t*)keys;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < count * sizeof(CacheKey); i++)
+    {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+
+
+// The one prewarm allowed to run at a time, handed to its thread through here
+struct PrewarmJob
+{
+    PageCache* cache;
+    CacheKey* keys;
+    size_t count;
+};
+
+static Mutex prewarm_lock;
+static PrewarmJob* prewarm_job = NULL;
+
+static void prewarm_main(void*)
+{
+    PrewarmJob* job;
+    {
+        UniqueLock<Mutex> l(prewarm_lock);
+        job = prewarm_job;
+    }
+
+    job->cache->run_prewarm(job->keys, job->count);
+
+    delete[] job->keys;
+    delete job;
+
+    UniqueLock<Mutex> l(prewarm_lock);
+    prewarm_job = NULL;
+}
+
+
+
+BlockRequestQueue::~BlockRequestQueue()
+{
+    UniqueLock<Mutex> l(lock_);
+    dispatch(nr_pending_);
+}
+
+
+
+/*
+Fetches straight from the device, then lays any queued stores for the
+same blocks over the result, since they are newer than the device copy.
+*/
+bool BlockRequestQueue::fetch_blocks(void* buffer, uint64_t lba, size_t count)
+{
+    UniqueLock<Mutex> l(lock_);
+
+    if (!device_->fetch_blocks(buffer, lba, count))
+    {
+        return false;
+    }
+
+    uint64_t end = lba + count;
+    for (BlockRequest* rq = pending_; rq && rq->lba < end; rq = rq->next)
+    {
+        uint64_t from = rq->lba > lba ? rq->lba : lba;
+        uint64_t to = rq->lba + rq->count < end ? rq->lba + rq->count : end;
+        if (from < to)
+        {
+            copy_blocks((uint8_t*)buffer + (from - lba) * BLOCK_SIZE,
+                        rq->data + (from - rq->lba) * BLOCK_SIZE, to - from);
+        }
+    }
+
+    return true;
+}
+
+
+
+/*
+Queues a store while plugged, otherwise sends it straight to the device.
+A queued store always succeeds here; a failure when it is dispatched
+later is reported by unplug().
+*/
+bool BlockRequestQueue::store_blocks(const void* buffer, uint64_t lba, size_t count)
+{
+    UniqueLock<Mutex> l(lock_);
+
+    stats_.submitted++;
+
+    if (plug_depth_ > 0 && count <= REQUEST_MAX_BLOCKS)
+    {
+        // Overlapping a queued store: send the old data out first, so the device sees them in order
+        if (!queue_store((const uint8_t*)buffer, lba, count))
+        {
+            dispatch(nr_pending_);
+            queue_store((const uint8_t*)buffer, lba, count);
+        }
+
+        if (nr_pending_ >= REQUEST_QUEUE_DEPTH)
+        {
+            dispatch(REQUEST_BATCH);
+        }
+        return true;
+    }
+
+    dispatch(nr_pending_);
+    stats_.dispatched++;
+    return device_->store_blocks(buffer, lba, count);
+}
+
+
+
+void BlockRequestQueue::plug()
+{
+    UniqueLock<Mutex> l(lock_);
+    plug_depth_++;
+}
+
+
+
+bool BlockRequestQueue::unplug()
+{
+    UniqueLock<Mutex> l(lock_);
+
+    if (--plug_depth_ > 0)
+    {
+        return true;
+    }
+
+    dispatch(nr_pending_);
+
+    bool ok = !failed_;
+    failed_ = false;
+    return ok;
+}
+
+
+
+void BlockRequestQueue::stats(RequestQueueStats& out) const
+{
+    UniqueLock<Mutex> l(lock_);
+    out = stats_;
+}
+
+
+
+/*
+Inserts a store into the sorted queue, merging it with the request
+that ends where it starts and/or the one that starts where it ends.
+Returns false, without queueing anything, if it overlaps a queued
+request.
+*/
+bool BlockRequestQueue::queue_store(const uint8_t* buffer, uint64_t lba, uint32_t count)
+{
+    uint64_t end = lba + count;
+    BlockRequest* prev = NULL;
+    BlockRequest* next = pending_;
+
+    while (next && next->lba < lba)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    if ((prev && prev->lba + prev->count > lba) || (next && next->lba < end))
+    {
+        return false;
+    }
+
+    clock_++;
+
+    if (prev && prev->lba + prev->count == lba && merge_into(prev, buffer, lba, count))
+    {
+        // It may have closed the gap to the next one as well
+        if (next && next->lba == end && merge_into(prev, next->data, next->lba, next->count))
+        {
+            if (next->deadline < prev->deadline)
+            {
+                prev->deadline = next->deadline;
+            }
+            prev->next = next->next;
+            nr_pending_--;
+
+            delete[] next->data;
+            delete next;
+        }
+
+        stats_.merged++;
+        return true;
+    }
+
+    if (next && next->lba == end && merge_into(next, buffer, lba, count))
+    {
+        stats_.merged++;
+        return true;
+    }
+
+    BlockRequest* rq = new BlockRequest;
+    rq->lba = lba;
+    rq->count = count;
+    rq->capacity = count;
+    rq->deadline = clock_ + REQUEST_DEADLINE;
+    rq->data = new uint8_t[count * BLOCK_SIZE];
+    copy_blocks(rq->data, buffer, count);
+
+    rq->next = next;
+    if (prev)
+    {
+        prev->next = rq;
+    }
+    else
+    {
+        pending_ = rq;
+    }
+    nr_pending_++;
+
+    return true;
+}
+
+
+
+/*
+Extends rq with count blocks that sit directly before or after it,
+growing its buffer by doubling.  Returns false if the result would be
+longer than REQUEST_MAX_BLOCKS.
+*/
+bool BlockRequestQueue::merge_into(BlockRequest* rq, const uint8_t* buffer, uint64_t lba, uint32_t count)
+{
+    uint32_t total = rq->count + count;
+    if (total > REQUEST_MAX_BLOCKS)
+    {
+        return false;
+    }
+
+    bool front = lba < rq->lba;
+
+    if (total > rq->capacity)
+    {
+        uint32_t capacity = rq->capacity * 2;
+        if (capacity < total)
+        {
+            capacity = total;
+        }
+        if (capacity > REQUEST_MAX_BLOCKS)
+        {
+            capacity = REQUEST_MAX_BLOCKS;
+        }
+
+        uint8_t* data = new uint8_t[capacity * BLOCK_SIZE];
+        copy_blocks(data + (front ? count * BLOCK_SIZE : 0), rq->data, rq->count);
+        delete[] rq->data;
+
+        rq->data = data;
+        rq->capacity = capacity;
+    }
+    else if (front)
+    {
+        memmove(rq->data + count * BLOCK_SIZE, rq->data, rq->count * BLOCK_SIZE);
+    }
+
+    copy_blocks(rq->data + (front ? 0 : rq->count * BLOCK_SIZE), buffer, count);
+    if (front)
+    {
+        rq->lba = lba;
+    }
+    rq->count = total;
+
+    return true;
+}
+
+
+
+/*
+Chooses the next request to dispatch: the one whose deadline passed
+first, if any has, else the first at or after the head, wrapping back
+to the lowest offset at the end of the disk.
+*/
+BlockRequest* BlockRequestQueue::pick_next()
+{
+    BlockRequest* oldest = pending_;
+    BlockRequest* ahead = NULL;
+
+    for (BlockRequest* rq = pending_; rq; rq = rq->next)
+    {
+        if (rq->deadline < oldest->deadline)
+        {
+            oldest = rq;
+        }
+        if (!ahead && rq->lba >= head_)
+        {
+            ahead = rq;
+        }
+    }
+
+    if (oldest && oldest->deadline <= clock_)
+    {
+        stats_.expired++;
+        return oldest;
+    }
+
+    return ahead ? ahead : pending_;
+}
+
+
+
+// Sends up to nr_commands queued requests to the device, in elevator order
+bool BlockRequestQueue::dispatch(size_t nr_commands)
+{
+    bool ok = true;
+
+    while (nr_commands-- > 0 && pending_)
+    {
+        BlockRequest* rq = pick_next();
+
+        BlockRequest** link = &pending_;
+        while (*link != rq)
+        {
+            link = &(*link)->next;
+        }
+        *link = rq->next;
+        nr_pending_--;
+
+        stats_.dispatched++;
+        if (!device_->store_blocks(rq->data, rq->lba, rq->count))
+        {
+            cache_log.messagef(LogLevel::ERROR, "cache: queued store failed offset=%lu count=%u", (unsigned long)rq->lba, rq->count);
+            failed_ = true;
+            ok = false;
+        }
+        head_ = rq->lba + rq->count;
+
+        delete[] rq->data;
+        delete rq;
+    }
+
+    return ok;
+}
+
+
+
+/*
+The tier's codec: byte-oriented LZ77 in the style of LZ4.  A sequence is
+a token (literal count in the high nibble, match length - 4 in the low;
+15 means more follows as a run of 255s ended by a smaller byte), the
+literals, then a 2-byte little-endian match offset and any extra match
+length.  The last sequence carries literals only.  Matches are found
+through a small hash table of 4-byte prefixes, which for a block fits
+in 512 bytes of stack.
+*/
+# define LZ_MIN_MATCH 4
+# define LZ_HASH_BITS 8
+
+static inline uint32_t lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool lz_put_length(uint8_t*& op, uint8_t* end, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (op >= end)
+        {
+            return false;
+        }
+        *op++ = 255;
+    }
+
+    if (op >= end)
+    {
+        return false;
+    }
+    *op++ = length;
+    return true;
+}
+
+static bool lz_put_sequence(uint8_t*& op, uint8_t* end, const uint8_t* literals, size_t nr_literals,
+                            size_t offset, size_t match)
+{
+    if (op >= end)
+    {
+        return false;
+    }
+
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+    *op++ = ((nr_literals < 15 ? nr_literals : 15) << 4) | (extra < 15 ? extra : 15);
+    if (nr_literals >= 15 && !lz_put_length(op, end, nr_literals - 15))
+    {
+        return false;
+    }
+
+    if ((size_t)(end - op) < nr_literals)
+    {
+        return false;
+    }
+    memcpy(op, literals, nr_literals);
+    op += nr_literals;
+
+    if (!match)
+    {
+        return true;
+    }
+
+    if (end - op < 2)
+    {
+        return false;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    return extra < 15 || lz_put_length(op, end, extra - 15);
+}
+
+size_t infos::drivers::ata::lz_compress(const uint8_t* in, size_t length, uint8_t* out, size_t max_out)
+{
+    uint16_t table[1 << LZ_HASH_BITS] = { }; // position + 1 of the last prefix with this hash
+    uint8_t* op = out;
+    uint8_t* end = out + max_out;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    while (ip + LZ_MIN_MATCH <= length)
+    {
+        uint32_t prefix = lz_read32(in + ip);
+        uint32_t h = (prefix * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+
+        if (!ref || ip - (ref - 1) > 0xffff || lz_read32(in + ref - 1) != prefix)
+        {
+            ip++;
+            continue;
+        }
+
+        ref--;
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < length && in[ref + match] == in[ip + match])
+        {
+            match++;
+        }
+
+        if (!lz_put_sequence(op, end, in + anchor, ip - anchor, ip - ref, match))
+        {
+            return 0;
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    if (!lz_put_sequence(op, end, in + anchor, length - anchor, 0, 0))
+    {
+        return 0;
+    }
+
+    return op - out;
+}
+
+static bool lz_get_length(const uint8_t*& ip, const uint8_t* end, size_t& length)
+{
+    uint8_t b;
+    do
+    {
+        if (ip >= end)
+        {
+            return false;
+        }
+        b = *ip++;
+        length += b;
+    } while (b == 255);
+
+    return true;
+}
+
+bool infos::drivers::ata::lz_decompress(const uint8_t* in, size_t in_length, uint8_t* out, size_t out_length)
+{
+    const uint8_t* ip = in;
+    const uint8_t* in_end = in + in_length;
+    size_t op = 0;
+
+    while (ip < in_end)
+    {
+        uint8_t token = *ip++;
+
+        size_t nr_literals = token >> 4;
+        if (nr_literals == 15 && !lz_get_length(ip, in_end, nr_literals))
+        {
+            return false;
+        }
+        if ((size_t)(in_end - ip) < nr_literals || out_length - op < nr_literals)
+        {
+            return false;
+        }
+        memcpy(out + op, ip, nr_literals);
+        ip += nr_literals;
+        op += nr_literals;
+
+        if (ip == in_end)
+        {
+            break;
+        }
+
+        if (in_end - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t match = token & 15;
+        if (match == 15 && !lz_get_length(ip, in_end, match))
+        {
+            return false;
+        }
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || out_length - op < match)
+        {
+            return false;
+        }
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < match; i++, op++)
+        {
+            out[op] = out[op - offset];
+        }
+    }
+
+    return op == out_length;
+}
+
+
+
+CompressedTier::CompressedTier(CacheStatCounters* stats, size_t min_bytes, size_t max_bytes)
+    : stats_(stats), staged_(new uint8_t[TIER_STAGED * BLOCK_SIZE]),
+      budget_(max_bytes / 2), min_budget_(min_bytes), max_budget_(max_bytes)
+{
+}
+
+
+
+CompressedTier::~CompressedTier()
+{
+    evict_to(0);
+    delete[] staged_;
+}
+
+
+
+/*
+Takes a clean block that is leaving the shards.  It is only copied into
+the staging ring here, as the caller holds a shard lock; drain()
+compresses it later.  If the ring is full the oldest staged block makes
+way.
+*/
+void CompressedTier::stage(CacheKey key, const uint8_t* data)
+{
+    UniqueLock<Mutex> l(lock_);
+
+    size_t index = (staged_head_ + nr_staged_) % TIER_STAGED;
+    if (nr_staged_ == TIER_STAGED)
+    {
+        staged_head_ = (staged_head_ + 1) % TIER_STAGED;
+    }
+    else
+    {
+        nr_staged_++;
+    }
+
+    staged_keys_[index] = key;
+    staged_valid_[index] = true;
+    memcpy(staged_ + index * BLOCK_SIZE, data, BLOCK_SIZE);
+}
+
+
+
+// Compresses the staged blocks into the tier.  Called without shard locks held.
+void CompressedTier::drain()
+{
+    uint8_t data[BLOCK_SIZE];
+
+    for (;;)
+    {
+        CacheKey key;
+        uint32_t invalidations;
+        {
+            UniqueLock<Mutex> l(lock_);
+            while (nr_staged_ && !staged_valid_[staged_head_])
+            {
+                staged_head_ = (staged_head_ + 1) % TIER_STAGED;
+                nr_staged_--;
+            }
+            if (!nr_staged_)
+            {
+                return;
+            }
+
+            key = staged_keys_[staged_head_];
+            memcpy(data, staged_ + staged_head_ * BLOCK_SIZE, BLOCK_SIZE);
+            staged_head_ = (staged_head_ + 1) % TIER_STAGED;
+            nr_staged_--;
+            invalidations = invalidations_;
+        }
+
+        store(key, data, invalidations);
+    }
+}
+
+
+
+/*
+Keeps a compressed copy of a staged block.  Any older copy is dropped
+first, so the tier never holds stale data even when the new one does not
+compress well enough to keep.  The block is dropped too if anything was
+invalidated while it was being compressed, as it may be out of date.
+*/
+void CompressedTier::store(CacheKey key, const uint8_t* data, uint32_t invalidations)
+{
+    uint8_t compressed[TIER_MAX_COMPRESSED];
+    size_t length = lz_compress(data, BLOCK_SIZE, compressed, sizeof(compressed));
+
+    TierEntry* entry = NULL;
+    if (length)
+    {
+        entry = (TierEntry*)new uint8_t[sizeof(TierEntry) + length];
+        entry->key = key;
+        entry->length = length;
+        memcpy(entry->data(), compressed, length);
+    }
+
+    UniqueLock<Mutex> l(lock_);
+
+    if (invalidations != invalidations_)
+    {
+        delete[] (uint8_t*)entry;
+        return;
+    }
+
+    TierEntry** link = find(key);
+    if (*link)
+    {
+        unlink(link);
+    }
+
+    if (!entry)
+    {
+        stats_->add(CACHE_TIER_REJECTS);
+        return;
+    }
+
+    entry->hash_next = buckets_[key % TIER_BUCKETS];
+    buckets_[key % TIER_BUCKETS] = entry;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head_;
+    if (lru_head_)
+    {
+        lru_head_->lru_prev = entry;
+    }
+    else
+    {
+        lru_tail_ = entry;
+    }
+    lru_head_ = entry;
+
+    nr_entries_++;
+    bytes_ += sizeof(TierEntry) + length;
+    stats_->add(CACHE_TIER_STORES);
+
+    evict_to(budget_);
+}
+
+
+
+// Takes a block out of the tier into data.  Returns false if it is not here.
+bool CompressedTier::load(CacheKey key, uint8_t* data)
+{
+    drain();
+
+    UniqueLock<Mutex> l(lock_);
+
+    TierEntry** link = find(key);
+    bool hit = *link && lz_decompress((*link)->data(), (*link)->length, data, BLOCK_SIZE);
+
+    if (*link)
+    {
+        unlink(link);
+    }
+
+    adapt(hit);
+    if (hit)
+    {
+        stats_->add(CACHE_TIER_HITS);
+    }
+    return hit;
+}
+
+
+
+void CompressedTier::invalidate(CacheKey key)
+{
+    UniqueLock<Mutex> l(lock_);
+    invalidations_++;
+
+    for (size_t i = 0; i < nr_staged_; i++)
+    {
+        size_t index = (staged_head_ + i) % TIER_STAGED;
+        if (staged_keys_[index] == key)
+        {
+            staged_valid_[index] = false;
+        }
+    }
+
+    TierEntry** link = find(key);
+    if (*link)
+    {
+        unlink(link);
+    }
+}
+
+
+
+// Shrinker hook: drops at least nr_bytes (if held) and lowers the budget to
+// match.  Drops nothing if the tier is locked, as the shrinker cannot wait.
+size_t CompressedTier::trim(size_t nr_bytes)
+{
+    if (!lock_.try_lock())
+    {
+        return 0;
+    }
+
+    size_t before = bytes_;
+    evict_to(bytes_ > nr_bytes ? bytes_ - nr_bytes : 0);
+
+    budget_ = bytes_ > min_budget_ ? bytes_ : min_budget_;
+    lock_.unlock();
+    return before - bytes_;
+}
+
+
+
+TierEntry** CompressedTier::find(CacheKey key)
+{
+    TierEntry** link = &buckets_[key % TIER_BUCKETS];
+    while (*link && (*link)->key != key)
+    {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+
+
+void CompressedTier::unlink(TierEntry** link)
+{
+    TierEntry* entry = *link;
+    *link = entry->hash_next;
+
+    if (entry->lru_prev)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        lru_head_ = entry->lru_next;
+    }
+    if (entry->lru_next)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        lru_tail_ = entry->lru_prev;
+    }
+
+    nr_entries_--;
+    bytes_ -= sizeof(TierEntry) + entry->length;
+    delete[] (uint8_t*)entry;
+}
+
+
+
+void CompressedTier::evict_to(size_t nr_bytes)
+{
+    while (bytes_ > nr_bytes && lru_tail_)
+    {
+        unlink(find(lru_tail_->key));
+    }
+}
+
+
+
+void CompressedTier::adapt(bool hit)
+{
+    window_lookups_++;
+    window_hits_ += hit;
+
+    if (window_lookups_ < TIER_WINDOW)
+    {
+        return;
+    }
+
+    size_t step = max_budget_ / 8;
+    if (window_hits_ * TIER_GROW_SHARE > window_lookups_)
+    {
+        budget_ = budget_ + step < max_budget_ ? budget_ + step : max_budget_;
+    }
+    else if (window_hits_ * TIER_SHRINK_SHARE < window_lookups_)
+    {
+        budget_ = budget_ > min_budget_ + step ? budget_ - step : min_budget_;
+        evict_to(budget_);
+    }
+
+    window_lookups_ = 0;
+    window_hits_ = 0;
+}
+
+
+
+void CacheStatCounters::snapshot(CacheStats& stats) const
+{
+    for (unsigned int i = 0; i < NR_CACHE_COUNTERS; i++)
+    {
+        stats.counters[i] = 0;
+    }
+    for (unsigned int i = 0; i < CACHE_LATENCY_BUCKETS; i++)
+    {
+        stats.miss_latency[i] = 0;
+    }
+
+    for (auto& stripe : stripes_)
+    {
+        for (unsigned int i = 0; i < NR_CACHE_COUNTERS; i++)
+        {
+            stats.counters[i] += __atomic_load_n(&stripe.counters[i], __ATOMIC_RELAXED);
+        }
+        for (unsigned int i = 0; i < CACHE_LATENCY_BUCKETS; i++)
+        {
+            stats.miss_latency[i] += __atomic_load_n(&stripe.miss_latency[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+
+void CacheStatCounters::reset()
+{
+    for (auto& stripe : stripes_)
+    {
+        for (unsigned int i = 0; i < NR_CACHE_COUNTERS; i++)
+        {
+            __atomic_store_n(&stripe.counters[i], 0, __ATOMIC_RELAXED);
+        }
+        for (unsigned int i = 0; i < CACHE_LATENCY_BUCKETS; i++)
+        {
+            __atomic_store_n(&stripe.miss_latency[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+
+void MissRatioEstimator::reset()
+{
+    UniqueLock<Mutex> l(lock_);
+
+    __atomic_store_n(&threshold_, MRC_HASH_SPACE / MRC_INITIAL_RATE, __ATOMIC_RELAXED);
+    nr_samples_ = 0;
+    clock_ = 0;
+    references_ = 0;
+    for (unsigned int i = 0; i < MRC_BUCKETS; i++)
+    {
+        histogram_[i] = 0;
+    }
+}
+
+
+
+/*
+Feeds one block access to the estimator.  Unsampled offsets (the vast
+majority) cost a hash and a compare, with no lock taken.  Each sampled
+reference counts for the inverse of the sampling rate it was taken at,
+so references from before and after the threshold drops are weighed
+alike.
+*/
+void MissRatioEstimator::access(CacheKey key)
+{
+    uint32_t hash = sample_hash(key);
+    if (hash >= __atomic_load_n(&threshold_, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    UniqueLock<Mutex> l(lock_);
+
+    // The threshold may have dropped while we waited for the lock
+    if (hash >= threshold_)
+    {
+        return;
+    }
+
+    size_t found = nr_samples_;
+    for (size_t i = 0; i < nr_samples_; i++)
+    {
+        if (samples_[i].key == key)
+        {
+            found = i;
+            break;
+        }
+    }
+
+    if (found < nr_samples_)
+    {
+        uint64_t now = ++clock_;
+        uint64_t weight = reference_weight();
+        references_ += weight;
+
+        // Reuse distance: distinct sampled offsets touched since the last access
+        // to this one, scaled up by the sampling rate.  Each sampled offset
+        // stands for a run of 1/rate offsets, so take the middle of the run.
+        uint64_t last = samples_[found].last_access;
+        uint64_t distinct = 0;
+        for (size_t i = 0; i < nr_samples_; i++)
+        {
+            distinct += samples_[i].last_access > last;
+        }
+
+        uint64_t distance = (2 * distinct + 1) * MRC_HASH_SPACE / (2 * (uint64_t)threshold_);
+        uint64_t bucket = distance / MRC_BUCKET_BLOCKS;
+        if (bucket < MRC_BUCKETS)
+        {
+            histogram_[bucket] += weight;
+        }
+
+        samples_[found].last_access = now;
+        return;
+    }
+
+    // A cold reference; it misses at every cache size.  If the set is full,
+    // whichever of it and the samples has the largest hash goes, and the
+    // threshold drops to that hash; a key that goes itself is not counted.
+    if (nr_samples_ == MRC_MAX_SAMPLES)
+    {
+        size_t largest = 0;
+        for (size_t i = 1; i < nr_samples_; i++)
+        {
+            if (samples_[i].hash > samples_[largest].hash)
+            {
+                largest = i;
+            }
+        }
+
+        if (hash >= samples_[largest].hash)
+        {
+            __atomic_store_n(&threshold_, hash, __ATOMIC_RELAXED);
+            return;
+        }
+
+        uint32_t dropped = samples_[largest].hash;
+        samples_[largest] = samples_[--nr_samples_];
+        __atomic_store_n(&threshold_, dropped, __ATOMIC_RELAXED);
+    }
+
+    uint64_t now = ++clock_;
+    references_ += reference_weight();
+
+    samples_[nr_samples_].key = key;
+    samples_[nr_samples_].hash = hash;
+    samples_[nr_samples_].last_access = now;
+    nr_samples_++;
+}
+
+
+
+uint32_t MissRatioEstimator::miss_ratio_locked(size_t nr_blocks)
+{
+    if (references_ == 0)
+    {
+        return 1000;
+    }
+
+    // A reference hits in an LRU cache of nr_blocks blocks if its reuse distance
+    // is smaller than nr_blocks.
+    size_t buckets = nr_blocks / MRC_BUCKET_BLOCKS;
+    if (buckets > MRC_BUCKETS)
+    {
+        buckets = MRC_BUCKETS;
+    }
+
+    uint64_t hits = 0;
+    for (size_t i = 0; i < buckets; i++)
+    {
+        hits += histogram_[i];
+    }
+
+    return (uint32_t)(1000 - hits * 1000 / references_);
+}
+
+
+
+// Predicted miss ratio, in parts per thousand, for an LRU cache of nr_blocks blocks
+uint32_t MissRatioEstimator::miss_ratio_permille(size_t nr_blocks)
+{
+    UniqueLock<Mutex> l(lock_);
+    return miss_ratio_locked(nr_blocks);
+}
+
+
+
+/*
+Fills permille[i] with the predicted miss ratio for a cache of
+(i + 1) * MRC_BUCKET_BLOCKS blocks, and returns the number of points
+written (at most MRC_BUCKETS).
+*/
+size_t MissRatioEstimator::curve(uint32_t* permille, size_t nr_points)
+{
+    UniqueLock<Mutex> l(lock_);
+
+    if (nr_points > MRC_BUCKETS)
+    {
+        nr_points = MRC_BUCKETS;
+    }
+
+    uint64_t hits = 0;
+    for (size_t i = 0; i < nr_points; i++)
+    {
+        hits += histogram_[i];
+        permille[i] = references_ ? (uint32_t)(1000 - hits * 1000 / references_) : 1000;
+    }
+
+    return nr_points;
+}
+
+
+
+/*
+Returns the smallest cache size, in blocks, predicted to keep the miss
+ratio at or below target_miss_permille, or 0 if no size on the curve
+does.
+*/
+size_t MissRatioEstimator::suggest_capacity(uint32_t target_miss_permille)
+{
+    UniqueLock<Mutex> l(lock_);
+
+    for (size_t nr_blocks = MRC_BUCKET_BLOCKS; nr_blocks <= MRC_BUCKETS * MRC_BUCKET_BLOCKS; nr_blocks += MRC_BUCKET_BLOCKS)
+    {
+        if (miss_ratio_locked(nr_blocks) <= target_miss_permille)
+        {
+            return nr_blocks;
+        }
+    }
+
+    return 0;
+}
+
+
+
+PageCache::PageCache()
+{
+    for (auto& shard : shards_)
+    {
+        shard.partitions_ = partitions_;
+        shard.stats_ = &stats_;
+    }
+}
+
+
+PageCache::~PageCache()
+{
+    unregister_shrinker(this);
+    flush();
+
+    for (auto& shard : shards_)
+    {
+        shard.tier_ = NULL;
+    }
+    delete tier_;
+}
+
+
+
+
+
+bool PageCache::init()
+{
+    copy_init();
+
+    // Initialize the cache
+    if (!set_capacity(CACHE_SIZE))
+    {
+        return false;
+    }
+
+    register_shrinker(this);
+
+    // The page allocator cannot start its zeroing thread before threads can
+    // be created, so it waits for a thread-context caller such as this one
+    if (pgalloc_ext)
+    {
+        pgalloc_ext->start_zeroing();
+    }
+
+    cache_log.messagef(LogLevel::DEBUG, "cache: Initialized %lu blocks in %u shards", nr_slots(), CACHE_SHARDS);
+    return true;
+}
+
+
+
+// Makes store the device behind keys with the given device number
+bool PageCache::attach_device(unsigned int device, CacheBackingStore* store)
+{
+    if (device >= CACHE_MAX_DEVICES)
+    {
+        return false;
+    }
+
+    // The shards read the partition under their own locks
+    for (auto& shard : shards_)
+    {
+        shard.lock_.lock();
+    }
+    partitions_[device].store = store;
+    for (auto& shard : shards_)
+    {
+        shard.lock_.unlock();
+    }
+
+    return true;
+}
+
+
+
+/*
+Sets a device's guaranteed minimum and cap, in blocks; a max_blocks of 0
+means no cap.  Fails if min_blocks is over the cap, or if the minimums
+of all devices together would not fit in the capacity.  Blocks a device
+already holds over a new cap are not thrown out; its later misses evict
+them first.
+*/
+bool PageCache::set_partition(unsigned int device, size_t min_blocks, size_t max_blocks)
+{
+    if (device >= CACHE_MAX_DEVICES || (max_blocks && min_blocks > max_blocks))
+    {
+        return false;
+    }
+
+    size_t reserved = reserved_blocks(device, min_blocks);
+    if (reserved > capacity())
+    {
+        cache_log.messagef(LogLevel::WARNING, "cache: %lu guaranteed blocks do not fit in %lu", reserved, capacity());
+        return false;
+    }
+
+    for (auto& shard : shards_)
+    {
+        shard.lock_.lock();
+    }
+    partitions_[device].min_blocks = min_blocks;
+    partitions_[device].max_blocks = max_blocks;
+    for (auto& shard : shards_)
+    {
+        shard.lock_.unlock();
+    }
+
+    return true;
+}
+
+
+
+/*
+Blocks the guaranteed minimums hold back, with device's minimum taken
+as min_blocks (pass CACHE_MAX_DEVICES to take them all as they are).
+Each shard keeps its share of every minimum, rounded up, so this can be
+a little over their sum.
+*/
+size_t PageCache::reserved_blocks(unsigned int device, size_t min_blocks) const
+{
+    size_t per_shard = 0;
+    for (unsigned int other = 0; other < CACHE_MAX_DEVICES; other++)
+    {
+        size_t min = other == device ? min_blocks : partitions_[other].min_blocks;
+        per_shard += (min + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    }
+    return per_shard * CACHE_SHARDS;
+}
+
+
+
+// Blocks the device holds right now, summed over the shards without their locks
+size_t PageCache::nr_resident(unsigned int device) const
+{
+    size_t nr = 0;
+    for (auto& shard : shards_)
+    {
+        nr += __atomic_load_n(&shard.resident_[device], __ATOMIC_RELAXED);
+    }
+    return nr;
+}
+
+
+
+// Lets request queues below collect a burst of writeback, see CacheBackingStore::plug()
+void PageCache::plug_devices()
+{
+    for (auto& partition : partitions_)
+    {
+        if (partition.store)
+        {
+            partition.store->plug();
+        }
+    }
+}
+
+
+
+bool PageCache::unplug_devices()
+{
+    bool ok = true;
+    for (auto& partition : partitions_)
+    {
+        if (partition.store)
+        {
+            ok &= partition.store->unplug();
+        }
+    }
+    return ok;
+}
+
+
+
+size_t PageCache::nr_pages() const
+{
+    size_t nr = 0;
+    for (auto& shard : shards_)
+    {
+        nr += shard.nr_pages_;
+    }
+    return nr;
+}
+
+
+
+size_t PageCache::capacity() const
+{
+    size_t nr = 0;
+    for (auto& shard : shards_)
+    {
+        nr += shard.target_pages_;
+    }
+    return nr * SECTORS_PER_PAGE;
+}
+
+
+
+// Spreads nr_pages new pages across the shards
+bool PageCache::grow(size_t nr_pages)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < nr_pages; i++)
+    {
+        ok &= grow_shard(shards_[i % CACHE_SHARDS], 1, false);
+    }
+
+    return ok;
+}
+
+
+
+/*
+Takes up to count single pages, in one call to the allocator's bulk
+path where it has one.  That path does not reclaim, so if it comes back
+empty a single page is asked for the usual way, which does.
+*/
+static size_t alloc_page_batch(PageDescriptor** pgds, size_t count)
+{
+    size_t got = pgalloc_ext ? pgalloc_ext->alloc_pages_bulk(0, pgds, count) : 0;
+    if (!got && (pgds[0] = sys.mm().pgalloc().alloc_pages(0)))
+    {
+        got = 1;
+    }
+    return got;
+}
+
+
+
+static void free_page_batch(PageDescriptor** pgds, size_t count)
+{
+    if (pgalloc_ext)
+    {
+        pgalloc_ext->free_pages_bulk(pgds, count, 0);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sys.mm().pgalloc().free_pages(pgds[i], 0);
+    }
+}
+
+
+
+/*
+Adds nr_pages pages to shard, stopping at its capacity if to_target is
+set.  The pages, taken from the allocator CACHE_GROW_BATCH at a time,
+and a bigger table when the shard needs one, are allocated before the
+shard lock is taken and handed over under it: when the page allocator
+runs low it calls reclaim_pages() before failing, and scan() passes
+over a shard whose lock is held.  Returns false if the allocator ran
+dry first; the pages that were added are kept.
+*/
+bool PageCache::grow_shard(CacheShard& shard, size_t nr_pages, bool to_target)
+{
+    ShardTable* spare = NULL;
+    PageDescriptor* batch[CACHE_GROW_BATCH];
+    size_t batch_size = 0;
+    size_t next = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < nr_pages; i++)
+    {
+        if (next == batch_size)
+        {
+            size_t count = nr_pages - i < CACHE_GROW_BATCH ? nr_pages - i : CACHE_GROW_BATCH;
+            batch_size = alloc_page_batch(batch, count);
+            next = 0;
+        }
+        if (next == batch_size)
+        {
+            cache_log.messagef(LogLevel::WARNING, "cache: out of pages after growing by %lu", i);
+            ok = false;
+            break;
+        }
+        PageDescriptor* pgd = batch[next++];
+
+        size_t wanted;
+        bool full = false;
+        do
+        {
+            {
+                UniqueLock<Mutex> l(shard.lock_);
+                full = to_target && shard.nr_pages_ >= shard.target_pages_;
+                wanted = full ? 0 : shard.add_page(pgd, spare);
+            }
+
+            // Room for the rest of the pages too, so this happens once per call
+            if (wanted)
+            {
+                if (spare)
+                {
+                    free_table(spare);
+                }
+                spare = alloc_table(wanted + nr_pages - i - 1);
+            }
+        } while (wanted);
+
+        if (full)
+        {
+            next--;
+            break;
+        }
+    }
+
+    // Whatever is left of the last batch goes back
+    if (next < batch_size)
+    {
+        free_page_batch(&batch[next], batch_size - next);
+    }
+
+    if (spare)
+    {
+        free_table(spare);
+    }
+    return ok;
+}
+
+
+
+/*
+Grows a shard that the shrinker left below its capacity back by a page,
+once the memory pressure has had time to pass.  Called on a miss,
+before the shard lock is taken.
+*/
+void PageCache::regrow(CacheShard& shard)
+{
+    if (!shard.wants_page())
+    {
+        return;
+    }
+
+    bool ok = grow_shard(shard, 1, true);
+
+    UniqueLock<Mutex> l(shard.lock_);
+    shard.under_pressure_ = !ok;
+    shard.pressure_stamp_ = shard.access_counter_;
+}
+
+
+
+/*
+Takes nr_pages pages from the shards round-robin, never leaving a shard
+with fewer than one page.  Returns the number of pages released.
+*/
+size_t PageCache::shrink(size_t nr_pages)
+{
+    size_t released = 0;
+    size_t idle = 0;
+
+    // Dirty blocks on the released pages are written back as one batch
+    plug_devices();
+
+    while (released < nr_pages && idle < CACHE_SHARDS)
+    {
+        CacheShard& shard = shards_[shrink_cursor_];
+        shrink_cursor_ = (shrink_cursor_ + 1) % CACHE_SHARDS;
+
+        UniqueLock<Mutex> l(shard.lock_);
+        if (shard.nr_pages_ > 1 && shard.shrink(1) == 1)
+        {
+            released++;
+            idle = 0;
+        }
+        else
+        {
+            idle++;
+        }
+    }
+
+    unplug_devices();
+
+    cache_log.messagef(LogLevel::DEBUG, "cache: released %lu pages, %lu left", released, this->nr_pages());
+    return released;
+}
+
+
+
+/*
+Sets the capacity to nr_blocks, rounded up so that every shard gets the
+same whole number of pages (at least one), which makes it a multiple of
+CACHE_SHARDS pages, and grows or shrinks the shards to match.  Fails,
+changing nothing, if the devices' guaranteed minimums would not fit in
+the new capacity.  Returns false too if the allocator could not supply
+enough pages, or if pinned blocks kept a shard from shrinking far
+enough; the new capacity is still recorded then, and the shards
+converge on it as they are used.
+*/
+bool PageCache::set_capacity(size_t nr_blocks)
+{
+    size_t nr_pages = (nr_blocks + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+    size_t per_shard = (nr_pages + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if (per_shard == 0)
+    {
+        per_shard = 1;
+    }
+
+    size_t reserved = reserved_blocks(CACHE_MAX_DEVICES, 0);
+    if (reserved > per_shard * CACHE_SHARDS * SECTORS_PER_PAGE)
+    {
+        cache_log.messagef(LogLevel::WARNING, "cache: %lu guaranteed blocks do not fit in %lu",
+            reserved, per_shard * CACHE_SHARDS * SECTORS_PER_PAGE);
+        return false;
+    }
+
+    bool ok = true;
+    for (auto& shard : shards_)
+    {
+        size_t nr_pages;
+        {
+            UniqueLock<Mutex> l(shard.lock_);
+            shard.target_pages_ = per_shard;
+            nr_pages = shard.nr_pages_;
+
+            if (per_shard < nr_pages)
+            {
+                size_t excess = nr_pages - per_shard;
+                ok &= shard.shrink(excess) == excess;
+            }
+        }
+
+        if (per_shard > nr_pages)
+        {
+            ok &= grow_shard(shard, per_shard - nr_pages, true);
+        }
+    }
+
+    return ok;
+}
+
+
+
+size_t PageCache::count_reclaimable()
+{
+    // Always keep one page per shard, so the cache keeps working under pressure.
+    // The compressed tier lives on the kernel heap, so it is not counted in pages.
+    size_t nr = 0;
+    for (auto& shard : shards_)
+    {
+        nr += shard.nr_pages_ > 1 ? shard.nr_pages_ - 1 : 0;
+    }
+    return nr;
+}
+
+
+
+/*
+Shrinker callback.  Releases up to nr_pages pages, taking them from the
+shards round-robin like shrink(), and holds the shards off growing back
+towards the capacity for SHRINK_REGROW_DELAY accesses.  The page
+allocator calls this when it is about to fail an allocation, possibly
+from a thread that holds one of our locks, so nothing here waits: a
+shard whose lock is taken is passed over, and only pages holding
+nothing but clean blocks are released, as dirty ones would need device
+I/O first.
+*/
+size_t PageCache::scan(size_t nr_pages)
+{
+    for (auto& shard : shards_)
+    {
+        if (shard.lock_.try_lock())
+        {
+            shard.under_pressure_ = true;
+            shard.pressure_stamp_ = shard.access_counter_;
+            shard.lock_.unlock();
+        }
+    }
+
+    // The compressed tier is trimmed as well, as it is the cheapest memory to
+    // give up, but what it frees goes back to the heap rather than the page
+    // allocator, so only the shards' pages count towards nr_pages
+    if (tier_)
+    {
+        tier_->trim(nr_pages * SECTORS_PER_PAGE * BLOCK_SIZE);
+    }
+
+    size_t released = 0;
+    size_t idle = 0;
+
+    while (released < nr_pages && idle < CACHE_SHARDS)
+    {
+        CacheShard& shard = shards_[shrink_cursor_];
+        shrink_cursor_ = (shrink_cursor_ + 1) % CACHE_SHARDS;
+
+        if (!shard.lock_.try_lock())
+        {
+            idle++;
+            continue;
+        }
+
+        if (shard.nr_pages_ > 1 && shard.shrink(1, true) == 1)
+        {
+            released++;
+            idle = 0;
+        }
+        else
+        {
+            idle++;
+        }
+        shard.lock_.unlock();
+    }
+
+    return released;
+}
+
+
+
+void PageCache::count_hit(CacheShard& shard, uint32_t slot)
+{
+    stats_.add(CACHE_HITS);
+
+    // The first hit on a readahead block is what made the readahead worthwhile.
+    // Hits can come in without the lock, so the flag is cleared atomically.
+    uint8_t* flags = &shard.table_->slot_flags[slot];
+    if ((__atomic_load_n(flags, __ATOMIC_RELAXED) & SLOT_READAHEAD) &&
+        (__atomic_fetch_and(flags, (uint8_t)~SLOT_READAHEAD, __ATOMIC_RELAXED) & SLOT_READAHEAD))
+    {
+        stats_.add(CACHE_READAHEAD_HITS);
+    }
+}
+
+
+
+/*
+Waits for the in-flight fill of key, if there still is one, and
+copies the block to buffer (if given).  Must be called without the
+shard lock.  Returns true if the block arrived; false if the fill failed
+or had already finished, in which case the caller looks again.
+*/
+bool PageCache::wait_for_fill(CacheShard& shard, CacheKey key, void* buffer)
+{
+    CacheCompletion completion;
+    completion.buffer = buffer;
+    completion.waiter = &Thread::current();
+
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+        InflightFill* fill = shard.find_fill(key);
+        if (!fill)
+        {
+            return false;
+        }
+        shard.join_fill(fill, completion);
+    }
+
+    wait_completion(completion);
+    return completion.ok;
+}
+
+
+
+/*
+Reads count blocks starting at key into buffer.  Hits are
+copied straight out of the cache, without the shard lock when nothing
+is changing the shard, and a block that another request is already
+fetching is waited for rather than fetched again.
+
+Each miss is grown into a span (of at most EXTENT_MAX_SPAN blocks) that
+swallows later misses, as long as no more than EXTENT_GAP_LIMIT cached
+blocks sit between them.  Before going to the device, every missing
+block in the span is claimed as an in-flight fill and every cached one
+is pinned, so concurrent misses on the span coalesce onto this read and
+nothing in it can be evicted.  The whole span is then fetched with a
+single device read directly into the caller's buffer, with no lock held.
+Finally the cached copies are laid over the device data (they may be
+dirty, so the cache wins) and the claimed slots are filled.
+*/
+bool PageCache::read_extent(void* buffer, CacheKey key, size_t count)
+{
+    uint8_t* out = (uint8_t*)buffer;
+    size_t i = 0;
+
+    for (size_t j = 0; j < count; j++)
+    {
+        mrc_.access(key + j);
+    }
+
+    while (i < count)
+    {
+        CacheKey offset = key + i;
+        CacheShard& shard = shard_for(offset);
+
+        uint32_t slot = shard.try_read(out + i * BLOCK_SIZE, offset);
+        if (slot != NO_SLOT)
+        {
+            cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE HIT] offset=" KEY_FMT, KEY_ARGS(offset));
+            count_hit(shard, slot);
+            i++;
+            continue;
+        }
+
+        bool filling;
+        {
+            UniqueLock<Mutex> l(shard.lock_);
+            slot = shard.lookup_slot(offset);
+            if (slot != NO_SLOT && !(shard.table_->slot_flags[slot] & SLOT_FILLING))
+            {
+                if (!shard.verify_hit(slot))
+                {
+                    return false;
+                }
+
+                cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE HIT] offset=" KEY_FMT, KEY_ARGS(offset));
+                copy_blocks(out + i * BLOCK_SIZE, shard.slot_data(slot), 1);
+                shard.touch_slot(slot);
+                count_hit(shard, slot);
+                i++;
+                continue;
+            }
+            filling = slot != NO_SLOT;
+        }
+
+        if (filling)
+        {
+            // Already on its way from the device for someone else
+            if (wait_for_fill(shard, offset, out + i * BLOCK_SIZE))
+            {
+                cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE MISS] offset=" KEY_FMT " (coalesced)", KEY_ARGS(offset));
+                stats_.add(CACHE_MISSES);
+                stats_.add(CACHE_COALESCED_MISSES);
+                i++;
+            }
+            continue;
+        }
+
+        // Grow the miss span [start, end)
+        size_t start = i;
+        size_t end = i + 1;
+        size_t gap = 0;
+        for (size_t j = i + 1; j < count && j < start + EXTENT_MAX_SPAN; j++)
+        {
+            if (shard_for(key + j).contains(key + j))
+            {
+                if (++gap > EXTENT_GAP_LIMIT)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                gap = 0;
+                end = j + 1;
+            }
+        }
+
+        uint64_t claimed = 0;
+        uint64_t pinned = 0;
+        for (size_t j = start; j < end; j++)
+        {
+            CacheShard& target = shard_for(key + j);
+            regrow(target);
+            UniqueLock<Mutex> l(target.lock_);
+
+            slot = target.lookup_slot(key + j);
+            if (slot != NO_SLOT)
+            {
+                if (!(target.table_->slot_flags[slot] & SLOT_FILLING))
+                {
+                    target.table_->slot_pins[slot]++;
+                    pinned |= 1ull << (j - start);
+                }
+                continue;
+            }
+
+            cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE MISS] offset=" KEY_FMT, KEY_ARGS(key + j));
+            stats_.add(CACHE_MISSES);
+
+            slot = target.claim_slot(key + j);
+            if (slot != NO_SLOT)
+            {
+                target.start_fill(this, slot);
+                claimed |= 1ull << (j - start);
+            }
+        }
+
+        // Claimed blocks still held by the compressed tier need no device read
+        uint64_t from_tier = 0;
+        for (size_t j = start; tier_ && j < end; j++)
+        {
+            if ((claimed & (1ull << (j - start))) && tier_->load(key + j, out + j * BLOCK_SIZE))
+            {
+                from_tier |= 1ull << (j - start);
+            }
+        }
+
+        // Then read the stretch [lo, hi) that is left for the device, if any
+        uint64_t span = end - start == 64 ? ~0ull : (1ull << (end - start)) - 1;
+        uint64_t need = span & ~pinned & ~from_tier;
+        size_t lo = need ? start + __builtin_ctzll(need) : start;
+        size_t hi = need ? start + 64 - __builtin_clzll(need) : start;
+        bool ok = true;
+        bool failed = false;
+
+        if (lo < hi)
+        {
+            uint64_t issued = __builtin_ia32_rdtsc();
+            CacheBackingStore* store = store_for(key);
+            ok = store && store->fetch_blocks(out + lo * BLOCK_SIZE, cache_key_lba(key + lo), hi - lo);
+            if (ok)
+            {
+                stats_.record_miss_latency(__builtin_ia32_rdtsc() - issued);
+            }
+            else
+            {
+                cache_log.messagef(LogLevel::ERROR, "cache: fetch failed offset=" KEY_FMT " count=%u",
+                                   KEY_ARGS(key + lo), (unsigned int)(hi - lo));
+            }
+        }
+
+        for (size_t j = start; j < end; j++)
+        {
+            CacheKey target_key = key + j;
+            CacheShard& target = shard_for(target_key);
+            CacheCompletion* waiters = NULL;
+            bool filled = false;
+            bool filling_elsewhere = false;
+
+            {
+                UniqueLock<Mutex> l(target.lock_);
+                slot = target.lookup_slot(target_key);
+
+                if (claimed & (1ull << (j - start)))
+                {
+                    filled = ok || (from_tier & (1ull << (j - start)));
+                    if (filled)
+                    {
+                        copy_blocks(target.slot_data(slot), out + j * BLOCK_SIZE, 1);
+                    }
+                    waiters = target.complete_fill(target_key, filled);
+                }
+                else if (pinned & (1ull << (j - start)))
+                {
+                    // A bad clean copy that cannot be re-read leaves the device data, if we
+                    // fetched it; a lost one is newer than the device, so that will not do
+                    cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE HIT] offset=" KEY_FMT, KEY_ARGS(target_key));
+                    if (target.verify_hit(slot))
+                    {
+                        copy_blocks(out + j * BLOCK_SIZE, target.slot_data(slot), 1);
+                    }
+                    else if (j < lo || j >= hi || (target.table_->slot_flags[slot] & SLOT_LOST))
+                    {
+                        failed = true;
+                    }
+                    target.table_->slot_pins[slot]--;
+                    target.touch_slot(slot);
+                    count_hit(target, slot);
+                }
+                else
+                {
+                    filling_elsewhere = slot != NO_SLOT;
+                }
+            }
+
+            notify_completions(waiters, filled);
+
+            // If that fill fails the device data we just read stands, if we read any
+            if (filling_elsewhere && !wait_for_fill(target, target_key, out + j * BLOCK_SIZE) && (j < lo || j >= hi))
+            {
+                failed = true;
+            }
+        }
+
+        if (!ok || failed)
+        {
+            return false;
+        }
+
+        i = end;
+    }
+
+    return true;
+}
+
+
+
+/*
+Writes count blocks into the cache and marks them dirty.  They reach
+the device when they are evicted or when flush() is called; a block
+that finds no slot it may take is written through to the device
+instead.  A block whose cached copy already holds the same data is left
+as it was, clean blocks included, so identical rewrites cost no device
+I/O.
+*/
+bool PageCache::write_extent(const void* buffer, CacheKey key, size_t count)
+{
+    const uint8_t* in = (const uint8_t*)buffer;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        mrc_.access(key + i);
+
+        CacheShard& shard = shard_for(key + i);
+        bool filling;
+        regrow(shard);
+
+        {
+            UniqueLock<Mutex> l(shard.lock_);
+
+            uint32_t slot = shard.lookup_slot(key + i);
+            if (slot == NO_SLOT)
+            {
+                if (tier_)
+                {
+                    tier_->invalidate(key + i);
+                }
+
+                // With every slot pinned or filling, the block goes straight to the device
+                slot = shard.claim_slot(key + i);
+                if (slot == NO_SLOT)
+                {
+                    CacheBackingStore* store = store_for(key + i);
+                    if (!store || !store->store_blocks(in + i * BLOCK_SIZE, cache_key_lba(key + i), 1))
+                    {
+                        cache_log.messagef(LogLevel::ERROR, "cache: write-through failed offset=" KEY_FMT, KEY_ARGS(key + i));
+                        return false;
+                    }
+                    continue;
+                }
+
+                copy_blocks(shard.slot_data(slot), in + i * BLOCK_SIZE, 1);
+                shard.finish_fill(slot, SLOT_DIRTY);
+                continue;
+            }
+
+            filling = (shard.table_->slot_flags[slot] & SLOT_FILLING) != 0;
+            if (!filling && !(shard.table_->slot_flags[slot] & SLOT_LOST) &&
+                blocks_equal(shard.slot_data(slot), in + i * BLOCK_SIZE))
+            {
+                // Rewriting what is already there: no copy, and nothing to write back
+                stats_.add(CACHE_CLEAN_REWRITES);
+                shard.touch_slot(slot);
+            }
+            else if (!filling)
+            {
+                shard.write_begin();
+                copy_blocks(shard.slot_data(slot), in + i * BLOCK_SIZE, 1);
+                shard.table_->slot_flags[slot] = (shard.table_->slot_flags[slot] & ~SLOT_LOST) | SLOT_DIRTY;
+                shard.seal_slot(slot);
+                shard.write_end();
+                shard.touch_slot(slot);
+            }
+        }
+
+        // The device copy landing later would undo this write, so let it land and retry
+        if (filling)
+        {
+            wait_for_fill(shard, key + i, NULL);
+            i--;
+        }
+    }
+
+    return true;
+}
+
+
+
+/*
+Inserts count clean blocks that have just been read from the device.
+A block that is already cached and dirty is newer than the device copy,
+so it is left alone.
+*/
+void PageCache::fill_extent(const void* buffer, CacheKey key, size_t count)
+{
+    const uint8_t* in = (const uint8_t*)buffer;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        CacheShard& shard = shard_for(key + i);
+        regrow(shard);
+        UniqueLock<Mutex> l(shard.lock_);
+
+        uint32_t slot = shard.lookup_slot(key + i);
+        if (slot == NO_SLOT)
+        {
+            slot = shard.claim_slot(key + i);
+            if (slot != NO_SLOT)
+            {
+                copy_blocks(shard.slot_data(slot), in + i * BLOCK_SIZE, 1);
+                shard.finish_fill(slot, 0);
+            }
+            continue;
+        }
+
+        // Dirty or lost means newer than the device; filling means someone else is inserting it
+        if (shard.table_->slot_flags[slot] & (SLOT_DIRTY | SLOT_FILLING | SLOT_LOST))
+        {
+            continue;
+        }
+
+        shard.write_begin();
+        copy_blocks(shard.slot_data(slot), in + i * BLOCK_SIZE, 1);
+        shard.seal_slot(slot);
+        shard.write_end();
+        shard.touch_slot(slot);
+    }
+}
+
+
+
+/*
+Brings the blocks among the count (at most EXTENT_MAX_SPAN) starting at
+key that are not cached yet into the cache, flagged with flags.  As in
+read_extent(), every missing block is claimed as an in-flight fill
+before anything is read, so a write that comes in meanwhile waits for
+the fill to land instead of being undone by it.  Claimed blocks the
+compressed tier holds are taken out of it; the rest come in with a
+single device read into buffer (room for count blocks).  Sets filled to
+the number of blocks inserted, and returns false if the device read
+failed.
+*/
+bool PageCache::fill_span(CacheKey key, size_t count, uint8_t flags, uint8_t* buffer, size_t& filled)
+{
+    uint64_t claimed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        CacheShard& shard = shard_for(key + i);
+        regrow(shard);
+        UniqueLock<Mutex> l(shard.lock_);
+
+        if (shard.lookup_slot(key + i) != NO_SLOT)
+        {
+            continue;
+        }
+
+        uint32_t slot = shard.claim_slot(key + i);
+        if (slot != NO_SLOT)
+        {
+            shard.start_fill(this, slot);
+            claimed |= 1ull << i;
+        }
+    }
+
+    uint64_t need = claimed;
+    for (size_t i = 0; tier_ && i < count; i++)
+    {
+        if ((claimed & (1ull << i)) && tier_->load(key + i, buffer + i * BLOCK_SIZE))
+        {
+            need &= ~(1ull << i);
+        }
+    }
+
+    bool ok = true;
+    if (need)
+    {
+        size_t lo = __builtin_ctzll(need);
+        size_t hi = 64 - __builtin_clzll(need);
+        CacheBackingStore* store = store_for(key);
+        ok = store && store->fetch_blocks(buffer + lo * BLOCK_SIZE, cache_key_lba(key + lo), hi - lo);
+        if (!ok)
+        {
+            cache_log.messagef(LogLevel::ERROR, "cache: fetch failed offset=" KEY_FMT " count=%u",
+                               KEY_ARGS(key + lo), (unsigned int)(hi - lo));
+        }
+    }
+
+    filled = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!(claimed & (1ull << i)))
+        {
+            continue;
+        }
+
+        CacheShard& shard = shard_for(key + i);
+        bool got = ok || !(need & (1ull << i));
+        CacheCompletion* waiters;
+        {
+            UniqueLock<Mutex> l(shard.lock_);
+            if (got)
+            {
+                copy_blocks(shard.slot_data(shard.lookup_slot(key + i)), buffer + i * BLOCK_SIZE, 1);
+            }
+            waiters = shard.complete_fill(key + i, got, flags);
+        }
+
+        notify_completions(waiters, got);
+        filled += got;
+    }
+
+    return ok;
+}
+
+
+
+/*
+Brings count blocks starting at key into the cache ahead of use, a span
+of at most EXTENT_MAX_SPAN blocks (one device read) at a time; see
+fill_span().  The blocks are flagged SLOT_READAHEAD, so the first hit on
+each one is counted as a readahead hit.
+*/
+bool PageCache::readahead(CacheKey key, size_t count)
+{
+    size_t start = count;
+    size_t end = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!shard_for(key + i).contains(key + i))
+        {
+            if (start == count)
+            {
+                start = i;
+            }
+            end = i + 1;
+        }
+    }
+
+    if (start == count)
+    {
+        return true;
+    }
+
+    size_t span = end - start < EXTENT_MAX_SPAN ? end - start : EXTENT_MAX_SPAN;
+    uint8_t* buffer = new uint8_t[span * BLOCK_SIZE];
+    bool ok = true;
+
+    for (size_t i = start; ok && i < end; i += span)
+    {
+        size_t filled;
+        ok = fill_span(key + i, end - i < span ? end - i : span, SLOT_READAHEAD, buffer, filled);
+    }
+
+    delete[] buffer;
+    return ok;
+}
+
+
+
+bool PageCache::flush()
+{
+    bool ok = true;
+
+    // Let a request queue below collect the whole writeback and merge it
+    plug_devices();
+
+    for (auto& shard : shards_)
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+        ok &= shard.flush();
+    }
+
+    ok &= unplug_devices();
+
+    if (snapshot_blocks_)
+    {
+        ok &= save_snapshot();
+    }
+
+    return ok;
+}
+
+
+
+// Puts a compressed tier of up to max_bytes (adapting down to an eighth of that) behind the shards
+bool PageCache::enable_tier(size_t max_bytes)
+{
+    if (tier_)
+    {
+        return false;
+    }
+
+    tier_ = new CompressedTier(&stats_, max_bytes / 8, max_bytes);
+    for (auto& shard : shards_)
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+        shard.tier_ = tier_;
+    }
+
+    return true;
+}
+
+
+
+/*
+Turns integrity checking on or off.  Turning it on seals the blocks
+already cached; the ones still being filled are sealed when their data
+arrives.
+*/
+void PageCache::set_verify(uint8_t flags)
+{
+    for (auto& shard : shards_)
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+
+        if (flags && !shard.verify_)
+        {
+            shard.verify_ = flags;
+
+            uint32_t nr = shard.nr_pages_ * SECTORS_PER_PAGE;
+            for (uint32_t slot = 0; slot < nr; slot++)
+            {
+                if ((shard.table_->slot_flags[slot] & (SLOT_VALID | SLOT_FILLING)) == SLOT_VALID)
+                {
+                    shard.write_begin();
+                    shard.seal_slot(slot);
+                    shard.write_end();
+                }
+            }
+        }
+
+        __atomic_store_n(&shard.verify_, flags, __ATOMIC_RELAXED);
+    }
+}
+
+
+
+// Checks nr_blocks cached blocks, spread over the shards, for a periodic caller
+size_t PageCache::scrub(size_t nr_blocks)
+{
+    size_t bad = 0;
+
+    for (auto& shard : shards_)
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+        if (shard.verify_)
+        {
+            bad += shard.scrub((nr_blocks + CACHE_SHARDS - 1) / CACHE_SHARDS);
+        }
+    }
+
+    return bad;
+}
+
+
+
+// Reserves nr_blocks blocks at key for the warm-cache snapshot
+void PageCache::set_snapshot_region(CacheKey key, uint32_t nr_blocks)
+{
+    snapshot_key_ = key;
+    snapshot_blocks_ = nr_blocks;
+}
+
+
+
+/*
+Writes the keys of the resident blocks to the snapshot region, most
+recently used first, as many as fit.  Recency is compared across shards
+by age (accesses to the shard since the block was last touched), which
+is fair because the hash spreads accesses evenly over the shards.
+*/
+bool PageCache::save_snapshot()
+{
+    CacheBackingStore* store = store_for(snapshot_key_);
+    if (!store || snapshot_blocks_ < 2)
+    {
+        return false;
+    }
+
+    // Slots may be added while we walk the shards; anything past this is left out
+    size_t max_keys = nr_slots();
+    CacheKey* resident = new CacheKey[max_keys];
+    uint64_t* order = new uint64_t[max_keys]; // age in the high half, index into resident in the low
+    size_t nr_keys = 0;
+
+    for (auto& shard : shards_)
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+        uint32_t nr = shard.nr_pages_ * SECTORS_PER_PAGE;
+
+        for (uint32_t slot = 0; slot < nr && nr_keys < max_keys; slot++)
+        {
+            CacheKey key = shard.table_->slot_key[slot];
+            if ((shard.table_->slot_flags[slot] & (SLOT_VALID | SLOT_FILLING)) != SLOT_VALID ||
+                (key >= snapshot_key_ && key < snapshot_key_ + snapshot_blocks_))
+            {
+                continue;
+            }
+
+            uint32_t age = shard.access_counter_ - shard.table_->slot_stamp[slot];
+            resident[nr_keys] = key;
+            order[nr_keys] = ((uint64_t)age << 32) | nr_keys;
+            nr_keys++;
+        }
+    }
+
+    sort_keys(order, nr_keys);
+
+    size_t max_entries = (snapshot_blocks_ - 1) * SNAPSHOT_ENTRIES_PER_BLOCK;
+    size_t nr_entries = nr_keys < max_entries ? nr_keys : max_entries;
+    size_t nr_blocks = (nr_entries + SNAPSHOT_ENTRIES_PER_BLOCK - 1) / SNAPSHOT_ENTRIES_PER_BLOCK;
+
+    CacheKey* blocks = new CacheKey[(nr_blocks + 1) * SNAPSHOT_ENTRIES_PER_BLOCK];
+    memset(blocks, 0, (nr_blocks + 1) * BLOCK_SIZE);
+
+    CacheKey* entries = blocks + SNAPSHOT_ENTRIES_PER_BLOCK;
+    for (size_t i = 0; i < nr_entries; i++)
+    {
+        entries[i] = resident[(uint32_t)order[i]];
+    }
+    delete[] order;
+    delete[] resident;
+
+    CacheSnapshotHeader* header = (CacheSnapshotHeader*)blocks;
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->nr_entries = nr_entries;
+    header->checksum = snapshot_checksum(entries, nr_entries);
+
+    // Entries first, so the header never describes keys that did not make it
+    uint64_t lba = cache_key_lba(snapshot_key_);
+    bool ok = nr_blocks == 0 || store->store_blocks(entries, lba + 1, nr_blocks);
+    ok = ok && store->store_blocks(header, lba, 1);
+
+    delete[] blocks;
+
+    cache_log.messagef(LogLevel::DEBUG, "cache: saved warm-cache snapshot of %lu blocks", nr_entries);
+    return ok;
+}
+
+
+
+/*
+Reads the snapshot back and starts the "cache-prewarm" thread to bring
+its blocks in, at most capacity() of them.  Returns false if there is no
+valid snapshot or a prewarm is already running.
+*/
+bool PageCache::prewarm()
+{
+    CacheBackingStore* store = store_for(snapshot_key_);
+    if (!store || snapshot_blocks_ < 2)
+    {
+        return false;
+    }
+
+    uint64_t lba = cache_key_lba(snapshot_key_);
+    uint8_t block[BLOCK_SIZE];
+    if (!store->fetch_blocks(block, lba, 1))
+    {
+        return false;
+    }
+
+    CacheSnapshotHeader header;
+    memcpy(&header, block, sizeof(header));
+
+    size_t max_entries = (snapshot_blocks_ - 1) * SNAPSHOT_ENTRIES_PER_BLOCK;
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.nr_entries > max_entries)
+    {
+        cache_log.messagef(LogLevel::DEBUG, "cache: no warm-cache snapshot");
+        return false;
+    }
+    if (header.nr_entries == 0)
+    {
+        return true;
+    }
+
+    size_t nr_blocks = (header.nr_entries + SNAPSHOT_ENTRIES_PER_BLOCK - 1) / SNAPSHOT_ENTRIES_PER_BLOCK;
+    CacheKey* keys = new CacheKey[nr_blocks * SNAPSHOT_ENTRIES_PER_BLOCK];
+
+    if (!store->fetch_blocks(keys, lba + 1, nr_blocks) ||
+        snapshot_checksum(keys, header.nr_entries) != header.checksum)
+    {
+        cache_log.messagef(LogLevel::WARNING, "cache: warm-cache snapshot unreadable, starting cold");
+        delete[] keys;
+        return false;
+    }
+
+    size_t count = header.nr_entries < capacity() ? header.nr_entries : capacity();
+
+    {
+        UniqueLock<Mutex> l(prewarm_lock);
+        if (prewarm_job)
+        {
+            delete[] keys;
+            return false;
+        }
+
+        prewarm_job = new PrewarmJob;
+        prewarm_job->cache = this;
+        prewarm_job->keys = keys;
+        prewarm_job->count = count;
+    }
+
+    Thread& thread = sys.kernel_process().create_thread(ThreadPrivilege::Kernel, (Thread::thread_proc_t)&prewarm_main, "cache-prewarm");
+    thread.start();
+
+    return true;
+}
+
+
+
+/*
+Runs on the prewarm thread.  Keys are taken EXTENT_MAX_SPAN at a time
+in priority order; each batch is sorted and brought in as runs of
+consecutive blocks with fill_span(), so blocks nobody has brought in
+meanwhile are inserted clean.
+Blocks of a device that is no longer attached are skipped.  Finally the
+blocks are touched coldest first, so the cache's recency order matches
+the snapshot's.
+*/
+void PageCache::run_prewarm(const CacheKey* keys, size_t count)
+{
+    uint64_t batch_keys[EXTENT_MAX_SPAN];
+    uint8_t* buffer = new uint8_t[EXTENT_MAX_SPAN * BLOCK_SIZE];
+    size_t prewarmed = 0;
+
+    for (size_t batch = 0; batch < count; batch += EXTENT_MAX_SPAN)
+    {
+        size_t nr_keys = 0;
+        for (size_t i = batch; i < count && i < batch + EXTENT_MAX_SPAN; i++)
+        {
+            if (store_for(keys[i]) && !shard_for(keys[i]).contains(keys[i]))
+            {
+                batch_keys[nr_keys++] = keys[i];
+            }
+        }
+
+        sort_keys(batch_keys, nr_keys);
+
+        size_t start = 0;
+        while (start < nr_keys)
+        {
+            // Consecutive keys are consecutive blocks of one device
+            size_t end = start + 1;
+            while (end < nr_keys && batch_keys[end] == batch_keys[end - 1] + 1 &&
+                   cache_key_device(batch_keys[end]) == cache_key_device(batch_keys[start]))
+            {
+                end++;
+            }
+
+            // Claimed before the read, so a write that comes in meanwhile is not undone
+            size_t filled;
+            fill_span(batch_keys[start], end - start, 0, buffer, filled);
+            prewarmed += filled;
+
+            start = end;
+        }
+    }
+
+    for (size_t i = count; i-- > 0;)
+    {
+        CacheShard& shard = shard_for(keys[i]);
+        UniqueLock<Mutex> l(shard.lock_);
+
+        uint32_t slot = shard.lookup_slot(keys[i]);
+        if (slot != NO_SLOT)
+        {
+            shard.touch_slot(slot);
+        }
+    }
+
+    delete[] buffer;
+
+    stats_.add(CACHE_PREWARMED, prewarmed);
+    cache_log.messagef(LogLevel::DEBUG, "cache: prewarmed %lu of %lu blocks", prewarmed, count);
+}
+
+
+
+/*
+Starts an asynchronous read of key into completion.buffer (if
+set).  A hit is copied out and completed inline, and ASYNC_HIT is
+returned.  Otherwise the request joins the block's in-flight fill, or
+claims the slot and queues a new fill for the fill worker, and
+ASYNC_QUEUED is returned; the completion is signalled from the worker
+once the block is in.  If there is no slot to claim, no store for the
+device, or only a bad copy that could not be re-read, the completion is
+failed inline and ASYNC_FAILED is returned.
+*/
+int PageCache::read_block_async(CacheKey key, CacheCompletion& completion)
+{
+    mrc_.access(key);
+
+    CacheShard& shard = shard_for(key);
+    InflightFill* fill = NULL;
+    bool hit = false;
+
+    completion.next = NULL;
+    completion.done = false;
+
+    uint32_t slot = completion.buffer ? shard.try_read(completion.buffer, key) : NO_SLOT;
+    if (slot != NO_SLOT)
+    {
+        cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE HIT] offset=" KEY_FMT, KEY_ARGS(key));
+        count_hit(shard, slot);
+        notify_completions(&completion, true);
+        return ASYNC_HIT;
+    }
+
+    regrow(shard);
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+
+        slot = shard.lookup_slot(key);
+        if (slot != NO_SLOT && !(shard.table_->slot_flags[slot] & SLOT_FILLING))
+        {
+            // hit stays false for a bad block that could not be re-read, failing the completion
+            if (shard.verify_hit(slot))
+            {
+                cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE HIT] offset=" KEY_FMT, KEY_ARGS(key));
+                if (completion.buffer)
+                {
+                    copy_blocks(completion.buffer, shard.slot_data(slot), 1);
+                }
+                shard.touch_slot(slot);
+                count_hit(shard, slot);
+                hit = true;
+            }
+        }
+        else if (slot != NO_SLOT)
+        {
+            cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE MISS] offset=" KEY_FMT " (coalesced)", KEY_ARGS(key));
+            stats_.add(CACHE_MISSES);
+            stats_.add(CACHE_COALESCED_MISSES);
+            shard.join_fill(shard.find_fill(key), completion);
+            return ASYNC_QUEUED;
+        }
+        else
+        {
+            cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE MISS] offset=" KEY_FMT, KEY_ARGS(key));
+            stats_.add(CACHE_MISSES);
+
+            slot = store_for(key) ? shard.claim_slot(key) : NO_SLOT;
+            if (slot != NO_SLOT)
+            {
+                fill = shard.start_fill(this, slot);
+                shard.join_fill(fill, completion);
+            }
+        }
+    }
+
+    if (!fill)
+    {
+        notify_completions(&completion, hit);
+        return hit ? ASYNC_HIT : ASYNC_FAILED;
+    }
+
+    queue_fill(fill);
+    return ASYNC_QUEUED;
+}
+
+
+
+// Brings in one missing block, from the compressed tier if it has it, otherwise from the device
+bool PageCache::fetch_block(CacheKey key, uint8_t* data)
+{
+    if (tier_ && tier_->load(key, data))
+    {
+        return true;
+    }
+
+    uint64_t issued = __builtin_ia32_rdtsc();
+    CacheBackingStore* store = store_for(key);
+    bool ok = store && store->fetch_blocks(data, cache_key_lba(key), 1);
+    if (ok)
+    {
+        stats_.record_miss_latency(__builtin_ia32_rdtsc() - issued);
+    }
+    return ok;
+}
+
+
+
+// Runs on the fill worker: fetches a queued fill and signals its waiters
+void PageCache::run_fill(InflightFill& fill)
+{
+    CacheKey key = fill.key;
+    CacheShard& shard = shard_for(key);
+
+    bool ok = fetch_block(key, fill.data);
+
+    CacheCompletion* waiters;
+    {
+        UniqueLock<Mutex> l(shard.lock_);
+        waiters = shard.complete_fill(key, ok);
+    }
+    notify_completions(waiters, ok);
+}
+
+
+
+/*
+Returns a read-only pointer to the cached copy of key, reading
+it from the device straight into its cache slot on a miss (or waiting
+for a fill already in flight).  The block is pinned until the matching
+put_block(), so the pointer stays valid and the data can be parsed in
+place.  Returns NULL if the block could not be brought in.
+*/
+const uint8_t* PageCache::get_block(CacheKey key)
+{
+    mrc_.access(key);
+
+    CacheShard& shard = shard_for(key);
+    bool waited = false;
+
+    while (true)
+    {
+        InflightFill* fill = NULL;
+        regrow(shard);
+
+        {
+            UniqueLock<Mutex> l(shard.lock_);
+
+            uint32_t slot = shard.lookup_slot(key);
+            if (slot != NO_SLOT && !(shard.table_->slot_flags[slot] & SLOT_FILLING))
+            {
+                if (!shard.verify_hit(slot))
+                {
+                    return NULL;
+                }
+
+                if (waited)
+                {
+                    cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE MISS] offset=" KEY_FMT " (coalesced)", KEY_ARGS(key));
+                    stats_.add(CACHE_MISSES);
+                    stats_.add(CACHE_COALESCED_MISSES);
+                }
+                else
+                {
+                    cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE HIT] offset=" KEY_FMT, KEY_ARGS(key));
+                    count_hit(shard, slot);
+                }
+
+                shard.touch_slot(slot);
+                shard.table_->slot_pins[slot]++;
+                return shard.slot_data(slot);
+            }
+
+            if (slot == NO_SLOT)
+            {
+                cache_log.messagef(LogLevel::DEBUG, "cache: [CACHE MISS] offset=" KEY_FMT, KEY_ARGS(key));
+                stats_.add(CACHE_MISSES);
+                if (!store_for(key))
+                {
+                    return NULL;
+                }
+
+                slot = shard.claim_slot(key);
+                if (slot == NO_SLOT)
+                {
+                    return NULL;
+                }
+                fill = shard.start_fill(this, slot);
+            }
+        }
+
+        if (!fill)
+        {
+            waited |= wait_for_fill(shard, key, NULL);
+            continue;
+        }
+
+        // Read straight into the claimed slot, without the shard lock
+        bool ok = fetch_block(key, fill->data);
+
+        CacheCompletion* waiters;
+        const uint8_t* data = NULL;
+        {
+            UniqueLock<Mutex> l(shard.lock_);
+            waiters = shard.complete_fill(key, ok);
+            if (ok)
+            {
+                uint32_t slot = shard.lookup_slot(key);
+                shard.table_->slot_pins[slot]++;
+                data = shard.slot_data(slot);
+            }
+        }
+        notify_completions(waiters, ok);
+        return data;
+    }
+}
+
+
+
+void PageCache::put_block(CacheKey key)
+{
+    CacheShard& shard = shard_for(key);
+    UniqueLock<Mutex> l(shard.lock_);
+
+    uint32_t slot = shard.lookup_slot(key);
+    assert(slot != NO_SLOT && shard.table_->slot_pins[slot] > 0);
+    shard.table_->slot_pins[slot]--;
+}
+
+
+
+// The original per-block entry points, now extent-aware
+void PageCache::read_data_from_block_in_cache(void* buffer, uint32_t block_offset, size_t count)
+{
+    read_extent(buffer, block_offset, count);
+}
+
+
+
+void PageCache::check_cache_and_write_to_buffer(void* buffer, uint32_t block_offset, size_t count)
+{
+    read_extent(buffer, block_offset, count);
+}
+
+
+
+void PageCache::write_data_to_cache(void* buffer, uint32_t block_offset, size_t count)
+{
+    fill_extent(buffer, block_offset, count);
+}
@@ -2,6 +2,9 @@
 #include <infos/drivers/ata/ata-device.h>
 #include <infos/drivers/ata/ata-controller.h>
 #include <infos/kernel/kernel.h>
+#include <infos/kernel/thread.h>
+#include <infos/mm/mm.h>
+#include <infos/mm/pgalloc-ext.h>
 #include <infos/util/lock.h>
 #include <infos/util/string.h>
 #include <arch/x86/pio.h>
@@ -10,6 +13,7 @@
 
 
 using namespace infos::kernel;
+using namespace infos::mm;
 using namespace infos::drivers;
 using namespace infos::drivers::ata;
 using namespace infos::drivers::block;
@@ -125,35 +129,613 @@ namespace infos
         class Cache;
         
 
-        struct CacheBlock
+        /**
+         * The device side of the cache.  Missing blocks are fetched through this
+         * interface, and dirty blocks are stored back through it.  Both calls move
+         * a contiguous run of blocks in a single device request.  Each device the
+         * cache holds blocks for has its own, see PageCache::attach_device().
+         */
+        class CacheBackingStore
         {
-           public: 
-            uint8_t* originalbufferpointer;
-            uint32_t block_offset = 0;
+            public:
+            virtual ~CacheBackingStore() { }
+
+            virtual bool fetch_blocks(void* buffer, uint64_t lba, size_t count) = 0;
+            virtual bool store_blocks(const void* buffer, uint64_t lba, size_t count) = 0;
+
+            // Brackets a burst of stores the store may hold back and batch up.
+            // unplug() returns false if any store held back since plug() failed.
+            virtual void plug() { }
+            virtual bool unplug() { return true; }
+        };
+
+
+        # define CACHE_SIZE 64 // default amount of blocks in the cache, see set_capacity()
+
+        # define BLOCK_SIZE 512
+
+        # define SECTORS_PER_PAGE 8 // blocks carved out of each 4 KiB page
+
+        # define CACHE_SHARDS 4 // independently locked partitions of the cache
+
+        # define CACHE_MAX_DEVICES 16 // devices one cache can hold blocks for, see PageCache::attach_device()
+        # define CACHE_LBA_BITS 60 // low bits of a CacheKey, holding the LBA; the device number sits above
+
+        # define CACHE_GROW_BATCH 16 // pages taken from the allocator at a time when a shard grows
+
+        # define SHRINK_REGROW_DELAY 1024 // accesses after a shrink before a shard grows back
+
+        # define EXTENT_GAP_LIMIT 8 // cached blocks an extent read may re-fetch to avoid splitting a device read
+
+        # define EXTENT_MAX_SPAN 64 // longest single device read issued for an extent miss
+
+        # define SLOT_VALID 0x01
+        # define SLOT_DIRTY 0x02
+        # define SLOT_FILLING 0x04 // claimed, data still on its way from the device
+        # define SLOT_READAHEAD 0x08 // brought in by readahead() and not yet hit
+        # define SLOT_LOST 0x10 // dirty data failed its checksum; reads fail until it is written again
+        # define NO_SLOT 0xffffffffu
+
+        # define VERIFY_ON_HIT 0x01 // check a block's checksum every time it is read from the cache
+        # define VERIFY_SCRUB 0x02 // check a few cached blocks on every miss, see PageCache::scrub()
+        # define SCRUB_BLOCKS_PER_MISS 4
+
+        # define ASYNC_HIT 0 // read_block_async() completed the request inline, with the block
+        # define ASYNC_QUEUED 1 // the completion is signalled once the block's fill ends
+        # define ASYNC_FAILED 2 // completed inline without the block: no slot, store or good copy
+
+        # define REQUEST_QUEUE_DEPTH 64 // held-back writes that force a dispatch while plugged
+        # define REQUEST_BATCH 16 // commands dispatched when the queue fills up
+        # define REQUEST_MAX_BLOCKS 128 // longest command a merge may build
+        # define REQUEST_DEADLINE 256 // submissions a write may wait before it jumps the elevator
+
+        # define SNAPSHOT_MAGIC 0x53574350u // "PCWS"
+        # define SNAPSHOT_VERSION 2
+        # define SNAPSHOT_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(CacheKey))
+
+        # define TIER_MAX_COMPRESSED (BLOCK_SIZE * 7 / 8) // blocks that compress worse than this are not kept
+        # define TIER_BUCKETS 1024
+        # define TIER_STAGED 16 // evicted blocks held uncompressed until the next tier lookup
+        # define TIER_WINDOW 4096 // tier lookups between budget adjustments
+        # define TIER_GROW_SHARE 8 // grow the budget when more than 1/8 of lookups hit
+        # define TIER_SHRINK_SHARE 32 // shrink it when fewer than 1/32 do
+
+        # define CACHE_STAT_STRIPES 8 // cache-line sized counter stripes, see CacheStatCounters
+        # define CACHE_LATENCY_BUCKETS 40 // log2 buckets of TSC cycles
+
+
+        /**
+         * What the cache knows a block by: the device number and the block's LBA
+         * on that device, packed into one word so that it hashes and compares
+         * like a plain offset.  Consecutive blocks of a device have consecutive
+         * keys, and device 0's keys are just its LBAs.
+         */
+        typedef uint64_t CacheKey;
+
+        static inline CacheKey cache_key(unsigned int device, uint64_t lba)
+        {
+            return ((uint64_t)device << CACHE_LBA_BITS) | lba;
+        }
+
+        static inline unsigned int cache_key_device(CacheKey key)
+        {
+            return key >> CACHE_LBA_BITS;
+        }
+
+        static inline uint64_t cache_key_lba(CacheKey key)
+        {
+            return key & ((1ull << CACHE_LBA_BITS) - 1);
+        }
+
+
+        /**
+         * One device's share of the cache.  A miss on a device at its cap evicts
+         * one of the device's own blocks, and a miss never evicts a block of a
+         * device that is at or below its guaranteed minimum, so a noisy device
+         * cannot push another one's hot set out.  Both limits are split evenly
+         * across the shards, like the capacity.
+         */
+        struct CachePartition
+        {
+            CacheBackingStore* store; // NULL until the device is attached
+            size_t min_blocks;
+            size_t max_blocks;
+        };
+
+
+        enum CacheCounter
+        {
+            CACHE_HITS,
+            CACHE_MISSES,
+            CACHE_COALESCED_MISSES, // misses that waited on another request's fill instead of the device
+            CACHE_EVICTIONS,
+            CACHE_WRITEBACKS,
+            CACHE_READAHEAD_HITS,
+            CACHE_PREWARMED, // blocks brought back in from a warm-cache snapshot
+            CACHE_TIER_HITS, // misses served from the compressed tier instead of the device
+            CACHE_TIER_STORES, // evicted blocks kept in the compressed tier
+            CACHE_TIER_REJECTS, // evicted blocks that did not compress well enough to keep
+            CACHE_CLEAN_REWRITES, // writes that matched the cached block and were dropped
+            CACHE_CHECKSUM_ERRORS, // cached blocks found not to match their checksum
+            CACHE_REFETCHES, // of those, blocks read again from the device
+            NR_CACHE_COUNTERS
+        };
+
+
+        /**
+         * A point-in-time copy of the cache statistics, as returned by
+         * PageCache::stats().
+         */
+        struct CacheStats
+        {
+            uint64_t counters[NR_CACHE_COUNTERS];
+
+            // Bucket b counts device fetches on the miss path that took between
+            // 2^b and 2^(b+1) TSC cycles.
+            uint64_t miss_latency[CACHE_LATENCY_BUCKETS];
+
+            uint64_t hits() const { return counters[CACHE_HITS]; }
+            uint64_t misses() const { return counters[CACHE_MISSES]; }
+            uint64_t accesses() const { return hits() + misses(); }
+
+            // Hit ratio in parts per thousand, 0 before the first access
+            uint64_t hit_ratio_permille() const { return accesses() ? hits() * 1000 / accesses() : 0; }
+        };
+
+
+        /**
+         * Lock-free statistics.  Each counter is split across CACHE_STAT_STRIPES
+         * cache lines and a caller only ever bumps its own stripe, so concurrent
+         * I/O does not bounce a shared line between CPUs.  Drivers have no per-CPU
+         * area to hang this off, so the stripe is picked by hashing the address of
+         * the running thread: a thread always bumps the same stripe, and threads
+         * spread evenly over them.  Readers add the stripes up in snapshot().
+         */
+        class CacheStatCounters
+        {
+            public:
+            void add(CacheCounter counter, uint64_t n = 1)
+            {
+                __atomic_add_fetch(&stripe().counters[counter], n, __ATOMIC_RELAXED);
+            }
+
+            void record_miss_latency(uint64_t cycles)
+            {
+                unsigned int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+                if (bucket >= CACHE_LATENCY_BUCKETS)
+                {
+                    bucket = CACHE_LATENCY_BUCKETS - 1;
+                }
+                __atomic_add_fetch(&stripe().miss_latency[bucket], 1, __ATOMIC_RELAXED);
+            }
+
+            void snapshot(CacheStats& stats) const;
+            void reset();
+
+            private:
+            struct Stripe
+            {
+                uint64_t counters[NR_CACHE_COUNTERS];
+                uint64_t miss_latency[CACHE_LATENCY_BUCKETS];
+            } __attribute__((aligned(64)));
+
+            Stripe& stripe()
+            {
+                uint64_t thread = (uintptr_t)&infos::kernel::Thread::current();
+                return stripes_[((thread >> 4) * 0x9e3779b97f4a7c15ull >> 32) % CACHE_STAT_STRIPES];
+            }
+
+            Stripe stripes_[CACHE_STAT_STRIPES] = { };
+        };
+
+
+        # define MRC_MAX_SAMPLES 512 // offsets the estimator tracks at once
+        # define MRC_HASH_SPACE (1u << 24)
+        # define MRC_INITIAL_RATE 16 // start by sampling 1 in this many offsets
+        # define MRC_BUCKET_BLOCKS SECTORS_PER_PAGE // curve resolution, one point per page of cache
+        # define MRC_BUCKETS 512 // curve covers caches up to MRC_BUCKETS * MRC_BUCKET_BLOCKS blocks
+        # define MRC_WEIGHT_SHIFT 8 // fraction bits of a reference's weight, the inverse of its sampling rate
+
+
+        /**
+         * Predicts the LRU miss ratio for any cache size from the live access
+         * stream, using spatially hashed sampling (SHARDS, fixed-size variant).
+         * An offset is sampled when its hash falls below a threshold, so every
+         * access to a sampled offset is seen and its reuse distance is exact
+         * within the sample; scaling by the sampling rate gives the distance in
+         * the full stream.  At most MRC_MAX_SAMPLES offsets are tracked.  When the
+         * set is full the offset with the largest hash is dropped and the
+         * threshold lowered to it, so memory stays bounded however big the device
+         * and the rate adapts to the working set.
+         */
+        class MissRatioEstimator
+        {
+            public:
+            MissRatioEstimator() { reset(); }
+
+            void access(CacheKey key);
+
+            uint32_t miss_ratio_permille(size_t nr_blocks);
+            size_t curve(uint32_t* permille, size_t nr_points);
+            size_t suggest_capacity(uint32_t target_miss_permille);
+            void reset();
+
+            private:
+            struct Sample
+            {
+                CacheKey key;
+                uint32_t hash;
+                uint64_t last_access;
+            };
+
+            static uint32_t sample_hash(CacheKey key)
+            {
+                key ^= key >> 33;
+                key *= 0xff51afd7ed558ccdull;
+                key ^= key >> 33;
+                key *= 0xc4ceb9fe1a85ec53ull;
+                key ^= key >> 33;
+                return key & (MRC_HASH_SPACE - 1);
+            }
+
+            // The inverse of the sampling rate, with MRC_WEIGHT_SHIFT fraction bits
+            uint64_t reference_weight() const
+            {
+                return ((uint64_t)MRC_HASH_SPACE << MRC_WEIGHT_SHIFT) / threshold_;
+            }
+
+            uint32_t miss_ratio_locked(size_t nr_blocks);
+
+            Mutex lock_;
+            uint32_t threshold_;
+            Sample samples_[MRC_MAX_SAMPLES];
+            size_t nr_samples_;
+            uint64_t clock_;
+            uint64_t histogram_[MRC_BUCKETS]; // weighted reuse distances, MRC_BUCKET_BLOCKS wide each
+            uint64_t references_; // weighted sampled accesses, including cold ones and distances past the curve
+        };
+
+
+        // A run of blocks waiting in a BlockRequestQueue, with its own copy of the data
+        struct BlockRequest
+        {
+            uint64_t lba;
+            uint32_t count;
+            uint32_t capacity; // blocks data has room for
+            uint64_t deadline; // queue clock value after which it is dispatched first
             uint8_t* data;
-            uint8_t* buffer;
-            size_t count;
-            uint8_t* constantbufferpointer;
-            int access_counter_ = 0;
+            BlockRequest* next; // next higher lba
+        };
+
+
+        struct RequestQueueStats
+        {
+            uint64_t submitted; // store_blocks() calls
+            uint64_t merged; // of those, absorbed into an already queued request
+            uint64_t dispatched; // commands sent to the device
+            uint64_t expired; // commands sent out of elevator order by the deadline
+        };
+
+
+        /**
+         * A request queue between the cache and the device.  While plugged, stores
+         * are copied into a queue kept sorted by block offset, and a store that
+         * continues or precedes a queued one is merged into it, up to
+         * REQUEST_MAX_BLOCKS, so that scattered writeback leaves as a few long
+         * commands.  The queue is dispatched on the last unplug(), or REQUEST_BATCH
+         * commands at a time when it reaches REQUEST_QUEUE_DEPTH.  Dispatch follows
+         * a one-way elevator from the last block written, except that a request
+         * that has waited REQUEST_DEADLINE submissions goes first.
+         *
+         * Unplugged, a store goes straight through.  Fetches always go straight
+         * through, with any queued data for the same blocks laid over the result.
+         * The queue lock is held across device commands, which the ATA device runs
+         * one at a time anyway.
+         */
+        class BlockRequestQueue : public CacheBackingStore
+        {
+            public:
+            BlockRequestQueue(CacheBackingStore* device) : device_(device) { }
+            ~BlockRequestQueue();
+
+            bool fetch_blocks(void* buffer, uint64_t lba, size_t count) override;
+            bool store_blocks(const void* buffer, uint64_t lba, size_t count) override;
+            void plug() override;
+            bool unplug() override;
+
+            size_t nr_pending() const { return nr_pending_; }
+            void stats(RequestQueueStats& out) const;
+
+            private:
+            bool queue_store(const uint8_t* buffer, uint64_t lba, uint32_t count);
+            bool merge_into(BlockRequest* rq, const uint8_t* buffer, uint64_t lba, uint32_t count);
+            BlockRequest* pick_next();
+            bool dispatch(size_t nr_commands);
+
+            mutable Mutex lock_;
+            CacheBackingStore* device_;
+            BlockRequest* pending_ = NULL;
+            size_t nr_pending_ = 0;
+            unsigned int plug_depth_ = 0;
+            uint64_t head_ = 0; // block after the last one dispatched
+            uint64_t clock_ = 0; // submissions so far
+            bool failed_ = false; // a held-back store failed since the last unplug()
+            RequestQueueStats stats_ = { };
+        };
+
+
+        /**
+         * First block of a warm-cache snapshot.  The block keys follow in the
+         * next blocks, SNAPSHOT_ENTRIES_PER_BLOCK to a block, most recently used
+         * first.  The checksum (FNV-1a) covers the keys, and the header is
+         * written last, so a torn save is rejected rather than half-read.
+         */
+        struct CacheSnapshotHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t nr_entries;
+            uint32_t checksum;
+        };
+
+
+        // Built-in LZ77 codec for the compressed tier.  lz_compress() returns the
+        // compressed length, or 0 if it would not fit in max_out bytes.
+        size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out, size_t max_out);
+        bool lz_decompress(const uint8_t* in, size_t in_length, uint8_t* out, size_t out_length);
+
+
+        struct TierEntry
+        {
+            CacheKey key;
+            uint32_t length; // compressed bytes following the entry
+            TierEntry* hash_next;
+            TierEntry* lru_prev; // towards the most recently stored
+            TierEntry* lru_next;
+
+            uint8_t* data() { return (uint8_t*)(this + 1); }
+        };
+
+
+        /**
+         * A second cache tier behind the shards, holding clean blocks evicted from
+         * them in compressed form.  It is exclusive: a block leaves the tier when a
+         * miss takes it back, and any write to an uncached block drops its stale
+         * copy here.  Memory use is bounded by a byte budget that adapts between
+         * a floor and a ceiling: every TIER_WINDOW lookups it grows by an eighth
+         * of the ceiling if the tier is earning its keep, and shrinks likewise if
+         * it is not.  Least recently stored entries go first.  Evictions happen
+         * under a shard lock, so they are only copied into a small staging ring
+         * there; they are compressed on the next lookup, which is made without it.
+         */
+        class CompressedTier
+        {
+            public:
+            CompressedTier(CacheStatCounters* stats, size_t min_bytes, size_t max_bytes);
+            ~CompressedTier();
+
+            void stage(CacheKey key, const uint8_t* data);
+            void drain();
+            bool load(CacheKey key, uint8_t* data);
+            void invalidate(CacheKey key);
+            size_t trim(size_t nr_bytes);
+
+            size_t bytes() const { return bytes_; }
+            size_t budget() const { return budget_; }
+            size_t nr_entries() const { return nr_entries_; }
+
+            private:
+            TierEntry** find(CacheKey key);
+            void unlink(TierEntry** link);
+            void evict_to(size_t nr_bytes);
+            void adapt(bool hit);
+            void store(CacheKey key, const uint8_t* data, uint32_t invalidations);
+
+            Mutex lock_;
+            CacheStatCounters* stats_;
+            uint8_t* staged_; // TIER_STAGED blocks waiting for drain()
+            CacheKey staged_keys_[TIER_STAGED];
+            bool staged_valid_[TIER_STAGED];
+            size_t staged_head_ = 0; // oldest
+            size_t nr_staged_ = 0;
+            uint32_t invalidations_ = 0;
+            TierEntry* buckets_[TIER_BUCKETS] = { };
+            TierEntry* lru_head_ = NULL; // most recently stored
+            TierEntry* lru_tail_ = NULL;
+            size_t nr_entries_ = 0;
+            size_t bytes_ = 0;
+            size_t budget_;
+            size_t min_budget_;
+            size_t max_budget_;
+            uint32_t window_lookups_ = 0;
+            uint32_t window_hits_ = 0;
+        };
+
+
+        // CRC32C (Castagnoli), using the SSE4.2 crc32 instruction where the CPU has it
+        uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+
+        class PageCache;
+
+
+        /**
+         * Tracks one request waiting on a block fill.  The filling thread copies
+         * the block to buffer (if set), stores the result in ok, runs the callback
+         * (if set) and finally sets done, after which the cache no longer touches
+         * the completion, except to wake waiter (if set).
+         */
+        struct CacheCompletion
+        {
+            typedef void (*callback_t)(CacheCompletion& completion);
+
+            void* buffer = NULL;
+            callback_t callback = NULL;
+            void* arg = NULL;
+
+            bool ok = false;
+            bool done = false;
+            Thread* waiter = NULL; // sleeping until done
+            CacheCompletion* next = NULL;
+        };
+
+
+        /**
+         * A block on its way from the device into a claimed (SLOT_FILLING) slot.
+         * Every other request for the block joins the waiters instead of going
+         * to the device itself.
+         */
+        struct InflightFill
+        {
+            PageCache* cache;
+            CacheKey key;
+            uint8_t* data; // the claimed slot's storage; it stays put even if the slot is renumbered
+            CacheCompletion* waiters;
+
+            InflightFill* next; // the shard's in-flight list
+            InflightFill* queue_next; // the fill worker's queue, for async fills
+        };
+
+
+        /**
+         * The storage and metadata arrays of one shard.  A shard that outgrows its
+         * table builds a bigger one and keeps the old one on the retired chain
+         * instead of freeing it, because a lock-free reader may still be probing
+         * it.  Tables double in size, so the retired chain never outweighs the
+         * live table.
+         */
+        struct ShardTable
+        {
+            size_t max_pages;
+            uint32_t index_mask;
 
+            // Per-page storage, taken from the page allocator one order-0 page at a time
+            PageDescriptor** page_pgd;
+            uint8_t** page_base;
 
+            // Per-slot metadata, kept as parallel arrays indexed by slot number
+            CacheKey* slot_key;
+            uint32_t* slot_stamp;
+            uint16_t* slot_pins; // outstanding get_block() references; a pinned slot is never evicted
+            uint8_t* slot_flags;
+            uint32_t* slot_csum; // CRC32C of the data, kept up to date while verification is on
+
+            // Open-addressed offset -> slot index, holding slot + 1 (0 is an empty entry)
+            uint32_t* index;
+
+            ShardTable* retired;
         };
 
 
-        class PageCache
+        /**
+         * One partition of the cache.  Every change to a shard is made under its
+         * lock and inside a seqcount write section, so hits can be served without
+         * the lock: a reader copies the block out and retries under the lock if
+         * the seqcount moved underneath it.
+         */
+        class CacheShard
         {
             public:
-            # define CACHE_SIZE 64 // amount of blocks in the cache
+            ~CacheShard();
+
+            Mutex lock_;
+            const CachePartition* partitions_ = NULL; // the owning cache's, indexed by device
+            CacheStatCounters* stats_ = NULL;
+
+            // Lock-free
+            uint32_t try_read(void* buffer, CacheKey key);
+            bool contains(CacheKey key);
+
+            // Lock held
+            uint32_t lookup_slot(CacheKey key);
+            uint32_t claim_slot(CacheKey key);
+            void finish_fill(uint32_t slot, uint8_t flags);
+            void abort_fill(uint32_t slot);
+
+            InflightFill* start_fill(PageCache* cache, uint32_t slot);
+            InflightFill* find_fill(CacheKey key);
+            void join_fill(InflightFill* fill, CacheCompletion& completion);
+            CacheCompletion* complete_fill(CacheKey key, bool ok, uint8_t flags = 0);
+            bool evict_slot(uint32_t slot, bool demote = true);
+            size_t add_page(PageDescriptor* pgd, ShardTable*& spare);
+            size_t shrink(size_t nr_pages, bool clean_only = false);
+            bool flush();
+
+            void seal_slot(uint32_t slot);
+            bool check_slot(uint32_t slot);
+            size_t scrub(size_t nr_blocks);
+
+            void touch_slot(uint32_t slot);
+            bool slot_busy(uint32_t slot) const
+            {
+                // Pinned, owned by an in-flight fill, or lost (evicting it would let the
+                // older device copy be read as if nothing had happened); it must stay put
+                return table_->slot_pins[slot] > 0 || (table_->slot_flags[slot] & (SLOT_FILLING | SLOT_LOST));
+            }
+            bool wants_page() const
+            {
+                // Below the capacity, and past the pressure that shrank it; read without the lock
+                return nr_pages_ < target_pages_ &&
+                       (!under_pressure_ || access_counter_ - pressure_stamp_ > SHRINK_REGROW_DELAY);
+            }
+            bool verify_hit(uint32_t slot)
+            {
+                return !(verify_ & VERIFY_ON_HIT) ? !(table_->slot_flags[slot] & SLOT_LOST) : check_slot(slot);
+            }
+            uint8_t* slot_data(uint32_t slot) const
+            {
+                return table_->page_base[slot / SECTORS_PER_PAGE] + (slot % SECTORS_PER_PAGE) * BLOCK_SIZE;
+            }
+            CacheBackingStore* slot_store(uint32_t slot) const
+            {
+                return partitions_[cache_key_device(table_->slot_key[slot])].store;
+            }
+
+            void write_begin()
+            {
+                __atomic_store_n(&seq_, seq_ + 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+            }
 
-            # define BLOCK_SIZE 512
-                CacheBlock block;
+            void write_end()
+            {
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                __atomic_store_n(&seq_, seq_ + 1, __ATOMIC_RELAXED);
+            }
+
+            ShardTable* table_ = NULL;
+            size_t nr_pages_ = 0;
+            size_t target_pages_ = 0;
+
+            uint32_t access_counter_ = 0; // Counter to track access times for LRU replacement algorithm
+            bool under_pressure_ = false;
+            uint32_t pressure_stamp_ = 0; // access_counter_ at the last shrinker scan
+
+            InflightFill* inflight_ = NULL;
+            CompressedTier* tier_ = NULL;
+
+            uint32_t resident_[CACHE_MAX_DEVICES] = { }; // valid slots held by each device
+
+            uint8_t verify_ = 0; // VERIFY_* flags
+            uint32_t scrub_cursor_ = 0;
+
+            private:
+            uint32_t seq_ = 0;
+
+            void install_table(ShardTable* table);
+            bool release_page(size_t page);
+            uint32_t pick_victim(unsigned int device, bool clean_only);
+            void index_insert(CacheKey key, uint32_t slot);
+            void index_remove(CacheKey key);
+        };
+
+
+        class PageCache : public MemoryShrinker
+        {
+            public:
                 //block.buffer = &block.data;
                 //List<CacheBlock>cache_; //the cache itself
                 List<uint32_t>cacheoffsetlist; //the cache itself
-                List<CacheBlock>cache_;
-
-                Map<uint32_t, void*>cache_map_; //map to quickly look up cache blocks by offset
-                uint32_t access_counter_ =0 ; // Counter to track access times for LRU replacement algorithm
 
 
             PageCache();
@@ -183,13 +765,114 @@ namespace infos
             void print_cacheoffsetlist();
 
 
+            // Devices.  Blocks are addressed by CacheKey, so one cache can serve several
+            // devices; set_backing_store() attaches device 0, whose keys are plain LBAs.
+            // set_partition() gives a device a guaranteed minimum and a cap, in blocks
+            // (by default 0 and no cap), and fails if the minimums would add up to
+            // more than the capacity; set_capacity() will not go below them either.
+            bool attach_device(unsigned int device, CacheBackingStore* store);
+            void set_backing_store(CacheBackingStore* store) { attach_device(0, store); }
+            bool set_partition(unsigned int device, size_t min_blocks, size_t max_blocks);
+            size_t nr_resident(unsigned int device) const;
+
+            // Extent (multi-block) interface.  An extent covers count consecutive
+            // blocks of one device.
+            bool read_extent(void* buffer, CacheKey key, size_t count);
+            bool write_extent(const void* buffer, CacheKey key, size_t count);
+            void fill_extent(const void* buffer, CacheKey key, size_t count);
+            bool readahead(CacheKey key, size_t count);
+            bool flush();
+
+            // Asynchronous single-block read.  The completion's callback runs exactly
+            // once: inline on a hit (the call returns ASYNC_HIT) or on a failure
+            // found before any fill was queued (ASYNC_FAILED), otherwise from the
+            // thread that fills the block (ASYNC_QUEUED).  The completion must
+            // outlive the call until done is set.
+            int read_block_async(CacheKey key, CacheCompletion& completion);
+            void run_fill(InflightFill& fill);
+
+            // Compressed second tier, holding up to max_bytes of evicted clean blocks
+            // (see CompressedTier).  Off until enabled.
+            bool enable_tier(size_t max_bytes);
+            CompressedTier* tier() { return tier_; }
+
+            // End-to-end integrity checking (VERIFY_* flags, 0 for off).  While it is on,
+            // every cached block carries a CRC32C of its data; a block that no longer
+            // matches is counted and read again from the device.  scrub() checks the
+            // next nr_blocks blocks and returns how many were bad.
+            void set_verify(uint8_t flags);
+            uint8_t verify() const { return shards_[0].verify_; }
+            size_t scrub(size_t nr_blocks);
+
+            // Warm-cache snapshot.  The region, reserved for the snapshot and never
+            // read or written through the cache, holds the keys of the resident
+            // blocks (not their data) in recency order.  flush() saves it, and
+            // prewarm() reads it back and refills the cache from a background
+            // thread, hottest blocks first.
+            void set_snapshot_region(CacheKey key, uint32_t nr_blocks);
+            bool save_snapshot();
+            bool prewarm();
+            void run_prewarm(const CacheKey* keys, size_t count);
+
+            // Zero-copy interface: get_block() pins the block and returns a pointer into
+            // the cache, put_block() drops the pin.  Calls must be balanced.
+            const uint8_t* get_block(CacheKey key);
+            void put_block(CacheKey key);
+
+            // Storage is added and removed a whole page (SECTORS_PER_PAGE slots) at a time
+            bool grow(size_t nr_pages);
+            size_t shrink(size_t nr_pages);
+            size_t nr_pages() const;
+            size_t nr_slots() const { return nr_pages() * SECTORS_PER_PAGE; }
+
+            // Capacity, in blocks, rounded up to a multiple of CACHE_SHARDS pages, as
+            // each shard gets the same number of whole pages.  The cache may sit below
+            // it for a while after the shrinker has taken pages away.
+            size_t capacity() const;
+            bool set_capacity(size_t nr_blocks);
+
+            size_t count_reclaimable() override;
+            size_t scan(size_t nr_pages) override;
+
+            // Statistics
+            void stats(CacheStats& out) const { stats_.snapshot(out); }
+            void reset_stats() { stats_.reset(); }
+
+            // Predicted miss ratio against cache size, see MissRatioEstimator
+            MissRatioEstimator& mrc() { return mrc_; }
+
+            private:
+            CacheShard& shard_for(CacheKey key)
+            {
+                // Hash whole pages' worth of keys together, so a sequential extent
+                // takes each shard lock once per SECTORS_PER_PAGE blocks.
+                uint64_t page = key / SECTORS_PER_PAGE;
+                uint32_t h = (uint32_t)(page ^ (page >> 32)) * 2654435761u;
+                return shards_[(h >> 16) % CACHE_SHARDS];
+            }
+            CacheBackingStore* store_for(CacheKey key) const
+            {
+                return partitions_[cache_key_device(key)].store;
+            }
 
-
-            int hitcounter = 1;
-            int misscounter = 1;
-            int totalcounter = hitcounter + misscounter;
-            int hitrate = hitcounter/totalcounter;
-            int missrate = 1-hitrate;
+            void count_hit(CacheShard& shard, uint32_t slot);
+            bool grow_shard(CacheShard& shard, size_t nr_pages, bool to_target);
+            size_t reserved_blocks(unsigned int device, size_t min_blocks) const;
+            bool fill_span(CacheKey key, size_t count, uint8_t flags, uint8_t* buffer, size_t& filled);
+            void regrow(CacheShard& shard);
+            bool wait_for_fill(CacheShard& shard, CacheKey key, void* buffer);
+            bool fetch_block(CacheKey key, uint8_t* data);
+            void plug_devices();
+            bool unplug_devices();
+
+            CachePartition partitions_[CACHE_MAX_DEVICES] = { };
+            CacheStatCounters stats_;
+            MissRatioEstimator mrc_;
+            CacheShard shards_[CACHE_SHARDS];
+            size_t shrink_cursor_ = 0;
+            CompressedTier* tier_ = NULL;
+            CacheKey snapshot_key_ = 0;
+            uint32_t snapshot_blocks_ = 0; // 0: no snapshot region
         };
 
 
@@ -0,0 +1,81 @@
+#pragma once
+#include <infos/mm/mm.h>
+
+using namespace infos::mm;
+
+/**
+ * Counters for 2 MiB (order-9) allocations and the reserve of blocks kept for them.
+ */
+struct HugeStats
+{
+    uint64_t reserved; // blocks in the reserve now
+    uint64_t target; // blocks the reserve is kept at
+    uint64_t hits; // allocations served from the reserve
+    uint64_t allocated; // allocations served from the free lists, with the reserve empty
+    uint64_t failures; // allocations that found no block at all
+    uint64_t replenished; // blocks added back to the reserve as frees brought them back
+};
+
+/**
+ * What a page allocator offers beyond PageAllocatorAlgorithm.  The calls
+ * disable interrupts around the allocator's state themselves, as the memory
+ * manager does around the algorithm's, and are made from thread context
+ * unless they say otherwise.
+ */
+class PageAllocatorExtensions
+{
+public:
+    virtual ~PageAllocatorExtensions() { }
+
+    // Allocates up to count blocks of 2^order pages into pgds, carving them out of as few
+    // free blocks as it can.  Returns how many it got, which is short if memory ran out;
+    // unlike a single allocation, it does not ask the shrinkers for more.
+    virtual uint64_t alloc_pages_bulk(int order, PageDescriptor **pgds, uint64_t count) = 0;
+
+    // Frees count blocks of 2^order pages, merging neighbouring buddies within the batch
+    // before they reach the free lists.  pgds is used as scratch space.
+    virtual void free_pages_bulk(PageDescriptor **pgds, uint64_t count, int order) = 0;
+
+    // Allocates 2^order zero-filled pages.  Single pages come from a pool zeroed ahead of
+    // time while it has any; anything else is zeroed here, with interrupts enabled.
+    virtual PageDescriptor *alloc_zeroed_pages(int order) = 0;
+
+    // Starts the thread that keeps the zeroed pool filled, if it is not running yet
+    virtual void start_zeroing() = 0;
+
+    // Wakes the zeroing thread if allocations have run the pool low.  May be called with
+    // interrupts disabled, though not from inside the allocator.  Returns true if it woke it.
+    virtual bool kick_zeroing() = 0;
+
+    // Sets how many order-9 blocks are held back from smaller allocations for huge pages.
+    // Smaller allocations still take them, one at a time, rather than fail.
+    virtual void set_huge_reserve(uint64_t count) = 0;
+
+    virtual HugeStats huge_stats() const = 0;
+};
+
+// The active page allocator, if it offers these; set by it in init()
+extern PageAllocatorExtensions *pgalloc_ext;
+
+/**
+ * Something that holds pages it can give back when the system runs short.
+ * When an allocation is about to fail, the page allocator asks each
+ * registered shrinker in turn to release pages, through reclaim_pages().
+ * That happens inside the allocator, with interrupts disabled and with
+ * whatever locks the allocating thread holds, so scan() must not wait for
+ * a lock, nor for device I/O, and must not allocate pages itself.
+ */
+class MemoryShrinker
+{
+public:
+    virtual ~MemoryShrinker() { }
+
+    virtual size_t count_reclaimable() = 0;
+    virtual size_t scan(size_t nr_pages) = 0;
+};
+
+void register_shrinker(MemoryShrinker *shrinker);
+void unregister_shrinker(MemoryShrinker *shrinker);
+
+// Asks the shrinkers for nr_pages pages; returns how many they released
+size_t reclaim_pages(size_t nr_pages);
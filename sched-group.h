@@ -0,0 +1,466 @@
+#pragma once
+#include <infos/kernel/sched.h>
+
+using namespace infos::kernel;
+
+// Scheduling groups, see SchedGroups
+#define MAX_GROUPS 32
+#define ROOT_GROUP 0
+#define NO_GROUP MAX_GROUPS
+#define GROUP_DEFAULT_WEIGHT 1024
+#define MAX_GROUP_MEMBERS 1024 // entities outside the root group, as an open-addressed table
+
+// The least CPU time a group keeps before a sibling owed more takes over, in nanoseconds
+#define GROUP_GRANULARITY 4000000
+
+// quota_left() on a path with no bandwidth cap
+#define NO_QUOTA ((SchedulingEntity::EntityRuntime)-1)
+
+struct GroupStats
+{
+    uint64_t runtime; // CPU time used by entities in the group or below it
+    uint64_t throttled; // periods in which the group ran out of quota
+    unsigned int nr_members; // entities placed directly in the group
+};
+
+/**
+ * A hierarchy of scheduling groups.  Every entity belongs to one group, the
+ * root group unless it was placed elsewhere with set_member(), and every group
+ * but the root has a parent.  Siblings share their parent's CPU time in
+ * proportion to their weights (see GroupShares), and a group may also be capped
+ * at quota nanoseconds of CPU time per period, counted over all CPUs, which
+ * caps everything below it as well.
+ *
+ * This holds what is common to every CPU.  There is no locking here: it
+ * belongs to a scheduler, and is covered by that scheduler's lock.
+ */
+class SchedGroups
+{
+public:
+    SchedGroups()
+    {
+        groups[ROOT_GROUP].used = true;
+        groups[ROOT_GROUP].weight = GROUP_DEFAULT_WEIGHT;
+    }
+
+    /**
+     * Creates a group below parent, returning its number, or NO_GROUP if the
+     * parent does not exist, the weight is zero, or the table is full.
+     */
+    unsigned int create(unsigned int parent, unsigned int weight)
+    {
+        if (!exists(parent) || weight == 0) {
+            return NO_GROUP;
+        }
+
+        for (unsigned int group = 1; group < MAX_GROUPS; group++) {
+            if (!groups[group].used) {
+                groups[group] = Group { };
+                groups[group].used = true;
+                groups[group].parent = parent;
+                groups[group].weight = weight;
+                return group;
+            }
+        }
+        return NO_GROUP;
+    }
+
+    /**
+     * Removes a group, which must have no members and no groups below it.
+     */
+    bool destroy(unsigned int group)
+    {
+        if (group == ROOT_GROUP || !exists(group) || groups[group].nr_members > 0) {
+            return false;
+        }
+
+        for (unsigned int child = 1; child < MAX_GROUPS; child++) {
+            if (groups[child].used && groups[child].parent == group) {
+                return false;
+            }
+        }
+
+        groups[group].used = false;
+        return true;
+    }
+
+    bool set_weight(unsigned int group, unsigned int weight)
+    {
+        if (!exists(group) || weight == 0) {
+            return false;
+        }
+
+        groups[group].weight = weight;
+        return true;
+    }
+
+    /**
+     * Caps a group at quota nanoseconds of CPU time every period nanoseconds,
+     * from now on.  A quota of zero lifts the cap.  The quota may be more than
+     * the period, for a group allowed more than one CPU's worth.
+     */
+    bool set_bandwidth(unsigned int group, SchedulingEntity::EntityRuntime quota,
+                       SchedulingEntity::EntityRuntime period, SchedulingEntity::EntityStartTime now)
+    {
+        if (group == ROOT_GROUP || !exists(group) || (quota > 0 && period == 0)) {
+            return false;
+        }
+
+        Group& g = groups[group];
+        g.quota = quota;
+        g.period = period;
+        g.quota_left = quota;
+        g.period_end = now + period;
+        g.throttled = false;
+        return true;
+    }
+
+    bool exists(unsigned int group) const { return group < MAX_GROUPS && groups[group].used; }
+    unsigned int parent(unsigned int group) const { return groups[group].parent; }
+    unsigned int weight(unsigned int group) const { return groups[group].weight; }
+    bool throttled(unsigned int group) const { return groups[group].throttled; }
+
+    unsigned int group_of(const SchedulingEntity& entity) const
+    {
+        for (unsigned int slot = home(&entity); members[slot].entity; slot = (slot + 1) % MAX_GROUP_MEMBERS) {
+            if (members[slot].entity == &entity) {
+                return members[slot].group;
+            }
+        }
+        return ROOT_GROUP;
+    }
+
+    /**
+     * Puts an entity in a group.  Fails if the group does not exist or the
+     * member table is full.  The entity must be returned to the root group
+     * before it is destroyed.
+     */
+    bool set_member(const SchedulingEntity& entity, unsigned int group)
+    {
+        if (!exists(group)) {
+            return false;
+        }
+
+        unsigned int slot = home(&entity);
+        while (members[slot].entity && members[slot].entity != &entity) {
+            slot = (slot + 1) % MAX_GROUP_MEMBERS;
+        }
+
+        if (members[slot].entity) {
+            groups[members[slot].group].nr_members--;
+            if (group == ROOT_GROUP) {
+                remove_member(slot);
+                return true;
+            }
+        } else if (group == ROOT_GROUP) {
+            return true;
+        } else if (nr_members == MAX_GROUP_MEMBERS - 1) {
+            // Keep a free slot, so that probes always end
+            return false;
+        } else {
+            members[slot].entity = &entity;
+            nr_members++;
+        }
+
+        members[slot].group = group;
+        groups[group].nr_members++;
+        return true;
+    }
+
+    /**
+     * Counts CPU time used by an entity in a group against it and every group
+     * above it, throttling any that run out of quota.
+     */
+    void charge(unsigned int group, SchedulingEntity::EntityRuntime used)
+    {
+        while (true) {
+            Group& g = groups[group];
+            g.runtime += used;
+            if (g.quota > 0 && !g.throttled) {
+                g.quota_left = used < g.quota_left ? g.quota_left - used : 0;
+                if (g.quota_left == 0) {
+                    g.throttled = true;
+                    g.nr_throttled++;
+                }
+            }
+
+            if (group == ROOT_GROUP) {
+                break;
+            }
+            group = g.parent;
+        }
+    }
+
+    // Starts new bandwidth periods for capped groups whose period has ended
+    void refill(SchedulingEntity::EntityStartTime now)
+    {
+        for (Group& g : groups) {
+            if (!g.used || g.quota == 0 || now < g.period_end) {
+                continue;
+            }
+
+            g.quota_left = g.quota;
+            g.throttled = false;
+            g.period_end += g.period;
+            if (g.period_end <= now) {
+                g.period_end = now + g.period;
+            }
+        }
+    }
+
+    // The least quota left by the group or any group above it, or NO_QUOTA if none is capped
+    SchedulingEntity::EntityRuntime quota_left(unsigned int group) const
+    {
+        SchedulingEntity::EntityRuntime left = NO_QUOTA;
+        while (group != ROOT_GROUP) {
+            const Group& g = groups[group];
+            if (g.quota > 0 && g.quota_left < left) {
+                left = g.quota_left;
+            }
+            group = g.parent;
+        }
+        return left;
+    }
+
+    void stats(unsigned int group, GroupStats& out) const
+    {
+        out = GroupStats { };
+        if (exists(group)) {
+            out.runtime = groups[group].runtime;
+            out.throttled = groups[group].nr_throttled;
+            out.nr_members = groups[group].nr_members;
+        }
+    }
+
+private:
+    struct Group
+    {
+        bool used;
+        unsigned int parent;
+        unsigned int weight;
+
+        SchedulingEntity::EntityRuntime quota; // 0: not capped
+        SchedulingEntity::EntityRuntime period;
+        SchedulingEntity::EntityRuntime quota_left; // this period, over all CPUs
+        SchedulingEntity::EntityStartTime period_end;
+        bool throttled;
+
+        uint64_t runtime;
+        uint64_t nr_throttled;
+        unsigned int nr_members;
+    };
+
+    struct GroupMember
+    {
+        const SchedulingEntity *entity; // NULL: free slot
+        unsigned int group;
+    };
+
+    static unsigned int home(const SchedulingEntity *entity)
+    {
+        uintptr_t key = (uintptr_t)entity;
+        return ((key >> 4) ^ (key >> 14)) % MAX_GROUP_MEMBERS;
+    }
+
+    // Empties a slot, shifting back any later entries of the probe run that would no longer be found
+    void remove_member(unsigned int slot)
+    {
+        members[slot].entity = NULL;
+        nr_members--;
+
+        unsigned int next = slot;
+        while (true) {
+            next = (next + 1) % MAX_GROUP_MEMBERS;
+            if (!members[next].entity) {
+                break;
+            }
+
+            // Stays put if its home lies cyclically in (slot, next]
+            unsigned int h = home(members[next].entity);
+            bool reachable = slot < next ? (h > slot && h <= next) : (h > slot || h <= next);
+            if (!reachable) {
+                members[slot] = members[next];
+                members[next].entity = NULL;
+                slot = next;
+            }
+        }
+    }
+
+    Group groups[MAX_GROUPS] = { };
+    GroupMember members[MAX_GROUP_MEMBERS] = { };
+    unsigned int nr_members = 0;
+};
+
+/**
+ * How a run queue shares its CPU between groups.  Each group has a virtual
+ * runtime, the CPU time its subtree has used on this CPU scaled inversely by
+ * its weight, and at each level of the hierarchy the runnable child with the
+ * least virtual runtime is chosen, so siblings get CPU time in proportion to
+ * their weights.  The entities placed directly in a group compete with its
+ * child groups as one more child, of the default weight.  A group that
+ * becomes runnable again starts level with the sibling last chosen, so that
+ * sleeping does not bank CPU time.
+ */
+class GroupShares
+{
+public:
+    // An entity of the group has been queued on this CPU
+    void enqueue(const SchedGroups& groups, unsigned int group)
+    {
+        if (nr_own[group]++ == 0) {
+            own_vruntime[group] = rejoin(own_vruntime[group], clock[group]);
+        }
+
+        while (true) {
+            if (nr_runnable[group]++ == 0 && group != ROOT_GROUP) {
+                vruntime[group] = rejoin(vruntime[group], clock[groups.parent(group)]);
+            }
+
+            if (group == ROOT_GROUP) {
+                break;
+            }
+            group = groups.parent(group);
+        }
+    }
+
+    void dequeue(const SchedGroups& groups, unsigned int group)
+    {
+        nr_own[group]--;
+        while (true) {
+            nr_runnable[group]--;
+            if (group == ROOT_GROUP) {
+                break;
+            }
+            group = groups.parent(group);
+        }
+    }
+
+    // An entity of the group has run for some CPU time on this CPU
+    void charge(const SchedGroups& groups, unsigned int group, SchedulingEntity::EntityRuntime used)
+    {
+        own_vruntime[group] += used;
+        while (group != ROOT_GROUP) {
+            vruntime[group] += used * GROUP_DEFAULT_WEIGHT / groups.weight(group);
+            group = groups.parent(group);
+        }
+    }
+
+    /**
+     * Chooses the group whose own entities should run next, walking down from
+     * the root, or returns NO_GROUP if nothing runnable is left unthrottled.
+     * The group picked last keeps its place at each level until a sibling has
+     * fallen GROUP_GRANULARITY of virtual runtime behind it.
+     */
+    unsigned int pick(const SchedGroups& groups, unsigned int last)
+    {
+        // Groups found to have nothing to run below them, because of throttling
+        uint32_t exhausted = 0;
+
+        unsigned int group = ROOT_GROUP;
+        while (true) {
+            unsigned int best = NO_GROUP;
+            uint64_t best_vruntime = 0;
+            if (nr_own[group] > 0) {
+                best = group;
+                best_vruntime = own_vruntime[group];
+            }
+
+            for (unsigned int child = 1; child < MAX_GROUPS; child++) {
+                if (child == group || nr_runnable[child] == 0 || (exhausted & (1u << child)) ||
+                    !groups.exists(child) || groups.parent(child) != group || groups.throttled(child)) {
+                    continue;
+                }
+                if (best == NO_GROUP || vruntime[child] < best_vruntime) {
+                    best = child;
+                    best_vruntime = vruntime[child];
+                }
+            }
+
+            // Stay with the last pick's branch while it is not too far ahead
+            unsigned int sticky = branch_below(groups, last, group);
+            if (sticky != NO_GROUP && sticky != best && eligible(groups, sticky, group, exhausted)) {
+                uint64_t sticky_vruntime = sticky == group ? own_vruntime[group] : vruntime[sticky];
+                if (sticky_vruntime < best_vruntime + GROUP_GRANULARITY) {
+                    best = sticky;
+                    best_vruntime = sticky_vruntime;
+                }
+            }
+
+            if (best == NO_GROUP) {
+                if (group == ROOT_GROUP) {
+                    return NO_GROUP;
+                }
+
+                // Back out of a branch that turned out to be all throttled
+                exhausted |= 1u << group;
+                group = ROOT_GROUP;
+                continue;
+            }
+
+            if (clock[group] < best_vruntime) {
+                clock[group] = best_vruntime;
+            }
+            if (best == group) {
+                return group;
+            }
+            group = best;
+        }
+    }
+
+    // Whether anything else runnable on this CPU competes with the group at any level above it
+    bool contended(const SchedGroups& groups, unsigned int group) const
+    {
+        if (nr_runnable[group] > nr_own[group]) {
+            return true;
+        }
+
+        while (group != ROOT_GROUP) {
+            unsigned int parent = groups.parent(group);
+            if (nr_runnable[parent] > nr_runnable[group]) {
+                return true;
+            }
+            group = parent;
+        }
+        return false;
+    }
+
+private:
+    // Where a group rejoins its siblings: level with them, or at most a granularity ahead if it had got that far
+    static uint64_t rejoin(uint64_t vruntime, uint64_t clock)
+    {
+        if (vruntime < clock) {
+            return clock;
+        }
+        return vruntime < clock + GROUP_GRANULARITY ? vruntime : clock + GROUP_GRANULARITY;
+    }
+
+    // The child of ancestor on the way down to group: ancestor itself if they are the same, NO_GROUP if group is not below it
+    static unsigned int branch_below(const SchedGroups& groups, unsigned int group, unsigned int ancestor)
+    {
+        if (group == NO_GROUP || group == ancestor) {
+            return group;
+        }
+
+        while (group != ROOT_GROUP) {
+            if (groups.parent(group) == ancestor) {
+                return group;
+            }
+            group = groups.parent(group);
+        }
+        return NO_GROUP;
+    }
+
+    bool eligible(const SchedGroups& groups, unsigned int child, unsigned int group, uint32_t exhausted) const
+    {
+        if (child == group) {
+            return nr_own[group] > 0;
+        }
+        return nr_runnable[child] > 0 && !(exhausted & (1u << child)) && !groups.throttled(child);
+    }
+
+    uint64_t vruntime[MAX_GROUPS] = { };
+    uint64_t own_vruntime[MAX_GROUPS] = { };
+    uint64_t clock[MAX_GROUPS] = { }; // the virtual runtime of the group's child chosen last
+    unsigned int nr_runnable[MAX_GROUPS] = { }; // entities queued here in the group or below it
+    unsigned int nr_own[MAX_GROUPS] = { }; // entities queued here in the group itself
+};
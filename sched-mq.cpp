@@ -1,19 +1,226 @@
+#include <infos/kernel/kernel.h>
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
 #include <infos/kernel/log.h>
+#include <infos/mm/mm.h>
+#include <infos/mm/pgalloc-ext.h>
 #include <infos/util/list.h>
 #include <infos/util/lock.h>
+#include "sched-group.h"
+#include "sched-pi.h"
 
 using namespace infos::kernel;
 using namespace infos::util;
 
+PriorityInheritance *pi_scheduler;
+
 // Define the number of priority levels
 #define NUM_PRIORITIES 4
 
+// Default timeslice of each priority level, in nanoseconds of CPU time (see set_quantum())
+#define QUANTUM_REALTIME 4000000
+#define QUANTUM_INTERACTIVE 10000000
+#define QUANTUM_NORMAL 40000000
+#define QUANTUM_DAEMON 100000000
+
+// next_preemption() when nothing is waiting to take over from the running entity
+#define NO_PREEMPTION ((SchedulingEntity::EntityRuntime)-1)
+
+// Earliest-deadline-first class, see set_deadline_params()
+#define EDF_MAX_ENTITIES 16
+#define EDF_MAX_UTILISATION 950 // permille of a CPU the EDF class may reserve; the rest stays for the queues
+
+// CPUs, see this_cpu() and place_entity()
+#define MQ_MAX_CPUS 16
+#define MQ_APIC_IDS 256 // APIC ids below this are looked up by index; any above, by a scan
+#define MQ_AFFINE_LOAD 1 // a wakeup stays on its last CPU while that has no more than this many entities
+#define MQ_MAX_PINNED 32 // entities with an affinity mask narrower than CPU_MASK_ALL
+#define MQ_HINTS 256 // last-CPU hints, direct-mapped on the entity's address
+
+// Priority inheritance, see boost()
+#define MQ_MAX_BOOSTS 32 // boosts in force at once, one per contended PIMutex and entity holding it
+
+// Gangs, see set_gang()
+#define MQ_MAX_GANGS 8
+#define GANG_NONE MQ_MAX_GANGS
+#define GANG_SLICE 10000000 // wall time a dispatched gang holds its CPUs for, in nanoseconds
+
+// Placement policies, see set_policy()
+#define MQ_POLICY_PERFORMANCE 0 // spread over every CPU
+#define MQ_POLICY_POWER 1 // pack onto as few CPUs as the load needs
+#define PACK_INTERVAL 4000000 // how often the power policy reviews how many CPUs it uses, in nanoseconds
+#define PACK_SPREAD_LOAD 2 // runnable entities per CPU in use above which another CPU is brought in
+#define PACK_SHRINK_LOAD 1 // and at or below which, on one fewer CPU, that CPU is let go...
+#define PACK_HOLD 40000000 // ...once the load has stayed that low for this long
+
+typedef uint32_t CpuMask;
+#define CPU_MASK_ALL ((CpuMask)-1)
+
+/**
+ * An entity in the EDF class.  Each period it may run for runtime
+ * nanoseconds, and it should have done so by deadline nanoseconds into the
+ * period.  When its budget for the period runs out it is throttled until the
+ * next period begins, however urgent its deadline.
+ */
+struct EdfEntity
+{
+    SchedulingEntity *entity; // NULL: free table entry
+    SchedulingEntity::EntityRuntime runtime;
+    SchedulingEntity::EntityRuntime deadline;
+    SchedulingEntity::EntityRuntime period;
+
+    SchedulingEntity::EntityRuntime budget; // runtime left this period
+    SchedulingEntity::EntityStartTime abs_deadline; // of the current period
+    SchedulingEntity::EntityStartTime next_period; // when the budget is next refilled
+
+    unsigned int cpu; // the CPU whose reservation it was admitted against
+    bool runnable;
+    bool throttled;
+    bool deadline_passed; // this period's deadline has been dealt with, see edf_replenish()
+    unsigned int heap_index; // position in its CPU's deadline heap, if runnable and not throttled
+};
+
+struct EdfStats
+{
+    uint64_t admitted; // set_deadline_params() calls that were accepted
+    uint64_t rejected; // and refused by admission control
+    uint64_t throttled; // budgets run out before the period ended
+    uint64_t missed; // periods that ended with the entity still owed CPU time
+};
+
+struct GangStats
+{
+    uint64_t dispatched; // slots in which every member was given a CPU together
+    uint64_t partial; // turns given up because some members were blocked
+    uint64_t short_of_cpus; // turns given up because too few CPUs were free for all the members
+    uint64_t broken; // slots cut short because a member blocked
+    uint64_t joins; // members that ran in their slot
+    uint64_t join_skew; // nanoseconds between slots starting and those members running, in total
+};
+
+struct CpuStats
+{
+    uint64_t wakeups; // entities placed on this CPU by add_to_runqueue()
+    uint64_t affine_wakeups; // of which were placed back on the CPU they last ran on
+    uint64_t migrations; // entities that arrived here having last run on another CPU
+    uint64_t pulls; // of which were taken from a busier CPU's queue when this one went idle
+
+    uint64_t idle_ns; // time spent with nothing to run
+    uint64_t idle_periods;
+    uint64_t longest_idle; // nanoseconds
+};
+
+struct PackStats
+{
+    unsigned int in_use; // CPUs the power policy is placing entities on
+    uint64_t spreads; // times it brought in another CPU
+    uint64_t packs; // and let one go
+};
+
+/**
+ * The run queues of one CPU, and what that CPU is running.
+ */
+struct CpuRunqueue
+{
+    // Each group's run queues for each priority level, and what the head of each has left of its slice
+    List<SchedulingEntity*> runqueues[MAX_GROUPS][NUM_PRIORITIES];
+    SchedulingEntity::EntityRuntime slice_left[MAX_GROUPS][NUM_PRIORITIES] = { };
+    unsigned int nr_queued = 0;
+    GroupShares shares;
+
+    // Entities boosted by priority inheritance, by boosted level; each is also still in its own queue
+    List<SchedulingEntity*> boosted[NUM_PRIORITIES];
+
+    // The gang whose slot this CPU is part of, and which member it runs
+    unsigned int gang = GANG_NONE;
+    unsigned int gang_member = 0;
+
+    // Binary min-heap of this CPU's runnable, unthrottled EDF entities keyed on absolute deadline
+    EdfEntity *heap[EDF_MAX_ENTITIES];
+    unsigned int nr_heap = 0;
+    uint64_t edf_reserved = 0; // permille
+
+    // The entity last picked, its group and level (or EDF entry), and its CPU time when last charged
+    SchedulingEntity *current = NULL;
+    unsigned int current_group = ROOT_GROUP;
+    unsigned int current_level = 0;
+    EdfEntity *current_edf = NULL;
+    bool current_gang = false;
+    SchedulingEntity::EntityRuntime current_runtime = 0;
+
+    bool online = false;
+    unsigned int cache_domain = 0;
+    bool idle = false;
+    SchedulingEntity::EntityStartTime idle_since = 0;
+    CpuStats stats = { };
+};
+
+/**
+ * Spinlock over the whole scheduler.  Each CPU picks from its own queues, but
+ * wakeups and idle pulls reach into the others'.
+ */
+class SchedLock
+{
+public:
+    void lock()
+    {
+        while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+
+    void unlock() { __atomic_clear(&locked, __ATOMIC_RELEASE); }
+
+private:
+    bool locked = false;
+};
+
 /**
- * A Multiple Queue priority scheduling algorithm
+ * A Multiple Queue priority scheduling algorithm.  Each priority level has a
+ * FIFO run queue and a timeslice (quantum) of its own.  The entity at the
+ * head of the highest non-empty queue keeps the CPU until it has used up its
+ * quantum of CPU time, and then goes to the back of its queue.  A higher
+ * level becoming runnable preempts it, but it keeps what is left of its slice
+ * for when its level runs again, so only the head of each queue is ever part
+ * way through a slice.
+ *
+ * Entities given deadline parameters form an earliest-deadline-first class
+ * that is consulted before any of the queues: of those that are runnable and
+ * have budget left, the one with the earliest absolute deadline runs.
+ * Admission control keeps their total reserved utilisation at or below
+ * EDF_MAX_UTILISATION, so with throttling the queues always get the rest.
+ *
+ * Every CPU has its own set of queues and its own EDF heap.  A waking entity
+ * goes back to the CPU it last ran on while that CPU is lightly loaded, so it
+ * finds its cache still warm; otherwise to an idle CPU, preferring one that
+ * shares a cache with its last.  An EDF entity is bound to one CPU when it is
+ * admitted.  A CPU with nothing to run pulls a waiting entity from the
+ * busiest other CPU.
+ *
+ * Below the EDF class, entities are divided into a hierarchy of groups (see
+ * SchedGroups).  Each pick first walks down the hierarchy choosing between
+ * sibling groups by weight, skipping any that have used up their bandwidth
+ * quota, and then takes the highest priority entity queued in the group it
+ * arrives at, so a group's share does not grow with its number of entities.
+ *
+ * An entity holding a PIMutex that a more urgent entity waits for is boosted
+ * to the waiter's level.  Whichever group a pick arrives at, a boosted entity
+ * competes at that level, ahead of the group's own entities there and behind
+ * its more urgent ones.  It runs whatever its own group's share or quota, as
+ * holding up the waiter would hold up a level its group does not get to
+ * decide about.  Its CPU time is still charged to its group, which it may
+ * throttle, but quota it overruns while boosted is not carried over into
+ * the group's later periods.
+ *
+ * Gangs of entities that spin-wait for each other are run all together or
+ * not at all.  A gang is dispatched in a slot of GANG_SLICE nanoseconds of
+ * wall time for which it holds one CPU per member, ahead of the groups; after
+ * a slot it waits as long again before its next while other work is queued.
+ *
+ * Under the power policy, wakeups are placed on as few CPUs as the load
+ * needs, so the others stay idle for longer; see set_policy().
  */
-class MultipleQueuePriorityScheduler : public SchedulingAlgorithm
+class MultipleQueuePriorityScheduler : public SchedulingAlgorithm, public PriorityInheritance
 {
 public:
     /**
@@ -26,7 +233,18 @@ public:
      */
     void init()
     {
-        // Meh
+        // In x2APIC mode the local APIC's registers are MSRs, and otherwise they are
+        // mapped at the base address, which every CPU shares
+        uint32_t lo, hi;
+        asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(0x1b));
+        x2apic = lo & (1 << 10);
+        if (!x2apic) {
+            lapic_id = (volatile uint32_t *)pa_to_vpa(((uint64_t)hi << 32 | lo) & ~0xfffull) + 0x20 / 4;
+        }
+
+        UniqueLock<SchedLock> l(lock);
+        this_cpu();
+        pi_scheduler = this;
     }
 
     /**
@@ -35,25 +253,29 @@ public:
      */
     void add_to_runqueue(SchedulingEntity& entity) override
     {
-        // Determine the priority level of the entity
-        int priority = entity->priority();
-        if (priority >= NUM_PRIORITIES) {
-            priority = NUM_PRIORITIES - 1;
-        }
-        if (priority = 0) {
-            runqueue0.append(&entity);
-        }
-        if (priority = 1) {
-            runqueue1.append(&entity);
-        }
-        if (priority = 2) {
-            runqueue2.append(&entity);
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        this_cpu();
+
+        EdfEntity *edf = find_edf(entity);
+        if (edf) {
+            edf_wakeup(*edf, sys.runtime());
+            return;
         }
-        if (priority = 3) {
-            runqueue3.append(&entity);
+
+        // Gang members wait for their gang's slot rather than in a queue
+        unsigned int index;
+        Gang *gang = find_gang(entity, index);
+        if (gang) {
+            if (!gang->runnable[index]) {
+                gang->runnable[index] = true;
+                gang->nr_runnable++;
+            }
+            return;
         }
 
-        // Add the entity to the appropriate run queue
+        enqueue(place_entity(entity), entity);
     }
 
     /**
@@ -62,26 +284,31 @@ public:
      */
     void remove_from_runqueue(SchedulingEntity& entity) override
     {
-        // Determine the priority level of the entity
-        int priority = entity->priority();
-        if (priority >= NUM_PRIORITIES) {
-            priority = NUM_PRIORITIES - 1;
-        }
-        if (priority = 0) {
-            runqueue0.remove(&entity);
-        }
-        if (priority = 1) {
-            runqueue1.remove(&entity);
-        }
-        if (priority = 2) {
-            runqueue2.remove(&entity);
-        }
-        if (priority = 3) {
-            runqueue3.remove(&entity);
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        EdfEntity *edf = find_edf(entity);
+        if (edf) {
+            CpuRunqueue& rq = cpus[edf->cpu];
+            if (rq.current == &entity) {
+                charge_current(rq);
+                rq.current = NULL;
+            }
+            if (edf->runnable && !edf->throttled) {
+                heap_remove(rq, *edf);
+            }
+            edf->runnable = false;
+            return;
         }
 
-        // Remove the entity from the appropriate run queue
+        unsigned int index;
+        Gang *gang = find_gang(entity, index);
+        if (gang) {
+            gang_block(*gang, index);
+            return;
+        }
 
+        unlink_from_queue(entity);
     }
 
     /**
@@ -91,46 +318,1453 @@ public:
      */
     SchedulingEntity *pick_next_entity() override
     {
-        
-        SchedulingEntity *next = NULL;
-
-        // Select the highest priority non-empty run queue
-        if (runqueue0.count() > 0) {
-            next = &runqueue0.first();
-            runqueue0.remove(next);
-            runqueue0.append(next);
-            goto label1;
-        }
-        if (runqueue1.count() > 0) {
-            SchedulingEntity *next = &runqueue1.first();
-            runqueue1.remove(*next);
-            runqueue1.append(next);
-            goto label1;
-        }
-        if (runqueue2.count() > 0) {
-            SchedulingEntity *next = &runqueue2.first();
-            runqueue2.remove(*next);
-            runqueue2.append(next);
-            goto label1;
-        }
-        if (runqueue3.count() > 0) {
-            SchedulingEntity *next = &runqueue3.first();
-            runqueue3.remove(*next);
-            runqueue3.append(next);
-            goto label1;
-           
-        }
-        label1:
+        SchedulingEntity *next = pick();
+
+        // Time a CPU would spend idle is when the page allocator's zeroing thread
+        // refills its pool.  Waking it comes back in through add_to_runqueue(), so
+        // only once the lock is dropped.
+        if (!next && pgalloc_ext && pgalloc_ext->kick_zeroing()) {
+            next = pick();
+        }
         return next;
+    }
+
+    /**
+     * Sets the timeslice of a priority level, in nanoseconds of CPU time.  The
+     * entity running at that level now finishes the slice it started.
+     */
+    void set_quantum(unsigned int level, SchedulingEntity::EntityRuntime ns)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
 
+        if (level < NUM_PRIORITIES && ns > 0) {
+            quantum[level] = ns;
+        }
     }
 
-private:
-    // The run queues for each priority level
-    List<SchedulingEntity*> runqueue0;
-    List<SchedulingEntity*> runqueue1;
-    List<SchedulingEntity*> runqueue2;
-    List<SchedulingEntity*> runqueue3;
+    /**
+     * How much more CPU time the entity this CPU last picked may have before
+     * the next pick would take the CPU away from it, so the timer can be set
+     * for then instead of firing every tick.  NO_PREEMPTION if nothing is
+     * waiting at its level or competing with its group, and its group has no
+     * quota to run out of, since only a wakeup at a higher level could
+     * replace it, and that comes in through add_to_runqueue() rather than the
+     * timer.
+     */
+    SchedulingEntity::EntityRuntime next_preemption()
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        unsigned int cpu = this_cpu();
+        if (cpu == MQ_MAX_CPUS || !cpus[cpu].current) {
+            return NO_PREEMPTION;
+        }
+        const CpuRunqueue& rq = cpus[cpu];
+
+        // A throttled EDF entity coming back takes over, whatever is running
+        SchedulingEntity::EntityRuntime due = NO_PREEMPTION;
+        SchedulingEntity::EntityStartTime now = sys.runtime();
+        for (const EdfEntity& edf : edf_entities) {
+            if (edf.entity && edf.cpu == cpu && edf.runnable && edf.throttled) {
+                SchedulingEntity::EntityRuntime wait = edf.next_period > now ? edf.next_period - now : 0;
+                due = wait < due ? wait : due;
+            }
+        }
+
+        SchedulingEntity::EntityRuntime used = rq.current->cpu_runtime() - rq.current_runtime;
+        SchedulingEntity::EntityRuntime left = NO_PREEMPTION;
+        if (rq.current_edf) {
+            left = rq.current_edf->budget;
+        } else if (rq.current_gang) {
+            // Wall time, not CPU time: the slot ends for every member at once
+            if (rq.gang == GANG_NONE) {
+                return 0;
+            }
+            left = gangs[rq.gang].slot_end > now ? gangs[rq.gang].slot_end - now : 0;
+            return left < due ? left : due;
+        } else if (boost_level(*rq.current) != PI_NO_LEVEL) {
+            // Runs until its waiters have had what it holds
+            return due;
+        } else {
+            unsigned int group = rq.current_group;
+            if (rq.runqueues[group][rq.current_level].count() >= 2) {
+                left = rq.slice_left[group][rq.current_level];
+            }
+            if (rq.shares.contended(groups, group) && left > GROUP_GRANULARITY) {
+                left = GROUP_GRANULARITY;
+            }
+            if (groups.quota_left(group) < left) {
+                left = groups.quota_left(group);
+            }
+        }
+
+        if (left == NO_PREEMPTION) {
+            return due;
+        }
+        left = used < left ? left - used : 0;
+        return left < due ? left : due;
+    }
+
+    /**
+     * Moves an entity into the EDF class: every period nanoseconds it is owed
+     * runtime nanoseconds of CPU time by deadline nanoseconds into the period.
+     * Fails if the parameters make no sense (runtime <= deadline <= period is
+     * required), if the table is full, or if no CPU the entity may run on has
+     * room to reserve that much without passing EDF_MAX_UTILISATION.  The
+     * entity is bound to the least reserved CPU that does.  It must leave the
+     * class through clear_deadline_params() before it is destroyed.
+     */
+    bool set_deadline_params(SchedulingEntity& entity, SchedulingEntity::EntityRuntime runtime,
+                             SchedulingEntity::EntityRuntime deadline, SchedulingEntity::EntityRuntime period)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        unsigned int index;
+        if (runtime == 0 || runtime > deadline || deadline > period || find_gang(entity, index)) {
+            edf_stats.rejected++;
+            return false;
+        }
+
+        EdfEntity *edf = find_edf(entity);
+        uint64_t utilisation = runtime * 1000 / period;
+        CpuMask allowed = allowed_cpus(entity);
+
+        // Bind to the CPU with the most room, not counting what this entity already reserves
+        unsigned int best = MQ_MAX_CPUS;
+        uint64_t best_reserved = 0;
+        for (unsigned int cpu = 0; cpu < MQ_MAX_CPUS; cpu++) {
+            if (!(allowed & (1u << cpu))) {
+                continue;
+            }
+
+            uint64_t reserved = cpus[cpu].edf_reserved;
+            if (edf && edf->cpu == cpu) {
+                reserved -= edf->runtime * 1000 / edf->period;
+            }
+            if (best == MQ_MAX_CPUS || reserved < best_reserved) {
+                best = cpu;
+                best_reserved = reserved;
+            }
+        }
+
+        if (!edf) {
+            edf = find_edf_slot();
+        }
+        if (!edf || best == MQ_MAX_CPUS || best_reserved + utilisation > EDF_MAX_UTILISATION) {
+            edf_stats.rejected++;
+            return false;
+        }
+
+        bool runnable;
+        if (edf->entity) {
+            // New parameters for an admitted entity take effect from a fresh period
+            runnable = edf->runnable;
+            if (runnable && !edf->throttled) {
+                heap_remove(cpus[edf->cpu], *edf);
+            }
+            if (cpus[edf->cpu].current_edf == edf) {
+                cpus[edf->cpu].current_edf = NULL;
+                cpus[edf->cpu].current = NULL;
+            }
+            cpus[edf->cpu].edf_reserved -= edf->runtime * 1000 / edf->period;
+        } else {
+            // Leaving the queues: if it is runnable it is on one of them
+            runnable = unlink_from_queue(entity);
+        }
+
+        edf->entity = &entity;
+        edf->runtime = runtime;
+        edf->deadline = deadline;
+        edf->period = period;
+        edf->abs_deadline = 0;
+        edf->next_period = 0;
+        edf->cpu = best;
+        edf->runnable = false;
+        edf->throttled = false;
+        cpus[best].edf_reserved += utilisation;
+        edf_stats.admitted++;
+
+        if (runnable) {
+            edf_wakeup(*edf, sys.runtime());
+        }
+        return true;
+    }
+
+    /**
+     * Takes an entity out of the EDF class and back to a priority level's
+     * queue, releasing its reservation.
+     */
+    void clear_deadline_params(SchedulingEntity& entity)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        EdfEntity *edf = find_edf(entity);
+        if (!edf) {
+            return;
+        }
+
+        CpuRunqueue& rq = cpus[edf->cpu];
+        bool runnable = edf->runnable;
+        if (runnable && !edf->throttled) {
+            heap_remove(rq, *edf);
+        }
+        if (rq.current_edf == edf) {
+            rq.current_edf = NULL;
+            rq.current = NULL;
+        }
+        rq.edf_reserved -= edf->runtime * 1000 / edf->period;
+        edf->entity = NULL;
+
+        if (runnable) {
+            enqueue(place_entity(entity), entity);
+        }
+    }
+
+    void stats(EdfStats& out)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        out = edf_stats;
+    }
+
+    /**
+     * Restricts the CPUs an entity may run on to those set in mask (bit n for
+     * CPU n); CPU_MASK_ALL lifts the restriction.  A queued entity on a CPU it
+     * may no longer use is moved straight away, unless it is running there,
+     * in which case it moves when it next wakes up.  EDF entities keep the CPU
+     * they were admitted on until set_deadline_params() is called again.
+     * Fails if the mask names no CPU, or if MQ_MAX_PINNED entities already
+     * have masks.  A restricted entity must have its mask lifted before it is
+     * destroyed.
+     */
+    bool set_affinity(SchedulingEntity& entity, CpuMask mask)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        if (mask == 0) {
+            return false;
+        }
+
+        PinnedEntity *pin = find_pin(&entity);
+        if (mask == CPU_MASK_ALL) {
+            if (pin) {
+                pin->entity = NULL;
+            }
+            return true;
+        }
+
+        if (!pin) {
+            pin = find_pin(NULL);
+            if (!pin) {
+                return false;
+            }
+        }
+        pin->entity = &entity;
+        pin->mask = mask;
+
+        unsigned int cpu = queued_on(entity);
+        if (cpu != MQ_MAX_CPUS && !(mask & (1u << cpu)) && cpus[cpu].current != &entity) {
+            unlink_from_queue(entity);
+            enqueue(place_entity(entity), entity);
+        }
+        return true;
+    }
+
+    /**
+     * Puts a CPU in a cache domain: wakeups that cannot stay on their last
+     * CPU prefer an idle one in the same domain.  All CPUs start out in domain
+     * 0, since nothing here knows the topology.
+     */
+    void set_cache_domain(unsigned int cpu, unsigned int domain)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        if (cpu < MQ_MAX_CPUS) {
+            cpus[cpu].cache_domain = domain;
+        }
+    }
+
+    void cpu_stats(unsigned int cpu, CpuStats& out)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        out = cpu < MQ_MAX_CPUS ? cpus[cpu].stats : CpuStats { };
+        if (cpu < MQ_MAX_CPUS && cpus[cpu].idle) {
+            // Count the idle period so far
+            SchedulingEntity::EntityRuntime idle = sys.runtime() - cpus[cpu].idle_since;
+            out.idle_ns += idle;
+            out.longest_idle = idle > out.longest_idle ? idle : out.longest_idle;
+        }
+    }
+
+    /**
+     * Chooses where wakeups go.  MQ_POLICY_PERFORMANCE, the default, spreads
+     * them over every CPU.  MQ_POLICY_POWER places them only on the first few
+     * CPUs, as many as the load needs: another is brought in as soon as there
+     * are more than PACK_SPREAD_LOAD runnable entities for each CPU in use,
+     * but one is only let go once the load has fitted on one fewer at
+     * PACK_SHRINK_LOAD each for PACK_HOLD, so a load near the boundary does
+     * not make the count flap.  A CPU let go runs what it already has, and no
+     * longer pulls work when it runs out.
+     */
+    bool set_policy(unsigned int mode)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        if (mode != MQ_POLICY_PERFORMANCE && mode != MQ_POLICY_POWER) {
+            return false;
+        }
+
+        if (mode == MQ_POLICY_POWER && policy != MQ_POLICY_POWER) {
+            // Start from every CPU, and pack down as the load allows
+            nr_in_use = MQ_MAX_CPUS;
+            low_since = 0;
+            next_pack_review = 0;
+        }
+        policy = mode;
+        return true;
+    }
+
+    void pack_stats(PackStats& out)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        out = packing;
+        out.in_use = policy == MQ_POLICY_POWER ? (nr_in_use < nr_cpus ? nr_in_use : nr_cpus) : nr_cpus;
+    }
+
+    /**
+     * Creates a scheduling group below parent (ROOT_GROUP for a top level
+     * one), which will share its parent's CPU time with its siblings in
+     * proportion to weight; GROUP_DEFAULT_WEIGHT is what the entities placed
+     * directly in the parent get between them.  Returns the new group's
+     * number, or NO_GROUP.
+     */
+    unsigned int create_group(unsigned int parent, unsigned int weight)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        return groups.create(parent, weight);
+    }
+
+    /**
+     * Removes a group that has no entities and no groups left in it.
+     */
+    bool destroy_group(unsigned int group)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        return groups.destroy(group);
+    }
+
+    bool set_group_weight(unsigned int group, unsigned int weight)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        return groups.set_weight(group, weight);
+    }
+
+    /**
+     * Caps a group, and everything below it, at quota nanoseconds of CPU time
+     * per period over all CPUs.  Once the quota is used up none of it runs
+     * until the next period.  A quota of zero lifts the cap.
+     */
+    bool set_group_bandwidth(unsigned int group, SchedulingEntity::EntityRuntime quota,
+                             SchedulingEntity::EntityRuntime period)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        return groups.set_bandwidth(group, quota, period, sys.runtime());
+    }
+
+    /**
+     * Moves an entity into a group, requeueing it there if it is runnable.
+     * An entity in any group but ROOT_GROUP must be moved back to the root
+     * before it is destroyed.
+     */
+    bool set_group(SchedulingEntity& entity, unsigned int group)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        if (!groups.exists(group)) {
+            return false;
+        }
+
+        // EDF entities are scheduled ahead of every group, so are not queued in one
+        unsigned int cpu = find_edf(entity) ? MQ_MAX_CPUS : queued_on(entity);
+        bool running = cpu != MQ_MAX_CPUS && cpus[cpu].current == &entity;
+        if (cpu != MQ_MAX_CPUS) {
+            unlink_from_queue(entity);
+        }
+
+        bool moved = groups.set_member(entity, group);
+        if (cpu != MQ_MAX_CPUS) {
+            enqueue(cpu, entity);
+            if (running) {
+                // Still running, and now charged to its new group
+                run(cpu, &entity, groups.group_of(entity), level_of(entity), NULL);
+            }
+        }
+        return moved;
+    }
+
+    void group_stats(unsigned int group, GroupStats& out)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        groups.stats(group, out);
+    }
+
+    /**
+     * Creates an empty gang, returning its number, or GANG_NONE if there are
+     * MQ_MAX_GANGS already.
+     */
+    unsigned int create_gang()
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        for (unsigned int id = 0; id < MQ_MAX_GANGS; id++) {
+            if (!gangs[id].used) {
+                gangs[id] = Gang { };
+                gangs[id].used = true;
+                nr_gangs++;
+                return id;
+            }
+        }
+        return GANG_NONE;
+    }
+
+    bool destroy_gang(unsigned int id)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        if (id >= MQ_MAX_GANGS || !gangs[id].used || gangs[id].nr_members > 0) {
+            return false;
+        }
+
+        gangs[id].used = false;
+        nr_gangs--;
+        return true;
+    }
+
+    /**
+     * Makes an entity a member of a gang, or with GANG_NONE takes it out of
+     * its gang and back to its queue.  Members run only while their whole
+     * gang can, each on its own CPU, so a gang may have at most MQ_MAX_CPUS
+     * of them, and should have no more than there are CPUs or it never runs.
+     * Affinity masks and groups do not apply to members, and EDF entities
+     * cannot be members.  An entity must leave its gang before it is
+     * destroyed.
+     */
+    bool set_gang(SchedulingEntity& entity, unsigned int id)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        if ((id != GANG_NONE && (id >= MQ_MAX_GANGS || !gangs[id].used)) || find_edf(entity)) {
+            return false;
+        }
+
+        unsigned int index;
+        Gang *from = find_gang(entity, index);
+        if ((!from && id == GANG_NONE) || (from && from == &gangs[id])) {
+            return true;
+        }
+        if (id != GANG_NONE && gangs[id].nr_members == MQ_MAX_CPUS) {
+            return false;
+        }
+
+        bool runnable;
+        if (from) {
+            runnable = from->runnable[index];
+            gang_block(*from, index);
+
+            // Close up the gap
+            from->nr_members--;
+            from->members[index] = from->members[from->nr_members];
+            from->runnable[index] = from->runnable[from->nr_members];
+        } else {
+            runnable = unlink_from_queue(entity);
+        }
+
+        if (id == GANG_NONE) {
+            if (runnable) {
+                enqueue(place_entity(entity), entity);
+            }
+            return true;
+        }
+
+        Gang& to = gangs[id];
+        to.members[to.nr_members] = &entity;
+        to.runnable[to.nr_members] = runnable;
+        to.nr_runnable += runnable;
+        to.nr_members++;
+        return true;
+    }
+
+    void gang_stats(unsigned int id, GangStats& out)
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+        out = id < MQ_MAX_GANGS ? gangs[id].stats : GangStats { };
+    }
+
+    SchedulingEntity *running_entity() override
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        unsigned int cpu = this_cpu();
+        return cpu < MQ_MAX_CPUS ? cpus[cpu].current : NULL;
+    }
+
+    unsigned int effective_level(const SchedulingEntity& entity) override
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        unsigned int boosted = boost_level(entity);
+        return boosted != PI_NO_LEVEL ? boosted : level_of(entity);
+    }
+
+    /**
+     * Boosts an entity to level, on behalf of source, for as long as source
+     * asks.  The boost only counts while it is above the entity's own level.
+     * A queued entity is added to its CPU's boost list at its new level and
+     * left where it is in its own queue, where it cannot be reached while it
+     * is boosted, so the requeue is a single append.  Once MQ_MAX_BOOSTS are
+     * in force, further boosts are dropped.
+     */
+    void boost(SchedulingEntity& entity, const void *source, unsigned int level) override
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        unsigned int was = boost_level(entity);
+        Boost *b = find_boost(&entity, source);
+        if (!b) {
+            b = find_boost(NULL, NULL);
+            if (!b) {
+                return;
+            }
+            b->entity = &entity;
+            b->source = source;
+            nr_boosts++;
+        }
+
+        b->level = level;
+        rebalance_boost(entity, was);
+    }
+
+    void unboost(SchedulingEntity& entity, const void *source) override
+    {
+        UniqueIRQLock irq;
+        UniqueLock<SchedLock> l(lock);
+
+        Boost *b = find_boost(&entity, source);
+        if (!b) {
+            return;
+        }
+
+        unsigned int was = boost_level(entity);
+        b->entity = NULL;
+        nr_boosts--;
+        rebalance_boost(entity, was);
+    }
+
+private:
+    struct PinnedEntity
+    {
+        SchedulingEntity *entity; // NULL: free table entry
+        CpuMask mask;
+    };
+
+    struct Boost
+    {
+        SchedulingEntity *entity; // NULL: free table entry
+        const void *source;
+        unsigned int level;
+    };
+
+    struct Gang
+    {
+        bool used;
+        SchedulingEntity *members[MQ_MAX_CPUS];
+        bool runnable[MQ_MAX_CPUS];
+        unsigned int nr_members;
+        unsigned int nr_runnable;
+
+        bool active; // holding CPUs for a slot
+        bool joined[MQ_MAX_CPUS]; // members that have run in this slot
+        SchedulingEntity::EntityStartTime slot_start;
+        SchedulingEntity::EntityStartTime slot_end;
+        SchedulingEntity::EntityStartTime next_turn; // before which it waits, unless its CPUs are idle
+
+        GangStats stats;
+    };
+
+    struct CpuHint
+    {
+        const SchedulingEntity *entity;
+        unsigned int cpu;
+    };
+
+    static unsigned int level_of(const SchedulingEntity& entity)
+    {
+        unsigned int level = entity.priority();
+        return level < NUM_PRIORITIES ? level : NUM_PRIORITIES - 1;
+    }
+
+    /*
+     * pick_next_entity() itself: the entity this CPU runs next, or NULL to
+     * go idle.
+     */
+    SchedulingEntity *pick()
+    {
+        UniqueLock<SchedLock> l(lock);
+
+        unsigned int cpu = this_cpu();
+        if (cpu == MQ_MAX_CPUS) {
+            return NULL;
+        }
+
+        CpuRunqueue& rq = cpus[cpu];
+        charge_current(rq);
+
+        SchedulingEntity::EntityStartTime now = sys.runtime();
+        if (policy == MQ_POLICY_POWER && now >= next_pack_review) {
+            review_packing(now);
+        }
+
+        // The EDF class goes first
+        edf_replenish(now);
+        if (rq.nr_heap > 0) {
+            return run(cpu, rq.heap[0]->entity, ROOT_GROUP, 0, rq.heap[0]);
+        }
+
+        if (rq.nr_queued == 0) {
+            pull_entity(cpu);
+        }
+
+        // Then gangs
+        if (nr_gangs > 0) {
+            SchedulingEntity *member = gang_pick(cpu, now);
+            if (member) {
+                run(cpu, member, ROOT_GROUP, 0, NULL);
+                rq.current_gang = true;
+                return member;
+            }
+        }
+
+        // Then the group owed the most CPU time
+        groups.refill(now);
+        unsigned int group = rq.shares.pick(groups, rq.current && !rq.current_edf ? rq.current_group : NO_GROUP);
+
+        // Select its highest priority non-empty run queue.  Lock holders boosted on
+        // behalf of their waiters compete at the level they are boosted to, first
+        // come first served, ahead of the group's own entities there.
+        for (unsigned int level = 0; (group != NO_GROUP || nr_boosts > 0) && level < NUM_PRIORITIES; level++) {
+            if (nr_boosts > 0 && !rq.boosted[level].empty()) {
+                SchedulingEntity *next = rq.boosted[level].first();
+                return run(cpu, next, groups.group_of(*next), level_of(*next), NULL);
+            }
+
+            if (group == NO_GROUP) {
+                continue;
+            }
+            List<SchedulingEntity*>& runqueue = rq.runqueues[group][level];
+            if (runqueue.empty()) {
+                continue;
+            }
+
+            // Rotate only once the head has used up its slice
+            if (rq.slice_left[group][level] == 0) {
+                SchedulingEntity *head = runqueue.first();
+                runqueue.remove(head);
+                runqueue.append(head);
+                rq.slice_left[group][level] = quantum[level];
+            }
+
+            return run(cpu, runqueue.first(), group, level, NULL);
+        }
+
+        rq.current = NULL;
+        rq.current_edf = NULL;
+        if (!rq.idle) {
+            rq.idle = true;
+            rq.idle_since = now;
+            rq.stats.idle_periods++;
+        }
+        return NULL;
+    }
+
+    /*
+     * The index of the CPU we are running on, or MQ_MAX_CPUS for one past the
+     * first MQ_MAX_CPUS, which never runs anything.  CPUs are numbered in the
+     * order they first come through the scheduler, by their local APIC ids,
+     * and apic_cpu maps an id to its number from then on; no CPU state
+     * outside the scheduler is written.  The id is read from the local APIC's
+     * ID register rather than with cpuid, which serialises the CPU and under
+     * a hypervisor traps to it, as this is called once per scheduling call.
+     */
+    unsigned int this_cpu()
+    {
+        uint32_t apic_id = read_apic_id();
+        if (apic_id < MQ_APIC_IDS && apic_cpu[apic_id]) {
+            return apic_cpu[apic_id] - 1;
+        }
+
+        // First time through, or an id too large for apic_cpu
+        for (unsigned int cpu = 0; cpu < nr_cpus; cpu++) {
+            if (cpu_apic_id[cpu] == apic_id) {
+                return cpu;
+            }
+        }
+
+        if (nr_cpus == MQ_MAX_CPUS) {
+            return MQ_MAX_CPUS;
+        }
+        cpu_apic_id[nr_cpus] = apic_id;
+        if (apic_id < MQ_APIC_IDS) {
+            apic_cpu[apic_id] = nr_cpus + 1;
+        }
+        cpus[nr_cpus].online = true;
+        return nr_cpus++;
+    }
+
+    // The full 32-bit id in x2APIC mode, else the 8-bit xAPIC one
+    uint32_t read_apic_id()
+    {
+        uint32_t lo, hi;
+        if (x2apic) {
+            asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(0x802));
+            return lo;
+        }
+        return *lapic_id >> 24;
+    }
+
+    CpuMask allowed_cpus(const SchedulingEntity& entity)
+    {
+        CpuMask online = 0;
+        for (unsigned int cpu = 0; cpu < MQ_MAX_CPUS; cpu++) {
+            if (cpus[cpu].online) {
+                online |= 1u << cpu;
+            }
+        }
+
+        PinnedEntity *pin = find_pin(&entity);
+        if (pin && (pin->mask & online)) {
+            return pin->mask & online;
+        }
+        return online;
+    }
+
+    PinnedEntity *find_pin(const SchedulingEntity *entity)
+    {
+        for (PinnedEntity& pin : pinned) {
+            if (pin.entity == entity) {
+                return &pin;
+            }
+        }
+        return NULL;
+    }
+
+    CpuHint& hint_of(const SchedulingEntity& entity)
+    {
+        uintptr_t key = (uintptr_t)&entity;
+        return hints[((key >> 4) ^ (key >> 12)) % MQ_HINTS];
+    }
+
+    // The CPU the entity last ran on, or MQ_MAX_CPUS if it is not known
+    unsigned int last_cpu(const SchedulingEntity& entity)
+    {
+        const CpuHint& hint = hint_of(entity);
+        return hint.entity == &entity ? hint.cpu : MQ_MAX_CPUS;
+    }
+
+    // The CPUs wakeups may be placed on and idle CPUs pull work to: all of them, unless packing
+    CpuMask in_use() const
+    {
+        if (policy != MQ_POLICY_POWER || nr_in_use >= MQ_MAX_CPUS) {
+            return CPU_MASK_ALL;
+        }
+        return (1u << nr_in_use) - 1;
+    }
+
+    /*
+     * Brings in another CPU if the load has outgrown those in use, or lets
+     * one go if it has fitted on one fewer for PACK_HOLD.  CPUs are numbered
+     * in the order they came online, so those in use are the first few.
+     */
+    void review_packing(SchedulingEntity::EntityStartTime now)
+    {
+        next_pack_review = now + PACK_INTERVAL;
+
+        unsigned int load = 0;
+        for (unsigned int cpu = 0; cpu < MQ_MAX_CPUS; cpu++) {
+            load += cpus[cpu].online ? load_of(cpu) : 0;
+        }
+
+        if (nr_in_use > nr_cpus) {
+            nr_in_use = nr_cpus;
+        }
+
+        if (load > nr_in_use * PACK_SPREAD_LOAD && nr_in_use < nr_cpus) {
+            nr_in_use++;
+            packing.spreads++;
+            low_since = 0;
+        } else if (nr_in_use > 1 && load <= (nr_in_use - 1) * PACK_SHRINK_LOAD) {
+            if (low_since == 0) {
+                low_since = now;
+            } else if (now - low_since >= PACK_HOLD) {
+                nr_in_use--;
+                packing.packs++;
+                low_since = 0;
+            }
+        } else {
+            low_since = 0;
+        }
+    }
+
+    unsigned int load_of(unsigned int cpu) const
+    {
+        return cpus[cpu].nr_queued + cpus[cpu].nr_heap + (cpus[cpu].gang != GANG_NONE);
+    }
+
+    /*
+     * Chooses the CPU a waking entity should queue on: its last CPU if it is
+     * allowed there and that CPU is lightly loaded, else an idle CPU, one
+     * sharing the last CPU's cache domain first, else the least loaded.
+     */
+    unsigned int place_entity(const SchedulingEntity& entity)
+    {
+        CpuMask allowed = allowed_cpus(entity);
+        if (allowed & in_use()) {
+            allowed &= in_use();
+        }
+        unsigned int last = last_cpu(entity);
+        unsigned int chosen;
+
+        if (last != MQ_MAX_CPUS && (allowed & (1u << last)) && load_of(last) <= MQ_AFFINE_LOAD) {
+            chosen = last;
+            cpus[chosen].stats.affine_wakeups++;
+        } else {
+            chosen = MQ_MAX_CPUS;
+            for (unsigned int cpu = 0; cpu < MQ_MAX_CPUS; cpu++) {
+                if ((allowed & (1u << cpu)) && (chosen == MQ_MAX_CPUS || better_placement(cpu, chosen, last))) {
+                    chosen = cpu;
+                }
+            }
+
+            if (last != MQ_MAX_CPUS && chosen != last) {
+                cpus[chosen].stats.migrations++;
+            }
+        }
+
+        cpus[chosen].stats.wakeups++;
+        return chosen;
+    }
+
+    bool better_placement(unsigned int cpu, unsigned int than, unsigned int last) const
+    {
+        unsigned int load = load_of(cpu), than_load = load_of(than);
+        if ((load == 0) != (than_load == 0)) {
+            return load == 0;
+        }
+
+        if (load == 0 && last != MQ_MAX_CPUS) {
+            bool shares = cpus[cpu].cache_domain == cpus[last].cache_domain;
+            bool than_shares = cpus[than].cache_domain == cpus[last].cache_domain;
+            if (shares != than_shares) {
+                return shares;
+            }
+        }
+        return load < than_load;
+    }
+
+    Gang *find_gang(const SchedulingEntity& entity, unsigned int& index)
+    {
+        for (unsigned int id = 0; nr_gangs > 0 && id < MQ_MAX_GANGS; id++) {
+            for (index = 0; index < gangs[id].nr_members; index++) {
+                if (gangs[id].members[index] == &entity) {
+                    return &gangs[id];
+                }
+            }
+        }
+        return NULL;
+    }
+
+    /*
+     * What this CPU should run for the gangs: its member of the gang whose
+     * slot it is part of, or, if it is not part of one, its member of the
+     * next gang that can be dispatched now.  Gangs take turns to be offered
+     * the chance.
+     */
+    SchedulingEntity *gang_pick(unsigned int cpu, SchedulingEntity::EntityStartTime now)
+    {
+        CpuRunqueue& rq = cpus[cpu];
+        if (rq.gang != GANG_NONE) {
+            Gang& gang = gangs[rq.gang];
+            if (now < gang.slot_end) {
+                if (!gang.joined[rq.gang_member]) {
+                    gang.joined[rq.gang_member] = true;
+                    gang.stats.joins++;
+                    gang.stats.join_skew += now - gang.slot_start;
+                }
+                return gang.members[rq.gang_member];
+            }
+            end_slot(gang, now);
+        }
+
+        for (unsigned int i = 0; i < MQ_MAX_GANGS; i++) {
+            unsigned int id = (next_gang + i) % MQ_MAX_GANGS;
+            if (gangs[id].used && dispatch_gang(id, cpu, now)) {
+                next_gang = id + 1;
+                return gang_pick(cpu, now);
+            }
+        }
+        return NULL;
+    }
+
+    /*
+     * Gives every member of a gang a CPU for a slot, this CPU among them, if
+     * it is the gang's turn and there are enough CPUs free of other slots and
+     * of EDF and boosted work.  All of its members must be runnable.
+     */
+    bool dispatch_gang(unsigned int id, unsigned int cpu, SchedulingEntity::EntityStartTime now)
+    {
+        Gang& gang = gangs[id];
+        if (gang.active || gang.nr_runnable == 0) {
+            return false;
+        }
+
+        // This CPU, then idle ones, then busy ones
+        unsigned int chosen[MQ_MAX_CPUS];
+        unsigned int nr_chosen = 0;
+        bool idle = true;
+        for (unsigned int pass = 0; pass < 3 && nr_chosen < gang.nr_members; pass++) {
+            for (unsigned int other = 0; other < MQ_MAX_CPUS && nr_chosen < gang.nr_members; other++) {
+                const CpuRunqueue& rq = cpus[other];
+                bool wanted = pass == 0 ? other == cpu : other != cpu && (rq.nr_queued == 0) == (pass == 1);
+                if (!wanted || !rq.online || rq.gang != GANG_NONE || rq.nr_heap > 0 || has_boosted(rq)) {
+                    continue;
+                }
+                chosen[nr_chosen++] = other;
+                idle = idle && rq.nr_queued == 0;
+            }
+        }
+
+        // Wait for its turn, unless it would only be taking CPUs nothing else wants
+        if (now < gang.next_turn && !(nr_chosen == gang.nr_members && idle)) {
+            return false;
+        }
+
+        if (gang.nr_runnable < gang.nr_members || nr_chosen < gang.nr_members) {
+            if (gang.nr_runnable < gang.nr_members) {
+                gang.stats.partial++;
+            } else {
+                gang.stats.short_of_cpus++;
+            }
+            gang.next_turn = now + GANG_SLICE;
+            return false;
+        }
+
+        for (unsigned int i = 0; i < gang.nr_members; i++) {
+            cpus[chosen[i]].gang = id;
+            cpus[chosen[i]].gang_member = i;
+            gang.joined[i] = false;
+        }
+        gang.active = true;
+        gang.slot_start = now;
+        gang.slot_end = now + GANG_SLICE;
+        gang.stats.dispatched++;
+        return true;
+    }
+
+    /*
+     * Releases a gang's CPUs.  A CPU still running a member carries on until
+     * its next scheduling event, which the timer brings at the slot's end
+     * (see next_preemption()).
+     */
+    void end_slot(Gang& gang, SchedulingEntity::EntityStartTime now)
+    {
+        unsigned int id = &gang - gangs;
+        for (CpuRunqueue& rq : cpus) {
+            if (rq.gang == id) {
+                rq.gang = GANG_NONE;
+            }
+        }
+
+        gang.active = false;
+        gang.next_turn = now + (now - gang.slot_start);
+    }
+
+    // A member can no longer run, and the rest cannot run without it
+    void gang_block(Gang& gang, unsigned int index)
+    {
+        if (!gang.runnable[index]) {
+            return;
+        }
+
+        gang.runnable[index] = false;
+        gang.nr_runnable--;
+        for (CpuRunqueue& rq : cpus) {
+            if (rq.current == gang.members[index]) {
+                rq.current = NULL;
+            }
+        }
+
+        if (gang.active) {
+            gang.stats.broken++;
+            end_slot(gang, sys.runtime());
+        }
+    }
+
+    static bool has_boosted(const CpuRunqueue& rq)
+    {
+        for (unsigned int level = 0; level < NUM_PRIORITIES; level++) {
+            if (!rq.boosted[level].empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Boost *find_boost(const SchedulingEntity *entity, const void *source)
+    {
+        for (Boost& b : boosts) {
+            if (b.entity == entity && (b.source == source || !entity)) {
+                return &b;
+            }
+        }
+        return NULL;
+    }
+
+    // The most urgent level the entity is boosted to, or PI_NO_LEVEL if none is above its own
+    unsigned int boost_level(const SchedulingEntity& entity) const
+    {
+        unsigned int level = level_of(entity);
+        if (nr_boosts == 0) {
+            return PI_NO_LEVEL;
+        }
+
+        for (const Boost& b : boosts) {
+            if (b.entity == &entity && b.level < level) {
+                level = b.level;
+            }
+        }
+        return level < level_of(entity) ? level : PI_NO_LEVEL;
+    }
+
+    // Moves a queued entity between boost lists after its boost level has changed from was
+    void rebalance_boost(SchedulingEntity& entity, unsigned int was)
+    {
+        unsigned int now = boost_level(entity);
+        if (now == was || find_edf(entity)) {
+            return;
+        }
+
+        // A lock holder is most likely running, else it has been preempted where it last ran
+        unsigned int cpu = MQ_MAX_CPUS;
+        for (unsigned int i = 0; i < MQ_MAX_CPUS; i++) {
+            if (cpus[i].current == &entity) {
+                cpu = i;
+                break;
+            }
+        }
+        if (cpu == MQ_MAX_CPUS) {
+            cpu = queued_on(entity);
+        }
+        if (cpu == MQ_MAX_CPUS) {
+            // Not runnable: enqueue() puts it on the right list when it is
+            return;
+        }
+
+        if (was != PI_NO_LEVEL) {
+            cpus[cpu].boosted[was].remove(&entity);
+        }
+        if (now != PI_NO_LEVEL) {
+            cpus[cpu].boosted[now].append(&entity);
+        }
+    }
+
+    void enqueue(unsigned int cpu, SchedulingEntity& entity)
+    {
+        CpuRunqueue& rq = cpus[cpu];
+        unsigned int group = groups.group_of(entity);
+        unsigned int level = level_of(entity);
+        if (rq.runqueues[group][level].empty()) {
+            rq.slice_left[group][level] = quantum[level];
+        }
+        rq.runqueues[group][level].append(&entity);
+        rq.nr_queued++;
+        rq.shares.enqueue(groups, group);
+
+        unsigned int boosted = boost_level(entity);
+        if (boosted != PI_NO_LEVEL) {
+            rq.boosted[boosted].append(&entity);
+        }
+    }
+
+    // Records what a CPU is about to run, and returns it
+    SchedulingEntity *run(unsigned int cpu, SchedulingEntity *entity, unsigned int group, unsigned int level,
+                          EdfEntity *edf)
+    {
+        CpuRunqueue& rq = cpus[cpu];
+        rq.current = entity;
+        rq.current_group = group;
+        rq.current_level = level;
+        rq.current_edf = edf;
+        rq.current_gang = false;
+        rq.current_runtime = entity->cpu_runtime();
+
+        if (rq.idle) {
+            SchedulingEntity::EntityRuntime idle = sys.runtime() - rq.idle_since;
+            rq.idle = false;
+            rq.stats.idle_ns += idle;
+            rq.stats.longest_idle = idle > rq.stats.longest_idle ? idle : rq.stats.longest_idle;
+        }
+
+        CpuHint& hint = hint_of(*entity);
+        hint.entity = entity;
+        hint.cpu = cpu;
+        return entity;
+    }
+
+    /*
+     * A CPU with nothing queued takes a waiting entity from the busiest other
+     * CPU that has one it may run, from the lowest level there, since the
+     * higher levels will get their turn soonest where they are.
+     */
+    void pull_entity(unsigned int cpu)
+    {
+        // A CPU the power policy has let go stays idle
+        if (!(in_use() & (1u << cpu))) {
+            return;
+        }
+
+        // and one it has let go hands over even its last waiting entity
+        unsigned int busiest = MQ_MAX_CPUS;
+        for (unsigned int other = 0; other < MQ_MAX_CPUS; other++) {
+            unsigned int spare = in_use() & (1u << other) ? 2 : 1;
+            if (other != cpu && cpus[other].nr_queued >= spare &&
+                (busiest == MQ_MAX_CPUS || cpus[other].nr_queued > cpus[busiest].nr_queued)) {
+                busiest = other;
+            }
+        }
+        if (busiest == MQ_MAX_CPUS) {
+            return;
+        }
+
+        CpuRunqueue& from = cpus[busiest];
+        for (unsigned int level = NUM_PRIORITIES; level-- > 0; ) {
+            for (unsigned int group = 0; group < MAX_GROUPS; group++) {
+                for (SchedulingEntity *queued : from.runqueues[group][level]) {
+                    if (queued == from.current || !(allowed_cpus(*queued) & (1u << cpu)) ||
+                        boost_level(*queued) != PI_NO_LEVEL) {
+                        continue;
+                    }
+
+                    unlink_from(busiest, group, level, *queued);
+                    enqueue(cpu, *queued);
+                    cpus[cpu].stats.migrations++;
+                    cpus[cpu].stats.pulls++;
+                    return;
+                }
+            }
+        }
+    }
+
+    // Takes the CPU time the entity a CPU last picked has used since from its level's slice, or its EDF budget
+    void charge_current(CpuRunqueue& rq)
+    {
+        if (!rq.current) {
+            return;
+        }
+
+        SchedulingEntity::EntityRuntime used = rq.current->cpu_runtime() - rq.current_runtime;
+        rq.current_runtime = rq.current->cpu_runtime();
+
+        if (rq.current_edf) {
+            if (rq.current_edf->runnable && !rq.current_edf->throttled) {
+                edf_charge(*rq.current_edf, used);
+            }
+            return;
+        }
+        if (rq.current_gang) {
+            return;
+        }
+
+        unsigned int group = rq.current_group;
+        unsigned int level = rq.current_level;
+        rq.shares.charge(groups, group, used);
+        groups.charge(group, used);
+
+        List<SchedulingEntity*>& runqueue = rq.runqueues[group][level];
+        if (runqueue.empty() || runqueue.first() != rq.current) {
+            return;
+        }
+        rq.slice_left[group][level] = used < rq.slice_left[group][level] ? rq.slice_left[group][level] - used : 0;
+    }
+
+    // The CPU whose queues hold a runnable entity, or MQ_MAX_CPUS if none do
+    unsigned int queued_on(const SchedulingEntity& entity)
+    {
+        // Most likely the one it last ran on
+        unsigned int last = last_cpu(entity);
+        unsigned int group = groups.group_of(entity);
+        unsigned int level = level_of(entity);
+        for (unsigned int i = 0; i <= MQ_MAX_CPUS; i++) {
+            unsigned int cpu = i == 0 ? last : i - 1;
+            if (cpu == MQ_MAX_CPUS || (i > 0 && cpu == last)) {
+                continue;
+            }
+
+            for (SchedulingEntity *queued : cpus[cpu].runqueues[group][level]) {
+                if (queued == &entity) {
+                    return cpu;
+                }
+            }
+        }
+        return MQ_MAX_CPUS;
+    }
+
+    // Removes a runnable entity from whichever queue holds it; false if none does
+    bool unlink_from_queue(SchedulingEntity& entity)
+    {
+        unsigned int cpu = queued_on(entity);
+        if (cpu == MQ_MAX_CPUS) {
+            return false;
+        }
+
+        CpuRunqueue& rq = cpus[cpu];
+        if (rq.current == &entity) {
+            charge_current(rq);
+            rq.current = NULL;
+        }
+
+        unlink_from(cpu, groups.group_of(entity), level_of(entity), entity);
+        return true;
+    }
+
+    void unlink_from(unsigned int cpu, unsigned int group, unsigned int level, SchedulingEntity& entity)
+    {
+        CpuRunqueue& rq = cpus[cpu];
+        List<SchedulingEntity*>& runqueue = rq.runqueues[group][level];
+
+        // Whoever is next in line starts a fresh slice
+        if (runqueue.first() == &entity) {
+            rq.slice_left[group][level] = quantum[level];
+        }
+        runqueue.remove(&entity);
+        rq.nr_queued--;
+        rq.shares.dequeue(groups, group);
+
+        unsigned int boosted = boost_level(entity);
+        if (boosted != PI_NO_LEVEL) {
+            rq.boosted[boosted].remove(&entity);
+        }
+    }
+
+    EdfEntity *find_edf(const SchedulingEntity& entity)
+    {
+        for (EdfEntity& edf : edf_entities) {
+            if (edf.entity == &entity) {
+                return &edf;
+            }
+        }
+        return NULL;
+    }
+
+    EdfEntity *find_edf_slot()
+    {
+        for (EdfEntity& edf : edf_entities) {
+            if (!edf.entity) {
+                return &edf;
+            }
+        }
+        return NULL;
+    }
+
+    // Starts a period at start, with a full budget
+    static void edf_start_period(EdfEntity& edf, SchedulingEntity::EntityStartTime start)
+    {
+        edf.budget = edf.runtime;
+        edf.abs_deadline = start + edf.deadline;
+        edf.next_period = start + edf.period;
+        edf.throttled = false;
+        edf.deadline_passed = false;
+    }
+
+    /*
+     * An EDF entity becomes runnable.  If its next period has begun it
+     * starts a new one there and then; otherwise it carries on with what is
+     * left of the current one, so sleeping never earns it more than its
+     * runtime per period.  A throttled entity stays throttled until
+     * edf_replenish() starts its next period, and one whose deadline passed
+     * while it slept queues as though its deadline were the next period's
+     * start, behind the entities whose deadlines are still ahead.
+     */
+    void edf_wakeup(EdfEntity& edf, SchedulingEntity::EntityStartTime now)
+    {
+        if (now >= edf.next_period) {
+            edf_start_period(edf, now);
+        } else if (!edf.throttled && now >= edf.abs_deadline) {
+            edf.abs_deadline = edf.next_period;
+            edf.deadline_passed = true;
+        }
+
+        edf.runnable = true;
+        if (!edf.throttled) {
+            heap_insert(cpus[edf.cpu], edf);
+        }
+    }
+
+    // The running EDF entity has used some CPU time; with its budget gone it is throttled
+    void edf_charge(EdfEntity& edf, SchedulingEntity::EntityRuntime used)
+    {
+        edf.budget = used < edf.budget ? edf.budget - used : 0;
+        if (edf.budget == 0) {
+            heap_remove(cpus[edf.cpu], edf);
+            edf.throttled = true;
+            edf_stats.throttled++;
+        }
+    }
+
+    /*
+     * A runnable entity still owed CPU time at its deadline has missed it.
+     * It may use the rest of its budget until its next period begins, but
+     * queues as though its deadline were then, so the entities still on
+     * time go first.  Once the next period begins every entity gets its
+     * budget back, throttled or not; never before, which is what keeps each
+     * within its reserved runtime per period.
+     */
+    void edf_replenish(SchedulingEntity::EntityStartTime now)
+    {
+        for (EdfEntity& edf : edf_entities) {
+            if (!edf.entity || !edf.runnable) {
+                continue;
+            }
+
+            if (!edf.throttled && !edf.deadline_passed && now >= edf.abs_deadline) {
+                edf_stats.missed++;
+                edf.abs_deadline = edf.next_period;
+                edf.deadline_passed = true;
+                heap_fix(cpus[edf.cpu], edf.heap_index);
+            }
+
+            if (now >= edf.next_period) {
+                bool throttled = edf.throttled;
+
+                // Periods follow on from each other, unless whole ones were slept through
+                edf_start_period(edf, edf.next_period + edf.period > now ? edf.next_period : now);
+                if (throttled) {
+                    heap_insert(cpus[edf.cpu], edf);
+                } else {
+                    heap_fix(cpus[edf.cpu], edf.heap_index);
+                }
+            }
+        }
+    }
+
+    // Each CPU's binary min-heap of runnable, unthrottled EDF entities keyed on absolute deadline
+    static void heap_swap(CpuRunqueue& rq, unsigned int a, unsigned int b)
+    {
+        EdfEntity *tmp = rq.heap[a];
+        rq.heap[a] = rq.heap[b];
+        rq.heap[b] = tmp;
+        rq.heap[a]->heap_index = a;
+        rq.heap[b]->heap_index = b;
+    }
+
+    static void heap_fix(CpuRunqueue& rq, unsigned int i)
+    {
+        while (i > 0 && rq.heap[i]->abs_deadline < rq.heap[(i - 1) / 2]->abs_deadline) {
+            heap_swap(rq, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+
+        while (true) {
+            unsigned int smallest = i;
+            unsigned int left = 2 * i + 1;
+            unsigned int right = 2 * i + 2;
+            if (left < rq.nr_heap && rq.heap[left]->abs_deadline < rq.heap[smallest]->abs_deadline) {
+                smallest = left;
+            }
+            if (right < rq.nr_heap && rq.heap[right]->abs_deadline < rq.heap[smallest]->abs_deadline) {
+                smallest = right;
+            }
+            if (smallest == i) {
+                break;
+            }
+            heap_swap(rq, i, smallest);
+            i = smallest;
+        }
+    }
+
+    static void heap_insert(CpuRunqueue& rq, EdfEntity& edf)
+    {
+        edf.heap_index = rq.nr_heap;
+        rq.heap[rq.nr_heap++] = &edf;
+        heap_fix(rq, edf.heap_index);
+    }
+
+    static void heap_remove(CpuRunqueue& rq, EdfEntity& edf)
+    {
+        unsigned int i = edf.heap_index;
+        rq.nr_heap--;
+        if (i != rq.nr_heap) {
+            heap_swap(rq, i, rq.nr_heap);
+            heap_fix(rq, i);
+        }
+    }
+
+    SchedLock lock;
+    SchedGroups groups;
+
+    SchedulingEntity::EntityRuntime quantum[NUM_PRIORITIES] = {
+        QUANTUM_REALTIME, QUANTUM_INTERACTIVE, QUANTUM_NORMAL, QUANTUM_DAEMON
+    };
+
+    // The CPUs, numbered by this_cpu() through their local APIC ids
+    CpuRunqueue cpus[MQ_MAX_CPUS];
+    uint32_t cpu_apic_id[MQ_MAX_CPUS] = { }; // of each CPU numbered so far
+    uint8_t apic_cpu[MQ_APIC_IDS] = { }; // 0: not numbered yet, else CPU number + 1
+    unsigned int nr_cpus = 0;
+    bool x2apic = false;
+    volatile uint32_t *lapic_id = NULL; // the xAPIC ID register
+
+    PinnedEntity pinned[MQ_MAX_PINNED] = { };
+    Boost boosts[MQ_MAX_BOOSTS] = { };
+    unsigned int nr_boosts = 0;
+
+    // The placement policy, and under MQ_POLICY_POWER how many CPUs it is using
+    unsigned int policy = MQ_POLICY_PERFORMANCE;
+    unsigned int nr_in_use = MQ_MAX_CPUS;
+    SchedulingEntity::EntityStartTime low_since = 0; // since when the load would have fitted on one fewer, or 0
+    SchedulingEntity::EntityStartTime next_pack_review = 0;
+    PackStats packing = { };
+
+    Gang gangs[MQ_MAX_GANGS] = { };
+    unsigned int nr_gangs = 0;
+    unsigned int next_gang = 0; // the gang offered the next slot first
+    CpuHint hints[MQ_HINTS] = { };
+
+    // The EDF class
+    EdfEntity edf_entities[EDF_MAX_ENTITIES] = { };
+    EdfStats edf_stats = { };
 };
 
 // Register the scheduler
@@ -0,0 +1,157 @@
+#pragma once
+#include <infos/kernel/sched.h>
+
+using namespace infos::kernel;
+
+// Priority levels, SchedulingEntityPriority::REALTIME (0) to DAEMON (3)
+#define PI_LEVELS 4
+
+// effective_level() of nothing, and boost levels that boost nothing
+#define PI_NO_LEVEL PI_LEVELS
+
+// Spins between a waiter's checks for a boost of its own, which take the scheduler's lock
+#define PI_RECHECK_SPINS 64
+
+/**
+ * What a scheduler offers PIMutex for priority inheritance.  A boost is keyed
+ * by its source, the mutex whose waiters asked for it, so an entity holding
+ * several contended mutexes runs at the most urgent level any of them asks
+ * for, and keeps the others' boosts when it releases one.
+ */
+class PriorityInheritance
+{
+public:
+    virtual ~PriorityInheritance() { }
+
+    // The entity running on this CPU
+    virtual SchedulingEntity *running_entity() = 0;
+
+    // The level the entity is scheduled at: its own priority, or a boost if that is higher
+    virtual unsigned int effective_level(const SchedulingEntity& entity) = 0;
+
+    // Boosts the entity to level on behalf of source, replacing any boost source gave before
+    virtual void boost(SchedulingEntity& entity, const void *source, unsigned int level) = 0;
+
+    // Drops the boost source gave the entity, if any
+    virtual void unboost(SchedulingEntity& entity, const void *source) = 0;
+};
+
+// The active scheduler, if it supports priority inheritance; set by it in init()
+extern PriorityInheritance *pi_scheduler;
+
+/**
+ * A spinning mutex with priority inheritance.  While anything waits for it,
+ * its owner is boosted to the most urgent waiter's level, so that work at the
+ * levels in between cannot keep the owner, and with it the waiter, off the
+ * CPU.  Waiters follow boosts given to themselves, which carries a boost along
+ * a chain of owners each waiting for the next.  Without a scheduler that
+ * supports it, it is a plain spinning mutex.
+ */
+class PIMutex
+{
+public:
+    void lock()
+    {
+        SchedulingEntity *self = pi_scheduler ? pi_scheduler->running_entity() : NULL;
+
+        guard_lock();
+        if (!locked) {
+            acquire(self);
+            guard_unlock();
+            return;
+        }
+
+        unsigned int level = self ? pi_scheduler->effective_level(*self) : PI_NO_LEVEL;
+        waiting[level]++;
+        update_boost();
+        guard_unlock();
+
+        for (unsigned int spins = 1; ; spins++) {
+            asm volatile("pause");
+            if (__atomic_load_n(&locked, __ATOMIC_RELAXED) && spins % PI_RECHECK_SPINS != 0) {
+                continue;
+            }
+
+            guard_lock();
+            if (!locked) {
+                waiting[level]--;
+                acquire(self);
+                guard_unlock();
+                return;
+            }
+
+            // Pass on any boost this waiter has been given meanwhile
+            unsigned int now = self ? pi_scheduler->effective_level(*self) : PI_NO_LEVEL;
+            if (now != level) {
+                waiting[level]--;
+                waiting[now]++;
+                level = now;
+                update_boost();
+            }
+            guard_unlock();
+        }
+    }
+
+    void unlock()
+    {
+        guard_lock();
+        SchedulingEntity *was = boosted ? owner : NULL;
+        __atomic_store_n(&locked, false, __ATOMIC_RELAXED);
+        owner = NULL;
+        boosted = false;
+        guard_unlock();
+
+        if (was) {
+            pi_scheduler->unboost(*was, this);
+        }
+    }
+
+    bool is_locked() const { return __atomic_load_n(&locked, __ATOMIC_RELAXED); }
+
+private:
+    void acquire(SchedulingEntity *self)
+    {
+        __atomic_store_n(&locked, true, __ATOMIC_RELAXED);
+        owner = self;
+        boosted = false;
+
+        // The new owner inherits from whoever is still waiting
+        update_boost();
+    }
+
+    // Boosts the owner to the most urgent waiting level, or drops its boost if nothing waits
+    void update_boost()
+    {
+        if (!owner) {
+            return;
+        }
+
+        for (unsigned int level = 0; level < PI_NO_LEVEL; level++) {
+            if (waiting[level] > 0) {
+                pi_scheduler->boost(*owner, this, level);
+                boosted = true;
+                return;
+            }
+        }
+
+        if (boosted) {
+            pi_scheduler->unboost(*owner, this);
+            boosted = false;
+        }
+    }
+
+    void guard_lock()
+    {
+        while (__atomic_test_and_set(&guard, __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+
+    void guard_unlock() { __atomic_clear(&guard, __ATOMIC_RELEASE); }
+
+    bool guard = false; // covers the fields below
+    bool locked = false; // also read without the guard, by spinning waiters
+    SchedulingEntity *owner = NULL; // NULL if locked outside any entity, or without a PI scheduler
+    bool boosted = false; // whether this mutex has a boost on the owner
+    unsigned int waiting[PI_LEVELS + 1] = { }; // waiters by effective level; the last is those that have none
+};